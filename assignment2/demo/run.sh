@@ -3,7 +3,7 @@
 cd 2020CS10869_proj
 mkdir bin obj output
 make
-./bin/server_udp sth&
+./bin/server sth&
 pid=$!
-./bin/client_udp -o output.txt
+./bin/client -o output.txt
 kill -15 $pid
\ No newline at end of file
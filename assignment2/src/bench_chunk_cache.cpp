@@ -0,0 +1,163 @@
+// Microbenchmark for the server's chunk cache: the old LRUCache (two
+// unordered_maps and a std::list) against every ChunkCache policy (see
+// chunk_cache.hpp).
+//
+// All of them replay the same trace of chunk ids the way the server uses its
+// cache: access() every id, and insert it on a miss. Ids are drawn from a zipf
+// distribution over -n chunks (-s 0 makes it uniform), and the cache holds -c
+// chunks. The trace is generated before the clock starts, and values are
+// shared_ptrs to preallocated chunks, so only the cache itself is timed.
+//
+// The second trace mixes in a late joiner: a fraction -f of the requests walk
+// the whole file in order, which is what pure LRU handles worst.
+
+#include <getopt.h>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <memory>
+#include <random>
+#include <iostream>
+#include <algorithm>
+
+#include "protocol.hpp"
+#include "lru_cache.hpp"
+#include "chunk_cache.hpp"
+
+using bench_clock = std::chrono::steady_clock;
+
+struct Result {
+    double secs;
+    uint64_t hits;
+};
+
+static std::vector<uint32_t> make_trace(uint32_t n_keys, size_t n_ops, double skew, double scan_fraction) {
+    // cdf[k] = P(id <= k), with P(id = k) proportional to 1/(k+1)^skew
+    std::vector<double> cdf(n_keys);
+    double sum = 0;
+    for (uint32_t k=0; k<n_keys; k++) {
+        sum += 1.0/std::pow(k+1, skew);
+        cdf[k] = sum;
+    }
+
+    // ids are shuffled, so popular chunks aren't all next to each other
+    std::vector<uint32_t> ids(n_keys);
+    for (uint32_t k=0; k<n_keys; k++) ids[k] = k;
+    std::mt19937 rng{42};
+    std::shuffle(ids.begin(), ids.end(), rng);
+
+    std::uniform_real_distribution<double> u(0, sum);
+    std::uniform_real_distribution<double> coin(0, 1);
+    std::vector<uint32_t> trace(n_ops);
+    uint32_t scan = 0;
+    for (auto& id : trace) {
+        if (coin(rng) < scan_fraction) {
+            id = scan++ % n_keys;
+            continue;
+        }
+        size_t k = std::lower_bound(cdf.begin(), cdf.end(), u(rng)) - cdf.begin();
+        id = ids[std::min<size_t>(k, n_keys-1)];
+    }
+    return trace;
+}
+
+static Result run_lru(const std::vector<uint32_t>& trace, const std::vector<std::shared_ptr<FileChunk>>& chunks,
+                      size_t cache_chunks) {
+    LRUCache<uint32_t,std::shared_ptr<FileChunk>> cache{cache_chunks};
+    Result r{0, 0};
+
+    auto start = bench_clock::now();
+    for (uint32_t id : trace) {
+        std::shared_ptr<FileChunk> c = cache.access(id);
+        if (c != nullptr) {
+            r.hits++;
+        }
+        else {
+            cache.insert(id, chunks[id]);
+        }
+    }
+    r.secs = std::chrono::duration<double>(bench_clock::now()-start).count();
+    return r;
+}
+
+static Result run_policy(CachePolicy p, const std::vector<uint32_t>& trace,
+                         const std::vector<std::shared_ptr<FileChunk>>& chunks, size_t cache_chunks) {
+    auto cache = make_chunk_cache<uint32_t,std::shared_ptr<FileChunk>>(p, cache_chunks*DEFAULT_CHUNK_SIZE, cache_chunks);
+    Result r{0, 0};
+
+    auto start = bench_clock::now();
+    for (uint32_t id : trace) {
+        const std::shared_ptr<FileChunk>* c = cache->access(id);
+        if (c != nullptr) {
+            r.hits++;
+        }
+        else {
+            cache->insert(id, chunks[id], chunks[id]->size);
+        }
+    }
+    r.secs = std::chrono::duration<double>(bench_clock::now()-start).count();
+    return r;
+}
+
+static void report(const char* name, const Result& r, size_t n_ops) {
+    printf("%-10s %8.1f ns/op  %6.2f Mops/s  hit rate %5.1f%%\n",
+           name, 1e9*r.secs/n_ops, n_ops/r.secs/1e6, 100.0*r.hits/n_ops);
+}
+
+void print_usage() {
+    std::cout << "usage: bench_chunk_cache [-n num_chunks] [-c cache_chunks] [-o ops] [-s zipf_skew] [-f scan_fraction]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+
+    int n_keys = 100000;
+    int cache_chunks = 10000;
+    int n_ops = 5000000;
+    double skew = 0.99;
+    double scan_fraction = 0.25;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:o:s:f:")) != -1) {
+        switch (opt) {
+            case 'n': n_keys = std::stoi(std::string(optarg)); break;
+            case 'c': cache_chunks = std::stoi(std::string(optarg)); break;
+            case 'o': n_ops = std::stoi(std::string(optarg)); break;
+            case 's': skew = std::stod(std::string(optarg)); break;
+            case 'f': scan_fraction = std::stod(std::string(optarg)); break;
+            default:
+                print_usage();
+                return 0;
+        }
+    }
+    if (n_keys <= 0 or cache_chunks <= 0 or n_ops <= 0) {
+        print_usage();
+        return 0;
+    }
+
+    std::vector<std::shared_ptr<FileChunk>> chunks;
+    for (int k=0; k<n_keys; k++) {
+        chunks.push_back(make_chunk(DEFAULT_CHUNK_SIZE));
+        chunks.back()->id = k;
+        chunks.back()->size = DEFAULT_CHUNK_SIZE;
+    }
+    const CachePolicy policies[] = { CachePolicy::LRU, CachePolicy::CLOCK, CachePolicy::ARC,
+                                     CachePolicy::S3FIFO, CachePolicy::TINYLFU };
+
+    for (double f : { 0.0, scan_fraction }) {
+        std::vector<uint32_t> trace = make_trace(n_keys, n_ops, skew, f);
+        printf("%d chunks, cache of %d, %d ops, zipf skew %.2f, %.0f%% scan\n",
+               n_keys, cache_chunks, n_ops, skew, 100*f);
+
+        // the first round warms up the allocator and the caches
+        run_lru(trace, chunks, cache_chunks);
+        report("LRUCache", run_lru(trace, chunks, cache_chunks), n_ops);
+        for (CachePolicy p : policies) {
+            report(cache_policy_name(p), run_policy(p, trace, chunks, cache_chunks), n_ops);
+        }
+        if (f == scan_fraction) break;
+    }
+
+    return 0;
+}
@@ -0,0 +1,243 @@
+// Microbenchmark for the server's chunk buffers: make_chunk/copy_chunk
+// (a shared_ptr with its own control block) against ChunkPool/ChunkHandle.
+//
+// Every thread does what a shard does with a chunk that came back from a
+// client: copy it out of the receive buffer, put it in the shared cache, and
+// queue it for a client, where it stays until -q more chunks were queued
+// after it (i.e. sent). Chunk ids are uniform over -n chunks and the cache
+// holds -c of them, so most inserts evict something, and chunks are let go of
+// by whichever thread evicts or sends them last.
+//
+// Global operator new is counted, so the allocations per chunk in the timed
+// run (after a warm-up run) are exact; for the pool that includes its slabs.
+//
+// On linux the pooled chunks are then sent once more through io_uring, the
+// way the server's connections hand them to the ring, to count what the send
+// path allocates per chunk on top of that.
+
+#include <getopt.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iostream>
+
+#include "protocol.hpp"
+#include "chunk_pool.hpp"
+#include "concurrent_chunk_cache.hpp"
+#include "event_queue.hpp"
+
+static std::atomic<uint64_t> g_allocs{0};
+
+// (not inlined, or gcc sees a call with the biggest size_t there is on some
+// error path and warns about it)
+__attribute__((noinline)) void* operator new(size_t n) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(n > 0 ? n : 1);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+// they're all malloc'd, but gcc only sees that new[] hands out what new
+// returned and then warns when delete[] frees it
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new[](size_t n) {
+    return operator new(n);
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+using bench_clock = std::chrono::steady_clock;
+
+struct Result {
+    double secs;
+    uint64_t allocs;
+};
+
+// V is the chunk type, copy(c) makes one out of a receive buffer
+template<typename V, typename Copy>
+static Result run(Copy copy, uint32_t n_chunks, size_t cache_chunks, size_t queue_depth,
+                  size_t n_threads, size_t ops_per_thread) {
+    ConcurrentChunkCache<uint32_t,V> cache{CachePolicy::LRU, cache_chunks*DEFAULT_CHUNK_SIZE,
+                                           cache_chunks, n_threads};
+
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+    for (size_t t=0; t<n_threads; t++) {
+        threads.emplace_back([&,t]() {
+            std::mt19937 rng(t+1);
+            std::uniform_int_distribution<uint32_t> pick(0, n_chunks-1);
+            std::shared_ptr<FileChunk> recv = make_chunk(DEFAULT_CHUNK_SIZE);
+            recv->size = DEFAULT_CHUNK_SIZE;
+            // (a ring rather than a deque, which would allocate a block
+            // every so many chunks)
+            std::vector<V> queue(queue_depth+1);
+            while (!go) std::this_thread::yield();
+
+            for (size_t i=0; i<ops_per_thread; i++) {
+                recv->id = pick(rng);
+                V c = copy(*recv);
+                cache.insert(c->id, c, c->size);
+                // replaces (sends) the one queued queue_depth chunks ago
+                queue[i % queue.size()] = std::move(c);
+            }
+        });
+    }
+
+    uint64_t allocs = g_allocs;
+    auto start = bench_clock::now();
+    go = true;
+    for (auto& t : threads) {
+        t.join();
+    }
+    Result r;
+    r.secs = std::chrono::duration<double>(bench_clock::now()-start).count();
+    r.allocs = g_allocs - allocs;
+    return r;
+}
+
+#ifdef HAVE_IO_URING
+// n_sends of the pool's chunks through one ring, to a socket on loopback
+// that nobody reads (so most of them are dropped, which doesn't matter
+// here). Like the server, the send holds on to the chunk's ref until it
+// completes. Returns false if there is no io_uring.
+static bool run_uring_sends(ChunkPool& pool, size_t n_sends, Result& r) {
+    UringEventQueue uring;
+    if (!uring.ok()) return false;
+
+    int rx = socket(AF_INET, SOCK_DGRAM, 0);
+    int tx = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr{};
+    socklen_t len = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(rx, (struct sockaddr*)&addr, sizeof(addr));
+    getsockname(rx, (struct sockaddr*)&addr, &len);
+
+    std::shared_ptr<FileChunk> recv = make_chunk(DEFAULT_CHUNK_SIZE);
+    recv->size = DEFAULT_CHUNK_SIZE;
+    std::vector<ChunkHandle> chunks;
+    for (uint32_t i=0; i<64; i++) {
+        recv->id = i;
+        chunks.push_back(pool.copy(*recv));
+    }
+
+    uint64_t allocs = g_allocs;
+    auto start = bench_clock::now();
+    size_t queued = 0, done = 0;
+    while (done < n_sends) {
+        while (queued < n_sends and uring.queue_send(tx, ChunkRef(chunks[queued % chunks.size()]), &addr, queued)) {
+            queued++;
+        }
+        uring.get_events();
+        done += uring.completions().size();
+    }
+    r.secs = std::chrono::duration<double>(bench_clock::now()-start).count();
+    r.allocs = g_allocs - allocs;
+
+    uring.close();
+    close(rx);
+    close(tx);
+    return true;
+}
+#endif
+
+static void report(const char* name, const Result& r, size_t n_ops) {
+    printf("%-12s %8.1f ns/chunk  %6.2f Mchunks/s  %6.3f allocations/chunk\n",
+           name, 1e9*r.secs/n_ops, n_ops/r.secs/1e6, (double)r.allocs/n_ops);
+}
+
+void print_usage() {
+    std::cout << "usage: bench_chunk_pool [-n num_chunks] [-c cache_chunks] [-q queue_depth] [-t threads] [-o ops_per_thread]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+
+    int n_chunks = 100000;
+    int cache_chunks = 10000;
+    int queue_depth = 256;
+    int n_threads = 2;
+    int n_ops = 1000000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:q:t:o:")) != -1) {
+        switch (opt) {
+            case 'n': n_chunks = std::stoi(std::string(optarg)); break;
+            case 'c': cache_chunks = std::stoi(std::string(optarg)); break;
+            case 'q': queue_depth = std::stoi(std::string(optarg)); break;
+            case 't': n_threads = std::stoi(std::string(optarg)); break;
+            case 'o': n_ops = std::stoi(std::string(optarg)); break;
+            default:
+                print_usage();
+                return 0;
+        }
+    }
+    if (n_chunks <= 0 or cache_chunks <= 0 or queue_depth < 0 or n_threads <= 0 or n_ops <= 0) {
+        print_usage();
+        return 0;
+    }
+
+    printf("%d chunks of %u bytes, cache of %d, %d queued per thread, %d threads x %d chunks\n",
+           n_chunks, DEFAULT_CHUNK_SIZE, cache_chunks, queue_depth, n_threads, n_ops);
+    size_t total = (size_t)n_threads*n_ops;
+
+    auto shared = [](const FileChunk& c) { return copy_chunk(c); };
+    // the first round warms up the allocator
+    run<std::shared_ptr<FileChunk>>(shared, n_chunks, cache_chunks, queue_depth, n_threads, n_ops);
+    report("shared_ptr", run<std::shared_ptr<FileChunk>>(shared, n_chunks, cache_chunks, queue_depth,
+                                                         n_threads, n_ops), total);
+
+    // the pool outlives both runs, like the server's does; the first one
+    // fills it up
+    ChunkPool pool(DEFAULT_CHUNK_SIZE);
+    auto pooled = [&pool](const FileChunk& c) { return pool.copy(c); };
+    run<ChunkHandle>(pooled, n_chunks, cache_chunks, queue_depth, n_threads, n_ops);
+    uint64_t slabs = pool.slab_allocations();
+    report("ChunkPool", run<ChunkHandle>(pooled, n_chunks, cache_chunks, queue_depth, n_threads, n_ops), total);
+    printf("ChunkPool allocated %lu slabs after warming up (%lu in total, at most %lu chunks in use)\n",
+           (unsigned long)(pool.slab_allocations()-slabs), (unsigned long)pool.slab_allocations(),
+           (unsigned long)pool.high_water());
+
+#ifdef HAVE_IO_URING
+    Result r;
+    if (run_uring_sends(pool, n_ops, r)) {
+        report("io_uring send", r, n_ops);
+    }
+    else {
+        printf("io_uring unavailable (errno %d), not timing the send path\n", errno);
+    }
+#endif
+
+    return 0;
+}
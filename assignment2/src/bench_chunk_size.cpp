@@ -0,0 +1,65 @@
+// Chunk size benchmark: runs the transfer in bench_common.hpp once for each
+// chunk size. The server cache gets the same number of bytes for every chunk
+// size (-m), so bigger chunks don't get a bigger cache for free.
+//
+// -T picks the transport, like for the server: tcp has TCP control/UDP data,
+// udp (the default) UDP control/TCP data.
+
+#include "bench_common.hpp"
+
+// what the clients use to stop, see client.hpp
+volatile bool running = true;
+
+void print_usage() {
+    std::cout << "usage: bench_chunk_size [-T tcp|udp] [-c num_clients] [-f file_mb] [-m cache_mb] "
+                 "[-s chunk_size]... [-t timeout_s] [-p port] [-u]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+
+    BenchOptions o(4, 60, 17000);
+    std::vector<uint32_t> chunk_sizes;
+
+    bool ok = o.parse(argc, argv, "s:", [&](int opt, const char* arg) {
+        if (opt != 's') return false;
+        chunk_sizes.push_back(std::stoi(std::string(arg)));
+        return true;
+    });
+    if (!ok) {
+        print_usage();
+        return 0;
+    }
+    if (chunk_sizes.empty()) {
+        chunk_sizes = { 1024, 2048, 4096, 8192, 16384, 32768, MAX_CHUNK_SIZE };
+    }
+
+    raise_fd_limit();
+
+    BenchFiles files("bench_chunk_size", o.file_mb);
+    if (!files.ok()) return 1;
+
+    const char* desc = with_transport(o.transport, [](auto tp) { return tp.description(); });
+    printf("%s, %d clients, %d MB file, %d MB cache\n", desc, o.n_clients, o.file_mb, o.cache_mb);
+
+    for (size_t i=0; i<chunk_sizes.size(); i++) {
+        uint32_t cs = chunk_sizes[i];
+        if (cs == 0 or cs > MAX_CHUNK_SIZE) {
+            printf("chunk=%-6u skipped, has to be between 1 and %u\n", cs, MAX_CHUNK_SIZE);
+            continue;
+        }
+        RunResult r = with_transport(o.transport, [&](auto tp) {
+            using T = decltype(tp);
+            return run_transfer<T>(o, o.port+i, 1, files, [&](ShardedServer<T>& srv) {
+                srv.load_file(files.file(), cs);
+            });
+        });
+        if (!r.ok) {
+            printf("chunk=%-6u timed out after %.1fs (%d/%d clients done)\n", cs, r.secs, r.completed, o.n_clients);
+            continue;
+        }
+        printf("chunk=%-6u %8.2fs  %8.1f MB/s per client  (%d/%d files correct)\n",
+               cs, r.secs, o.file_mb/r.secs, r.correct, o.n_clients);
+    }
+
+    return 0;
+}
@@ -0,0 +1,226 @@
+#pragma once
+
+// What the end-to-end benchmarks (bench_chunk_size, bench_p2p) have in
+// common: they run an in-process server and num_clients real clients (one
+// thread each, like clientmgr) on loopback, and measure how long it takes
+// until every client has saved the whole file.
+//
+// Clients are started 200ms apart like clientmgr does, and the clock starts
+// once the last one is up.
+//
+// With UDP data, the initial distribution goes out as one burst per client,
+// so keep each client's share (file/num_clients) well under the UDP receive
+// buffer, or most of it is dropped and has to be read from the file again.
+
+#include <sys/resource.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+#include "sharded_server.hpp"
+#include "client.hpp"
+
+using bench_clock = std::chrono::steady_clock;
+
+// swallows everything; both the server and the clients log every chunk
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override {
+        return c;
+    }
+};
+
+struct RunResult {
+    bool ok = false;
+    int completed = 0;
+    int correct = 0;
+    double secs = 0;
+    uint64_t egress_bytes = 0;
+};
+
+inline bool same_file(const std::string& a, const std::string& b) {
+    std::ifstream fa(a, std::ios::binary), fb(b, std::ios::binary);
+    if (!fa or !fb) return false;
+    return std::equal(std::istreambuf_iterator<char>(fa), std::istreambuf_iterator<char>(),
+                      std::istreambuf_iterator<char>(fb), std::istreambuf_iterator<char>());
+}
+
+inline void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 and rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+// The options every end-to-end benchmark takes; parse() hands anything else
+// in extra_opts to extra(opt, optarg), which returns false for an option it
+// doesn't know either.
+struct BenchOptions {
+    int n_clients;
+    int file_mb = 8;
+    int cache_mb = 4;
+    int timeout_s;
+    int port;
+    bool use_io_uring = false;
+    Transport transport = Transport::UDP_CONTROL;
+
+    BenchOptions(int clients, int timeout, int first_port):
+        n_clients{clients}, timeout_s{timeout}, port{first_port} {}
+
+    template<typename F>
+    bool parse(int argc, char** argv, const std::string& extra_opts, F extra) {
+        std::string opts = "c:f:m:t:p:uT:" + extra_opts;
+        int opt;
+        while ((opt = getopt(argc, argv, opts.c_str())) != -1) {
+            switch (opt) {
+                case 'c': n_clients = std::stoi(std::string(optarg)); break;
+                case 'f': file_mb = std::stoi(std::string(optarg)); break;
+                case 'm': cache_mb = std::stoi(std::string(optarg)); break;
+                case 't': timeout_s = std::stoi(std::string(optarg)); break;
+                case 'p': port = std::stoi(std::string(optarg)); break;
+                case 'u': use_io_uring = true; break;
+                case 'T':
+                    if (!parse_transport(std::string(optarg), transport)) return false;
+                    break;
+                default:
+                    if (opt == '?' or !extra(opt, optarg)) return false;
+            }
+        }
+        return n_clients > 0 and file_mb > 0 and cache_mb >= 0 and timeout_s > 0;
+    }
+
+    size_t cache_bytes() const {
+        return (size_t)cache_mb*1024*1024;
+    }
+};
+
+// The file the clients share (file_mb MB of random letters) and a directory
+// for them to write theirs to, both gone again with this.
+class BenchFiles {
+
+    std::string _file;
+    std::string _out_dir;
+    bool _ok = false;
+
+public:
+
+    BenchFiles(const std::string& name, int file_mb) {
+        _file = "/tmp/" + name + "_" + std::to_string(getpid()) + ".txt";
+        {
+            std::ofstream f(_file);
+            std::minstd_rand rng{42};
+            for (size_t i=0; i<(size_t)file_mb*1024*1024; i++) f.put('a' + rng()%26);
+        }
+        std::string dir = "/tmp/" + name + "_out_XXXXXX";
+        std::vector<char> tmpl(dir.begin(), dir.end());
+        tmpl.push_back('\0');
+        if (mkdtemp(tmpl.data()) == nullptr) {
+            std::cerr << "Could not make an output directory (errno " << errno << ")" << std::endl;
+            return;
+        }
+        _out_dir = tmpl.data();
+        _ok = true;
+    }
+
+    BenchFiles(const BenchFiles&) = delete;
+    BenchFiles& operator=(const BenchFiles&) = delete;
+
+    ~BenchFiles() {
+        unlink(_file.c_str());
+        if (_ok) rmdir(_out_dir.c_str());
+    }
+
+    bool ok() const {
+        return _ok;
+    }
+
+    const std::string& file() const {
+        return _file;
+    }
+
+    const std::string& out_dir() const {
+        return _out_dir;
+    }
+
+    // checks and removes everything n_clients clients wrote (they name it
+    // after their id, which starts at 0 every run); returns how many got the
+    // file right
+    int collect(int n_clients) const {
+        int correct = 0;
+        for (int i=0; i<n_clients; i++) {
+            std::string id = std::to_string(i);
+            std::string out = _out_dir + "/outfile_" + id + ".txt";
+            if (same_file(out, _file)) correct++;
+            unlink(out.c_str());
+            unlink((_out_dir + "/rtt_" + id + ".csv").c_str());
+            unlink((_out_dir + "/window_" + id + ".csv").c_str());
+        }
+        return correct;
+    }
+};
+
+// One run: a server with n_shards shards and the options' cache, which
+// setup(srv) configures and loads the file into, and the options' clients,
+// until they're all done or the timeout passed. Everything they log is
+// swallowed.
+template<typename Transport, typename Setup>
+RunResult run_transfer(const BenchOptions& o, uint16_t port, uint32_t n_shards, const BenchFiles& files,
+                       Setup setup) {
+    using namespace std::literals;
+    RunResult r;
+
+    NullBuffer sink;
+    std::streambuf* saved = std::cout.rdbuf(&sink);
+
+    volatile bool srv_running = true;
+    ShardedServer<Transport> srv(port, o.n_clients, o.cache_bytes(), n_shards, o.use_io_uring);
+    setup(srv);
+    std::thread srv_thread(&ShardedServer<Transport>::run, &srv, std::ref(srv_running));
+    std::this_thread::sleep_for(100ms);
+
+    running = true;
+    std::atomic<int> completed{0};
+    std::vector<std::unique_ptr<Client<Transport>>> clients;
+    std::vector<std::thread> threads;
+
+    for (int i=0; i<o.n_clients and running; i++) {
+        std::this_thread::sleep_for(200ms);
+        clients.emplace_back(new Client<Transport>("127.0.0.1", port, files.out_dir(), o.use_io_uring));
+        clients.back()->on_save_file([&completed]{ completed++; });
+        threads.emplace_back(&Client<Transport>::run, clients.back().get(), std::ref(running));
+    }
+
+    auto start = bench_clock::now();
+    auto deadline = start+std::chrono::seconds(o.timeout_s);
+    while (completed < o.n_clients and running and bench_clock::now() < deadline) {
+        std::this_thread::sleep_for(1ms);
+    }
+    r.secs = std::chrono::duration<double>(bench_clock::now()-start).count();
+    r.completed = completed;
+    r.ok = completed == o.n_clients;
+
+    running = false;
+    for (auto& t : threads) t.join();
+    clients.clear();
+
+    srv_running = false;
+    srv.wake();
+    srv_thread.join();
+    r.egress_bytes = srv.egress_bytes();
+
+    std::cout.rdbuf(saved);
+
+    r.correct = files.collect(o.n_clients);
+    return r;
+}
@@ -0,0 +1,205 @@
+// Microbenchmark for the cache the server's shards share: one ChunkCache
+// behind a single mutex against a ConcurrentChunkCache (see
+// concurrent_chunk_cache.hpp) with -k lock shards, both of policy -e.
+//
+// Every thread replays its own trace of chunk ids the way the server uses its
+// cache: access() every id, and insert it on a miss. Ids are drawn from a zipf
+// distribution over -n chunks (-s 0 makes it uniform), every thread with its
+// own seed, and the cache holds -c chunks. Traces are generated before the
+// clock starts, so only the cache and its locks are timed.
+//
+// Scaling can only show up with as many cores as threads; on fewer the
+// numbers mostly measure how much the locks cost when they aren't contended.
+
+#include <getopt.h>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <random>
+#include <atomic>
+#include <iostream>
+#include <algorithm>
+
+#include "protocol.hpp"
+#include "chunk_cache.hpp"
+#include "concurrent_chunk_cache.hpp"
+
+using bench_clock = std::chrono::steady_clock;
+
+struct Result {
+    double secs;
+    uint64_t hits;
+};
+
+static std::vector<uint32_t> make_trace(uint32_t n_keys, size_t n_ops, double skew, uint32_t seed) {
+    // cdf[k] = P(id <= k), with P(id = k) proportional to 1/(k+1)^skew
+    std::vector<double> cdf(n_keys);
+    double sum = 0;
+    for (uint32_t k=0; k<n_keys; k++) {
+        sum += 1.0/std::pow(k+1, skew);
+        cdf[k] = sum;
+    }
+
+    // the same shuffle for every thread, so they all like the same chunks
+    std::vector<uint32_t> ids(n_keys);
+    for (uint32_t k=0; k<n_keys; k++) ids[k] = k;
+    std::mt19937 shuffle_rng{42};
+    std::shuffle(ids.begin(), ids.end(), shuffle_rng);
+
+    std::mt19937 rng{seed};
+    std::uniform_real_distribution<double> u(0, sum);
+    std::vector<uint32_t> trace(n_ops);
+    for (auto& id : trace) {
+        size_t k = std::lower_bound(cdf.begin(), cdf.end(), u(rng)) - cdf.begin();
+        id = ids[std::min<size_t>(k, n_keys-1)];
+    }
+    return trace;
+}
+
+// starts every thread on op(trace, hits) at once and times until the last one
+// is done
+template<typename Op>
+static Result run_threads(const std::vector<std::vector<uint32_t>>& traces, size_t n_threads, Op op) {
+    std::vector<std::thread> threads;
+    std::vector<uint64_t> hits(n_threads, 0);
+    std::atomic<size_t> ready{0};
+    std::atomic<bool> go{false};
+
+    for (size_t t=0; t<n_threads; t++) {
+        threads.emplace_back([&,t]() {
+            ready++;
+            while (!go) std::this_thread::yield();
+            hits[t] = op(traces[t]);
+        });
+    }
+    while (ready < n_threads) std::this_thread::yield();
+
+    auto start = bench_clock::now();
+    go = true;
+    for (auto& th : threads) th.join();
+
+    Result r{std::chrono::duration<double>(bench_clock::now()-start).count(), 0};
+    for (uint64_t h : hits) r.hits += h;
+    return r;
+}
+
+static Result run_global(CachePolicy p, const std::vector<std::vector<uint32_t>>& traces, size_t n_threads,
+                         const std::vector<std::shared_ptr<FileChunk>>& chunks, size_t cache_chunks) {
+    auto cache = make_chunk_cache<uint32_t,std::shared_ptr<FileChunk>>(p, cache_chunks*DEFAULT_CHUNK_SIZE, cache_chunks);
+    std::mutex lock;
+
+    return run_threads(traces, n_threads, [&](const std::vector<uint32_t>& trace) {
+        uint64_t hits = 0;
+        for (uint32_t id : trace) {
+            std::lock_guard<std::mutex> guard(lock);
+            // copied out like the concurrent cache has to, to be fair
+            std::shared_ptr<FileChunk> c;
+            const std::shared_ptr<FileChunk>* v = cache->access(id);
+            if (v != nullptr) c = *v;
+            if (c != nullptr) {
+                hits++;
+            }
+            else {
+                cache->insert(id, chunks[id], chunks[id]->size);
+            }
+        }
+        return hits;
+    });
+}
+
+static Result run_sharded(CachePolicy p, size_t n_shards, const std::vector<std::vector<uint32_t>>& traces,
+                          size_t n_threads, const std::vector<std::shared_ptr<FileChunk>>& chunks,
+                          size_t cache_chunks) {
+    ConcurrentChunkCache<uint32_t,std::shared_ptr<FileChunk>> cache{p, cache_chunks*DEFAULT_CHUNK_SIZE,
+                                                                    cache_chunks, n_shards};
+
+    return run_threads(traces, n_threads, [&](const std::vector<uint32_t>& trace) {
+        uint64_t hits = 0;
+        for (uint32_t id : trace) {
+            std::shared_ptr<FileChunk> c = cache.access(id);
+            if (c != nullptr) {
+                hits++;
+            }
+            else {
+                cache.insert(id, chunks[id], chunks[id]->size);
+            }
+        }
+        return hits;
+    });
+}
+
+static void report(const std::string& name, size_t n_threads, const Result& r, size_t n_ops) {
+    printf("%-14s %2zu threads %8.2f Mops/s  hit rate %5.1f%%\n",
+           name.c_str(), n_threads, n_ops/r.secs/1e6, 100.0*r.hits/n_ops);
+}
+
+void print_usage() {
+    std::cout << "usage: bench_concurrent_cache [-e lru|clock|arc|s3fifo|tinylfu] [-k lock_shards] [-t max_threads]"
+                 " [-n num_chunks] [-c cache_chunks] [-o ops_per_thread] [-s zipf_skew]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+
+    CachePolicy policy = CachePolicy::LRU;
+    int n_shards = 16;
+    int max_threads = 16;
+    int n_keys = 100000;
+    int cache_chunks = 10000;
+    int n_ops = 1000000;
+    double skew = 0.99;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:k:t:n:c:o:s:")) != -1) {
+        switch (opt) {
+            case 'e':
+                if (!parse_cache_policy(optarg, policy)) {
+                    print_usage();
+                    return 0;
+                }
+                break;
+            case 'k': n_shards = std::stoi(std::string(optarg)); break;
+            case 't': max_threads = std::stoi(std::string(optarg)); break;
+            case 'n': n_keys = std::stoi(std::string(optarg)); break;
+            case 'c': cache_chunks = std::stoi(std::string(optarg)); break;
+            case 'o': n_ops = std::stoi(std::string(optarg)); break;
+            case 's': skew = std::stod(std::string(optarg)); break;
+            default:
+                print_usage();
+                return 0;
+        }
+    }
+    if (n_shards <= 0 or max_threads <= 0 or n_keys <= 0 or cache_chunks <= 0 or n_ops <= 0) {
+        print_usage();
+        return 0;
+    }
+
+    std::vector<std::shared_ptr<FileChunk>> chunks;
+    for (int k=0; k<n_keys; k++) {
+        chunks.push_back(make_chunk(DEFAULT_CHUNK_SIZE));
+        chunks.back()->id = k;
+        chunks.back()->size = DEFAULT_CHUNK_SIZE;
+    }
+
+    std::vector<std::vector<uint32_t>> traces;
+    for (int t=0; t<max_threads; t++) {
+        traces.push_back(make_trace(n_keys, n_ops, skew, 1000+t));
+    }
+
+    printf("%s, %d chunks, cache of %d, %d ops per thread, zipf skew %.2f, %u cores\n",
+           cache_policy_name(policy), n_keys, cache_chunks, n_ops, skew, std::thread::hardware_concurrency());
+
+    std::string sharded = std::to_string(n_shards) + " locks";
+    // the first round warms up the allocator
+    run_global(policy, traces, 1, chunks, cache_chunks);
+    for (int n=1; n<=max_threads; n*=2) {
+        report("1 lock", n, run_global(policy, traces, n, chunks, cache_chunks), (size_t)n*n_ops);
+        report(sharded, n, run_sharded(policy, n_shards, traces, n, chunks, cache_chunks), (size_t)n*n_ops);
+    }
+
+    return 0;
+}
@@ -0,0 +1,212 @@
+// Microbenchmark for what it costs a connection to hand one message to its
+// shard, the way ClientConnection used to and the way it does now:
+//
+//   bind:   a std::function per kind of event, bound with std::bind to a
+//           Server member when the client connects, and called for every
+//           control message that comes in and every chunk that goes out.
+//           The transport was picked at link time, so what flush_UDP asks
+//           every connection about every datagram (UDP_size) was a call
+//           into client_connection_(tcp|udp).cpp.
+//   policy: ClientConnection<Transport> calls its Server<Transport>
+//           directly, and UDP_size is inline with the transport's branch
+//           folded away.
+//
+// The shard's side of it does next to nothing, so this is the dispatch
+// alone. The loops over a batch of messages are kept out of line in both
+// cases (they sit in the per-transport .cpp files), only the calls they make
+// per message differ. Each result is the best of -r runs.
+
+#include <netinet/in.h>
+#include <getopt.h>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <functional>
+#include <iostream>
+
+#include "protocol.hpp"
+#include "chunk_pool.hpp"
+#include "transport.hpp"
+
+using namespace std::placeholders;
+using bench_clock = std::chrono::steady_clock;
+
+// what the shard does with every message, which is as little as possible
+struct ShardCounters {
+    uint64_t requests = 0;
+    uint64_t sent = 0;
+    uint64_t sum = 0;
+
+    void received_control_msg(const ControlPacket& m, struct sockaddr_in from) {
+        if (m.type() == REQ) requests++;
+        sum += m.msg.chunk_id ^ from.sin_port;
+    }
+
+    void sent_chunk(uint32_t client_id, uint32_t chunk_id) {
+        sent++;
+        sum += chunk_id ^ client_id;
+    }
+};
+
+// before: callbacks, and the transport specific parts out of line
+class BoundConnection {
+
+    uint32_t _client_id = 7;
+    struct sockaddr_in _client_addr{};
+    std::vector<uint16_t> _chunk_sizes;
+
+    std::function<void(const ControlPacket&, struct sockaddr_in)> _recv_control_msg_callback;
+    std::function<void(uint32_t, uint32_t)> _send_chunk_callback;
+
+public:
+
+    explicit BoundConnection(const std::vector<uint16_t>& sizes): _chunk_sizes(sizes) {}
+
+    void on_recv_control_msg(std::function<void(const ControlPacket&,struct sockaddr_in)> cb) {
+        _recv_control_msg_callback = cb;
+    }
+
+    void on_send_chunk(std::function<void(uint32_t, uint32_t)> cb) {
+        _send_chunk_callback = cb;
+    }
+
+    __attribute__((noinline)) void received(const ControlPacket* msgs, size_t n) {
+        for (size_t i=0; i<n; i++) _recv_control_msg_callback(msgs[i], _client_addr);
+    }
+
+    __attribute__((noinline)) void sent(const uint32_t* chunk_ids, size_t n) {
+        for (size_t i=0; i<n; i++) _send_chunk_callback(_client_id, chunk_ids[i]);
+    }
+
+    __attribute__((noinline)) size_t UDP_size(size_t idx) {
+        return idx < _chunk_sizes.size() ? ChunkRef::HEADER + _chunk_sizes[idx] : 0;
+    }
+};
+
+// after: the connection knows its shard's type, and the transport
+template<typename Transport>
+class PolicyConnection {
+
+    uint32_t _client_id = 7;
+    struct sockaddr_in _client_addr{};
+    std::vector<uint16_t> _chunk_sizes;
+    std::vector<ControlPacket> _control_msgs;
+
+    ShardCounters& _server;
+
+public:
+
+    PolicyConnection(const std::vector<uint16_t>& sizes, ShardCounters& server):
+        _chunk_sizes(sizes), _control_msgs(sizes.size()), _server(server) {}
+
+    __attribute__((noinline)) void received(const ControlPacket* msgs, size_t n) {
+        for (size_t i=0; i<n; i++) _server.received_control_msg(msgs[i], _client_addr);
+    }
+
+    __attribute__((noinline)) void sent(const uint32_t* chunk_ids, size_t n) {
+        for (size_t i=0; i<n; i++) _server.sent_chunk(_client_id, chunk_ids[i]);
+    }
+
+    size_t UDP_size(size_t idx) {
+        if (Transport::CONTROL_OVER_TCP) {
+            return idx < _chunk_sizes.size() ? ChunkRef::HEADER + _chunk_sizes[idx] : 0;
+        }
+        return idx < _control_msgs.size() ? _control_msgs[idx].size() : 0;
+    }
+};
+
+// the messages in one batch, which gets dispatched over and over
+struct Batch {
+    std::vector<ControlPacket> msgs;
+    std::vector<uint32_t> chunk_ids;
+    std::vector<uint16_t> sizes;
+
+    explicit Batch(size_t n) {
+        for (size_t i=0; i<n; i++) {
+            msgs.push_back(ControlMessage{ (uint8_t)(i % 4 == 0 ? HAVE : REQ), 0, (uint32_t)i });
+            chunk_ids.push_back(i*31);
+            sizes.push_back(DEFAULT_CHUNK_SIZE - i % 3);
+        }
+    }
+};
+
+// best ns per message of `runs` runs of `passes` calls to f()
+template<typename F>
+static double best_ns(F f, size_t passes, size_t per_pass, int runs) {
+    double best = 0;
+    for (int r=0; r<runs; r++) {
+        auto start = bench_clock::now();
+        for (size_t p=0; p<passes; p++) f();
+        double ns = std::chrono::duration<double,std::nano>(bench_clock::now()-start).count()/(passes*per_pass);
+        if (r == 0 or ns < best) best = ns;
+    }
+    return best;
+}
+
+// the sizes of everything queued, the way DrrScheduler::pick asks for them
+template<typename Conn>
+static uint64_t size_all(Conn& conn, size_t n) {
+    uint64_t bytes = 0;
+    for (size_t i=0; i<=n; i++) bytes += conn.UDP_size(i);
+    return bytes;
+}
+
+void print_usage() {
+    std::cout << "usage: bench_dispatch [-n batch_size] [-o messages] [-r runs]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+
+    int batch_size = 256;
+    int n_msgs = 20000000;
+    int runs = 5;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:o:r:")) != -1) {
+        switch (opt) {
+            case 'n': batch_size = std::stoi(std::string(optarg)); break;
+            case 'o': n_msgs = std::stoi(std::string(optarg)); break;
+            case 'r': runs = std::stoi(std::string(optarg)); break;
+            default:
+                print_usage();
+                return 0;
+        }
+    }
+    if (batch_size <= 0 or n_msgs <= 0 or runs <= 0) {
+        print_usage();
+        return 0;
+    }
+
+    Batch b(batch_size);
+    size_t passes = std::max(1, n_msgs/batch_size);
+
+    ShardCounters before;
+    BoundConnection bound(b.sizes);
+    bound.on_recv_control_msg(std::bind(&ShardCounters::received_control_msg, &before, _1, _2));
+    bound.on_send_chunk(std::bind(&ShardCounters::sent_chunk, &before, _1, _2));
+
+    ShardCounters after;
+    PolicyConnection<TcpControl> tcp(b.sizes, after);
+
+    uint64_t bytes = 0;
+    printf("%d messages per batch, %zu batches, best of %d\n", batch_size, passes, runs);
+    printf("%-22s %10s %10s\n", "", "bind", "policy");
+    printf("%-22s %7.2f ns %7.2f ns\n", "control msg received",
+           best_ns([&]{ bound.received(b.msgs.data(), b.msgs.size()); }, passes, batch_size, runs),
+           best_ns([&]{ tcp.received(b.msgs.data(), b.msgs.size()); }, passes, batch_size, runs));
+    printf("%-22s %7.2f ns %7.2f ns\n", "chunk sent",
+           best_ns([&]{ bound.sent(b.chunk_ids.data(), b.chunk_ids.size()); }, passes, batch_size, runs),
+           best_ns([&]{ tcp.sent(b.chunk_ids.data(), b.chunk_ids.size()); }, passes, batch_size, runs));
+    printf("%-22s %7.2f ns %7.2f ns\n", "UDP_size",
+           best_ns([&]{ bytes += size_all(bound, b.sizes.size()); }, passes, batch_size, runs),
+           best_ns([&]{ bytes += size_all(tcp, b.sizes.size()); }, passes, batch_size, runs));
+
+    // (so that none of it gets optimized away)
+    if (before.sum != after.sum or before.requests != after.requests or before.sent != after.sent) {
+        printf("the two did different things (%lu vs %lu)\n", (unsigned long)before.sum, (unsigned long)after.sum);
+    }
+    printf("checksum %lu\n", (unsigned long)(after.sum + bytes));
+
+    return 0;
+}
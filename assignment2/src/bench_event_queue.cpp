@@ -0,0 +1,172 @@
+// Loopback benchmark for the EventQueue backends.
+//
+// pingpong: one UDP socket, one datagram in flight at a time. Every wakeup
+//           carries exactly one event, so this measures the raw wakeup rate.
+// fanin:    n_socks UDP sockets all get a datagram before we wait, so a single
+//           wakeup returns many events. This measures per-event dispatch cost.
+//
+// Every backend compiled in gets run: epoll and io_uring on linux, kqueue on
+// macOS, and kqueue on linux as well when built with KQUEUE=1 (libkqueue).
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "event_queue.hpp"
+
+using bench_clock = std::chrono::steady_clock;
+
+struct LoopbackSockets {
+
+    int sender;
+    std::vector<int> receivers;
+    std::vector<struct sockaddr_in> addrs;
+
+    LoopbackSockets(int n) {
+        sender = socket(AF_INET, SOCK_DGRAM, 0);
+        for (int i=0; i<n; i++) {
+            int fd = socket(AF_INET, SOCK_DGRAM, 0);
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port = 0;
+            bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+            socklen_t len = sizeof(addr);
+            getsockname(fd, (struct sockaddr*)&addr, &len);
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            receivers.push_back(fd);
+            addrs.push_back(addr);
+        }
+    }
+
+    void send_to(int i) {
+        char b = 'x';
+        sendto(sender, &b, 1, 0, (struct sockaddr*)&addrs[i], sizeof(addrs[i]));
+    }
+
+    ~LoopbackSockets() {
+        for (int fd : receivers) close(fd);
+        close(sender);
+    }
+};
+
+struct BenchResult {
+    uint64_t wakeups = 0;
+    uint64_t events = 0;
+    bench_clock::duration wait_time{0};
+    bench_clock::duration total_time{0};
+};
+
+// drains everything that's queued up on fd. In edge triggered mode we
+// have to do this anyway, in level triggered mode it's one recv + one EAGAIN.
+static int drain(int fd) {
+    char buf[16];
+    int n = 0;
+    while (recv(fd, buf, sizeof(buf), 0) > 0) n++;
+    return n;
+}
+
+template<typename Q>
+BenchResult run(Q& q, LoopbackSockets& socks, int rounds) {
+    int n = socks.receivers.size();
+    for (int fd : socks.receivers) {
+        q.add_event(fd, EVFILT_READ);
+    }
+
+    BenchResult r;
+    auto start = bench_clock::now();
+
+    for (int round=0; round<rounds; round++) {
+        for (int i=0; i<n; i++) socks.send_to(i);
+
+        int pending = n;
+        while (pending > 0) {
+            auto t0 = bench_clock::now();
+            const std::vector<event_t>& evts = q.get_events();
+            r.wait_time += bench_clock::now()-t0;
+
+            r.wakeups++;
+            r.events += evts.size();
+            for (const auto& e : evts) {
+                if (e.filter == EVFILT_READ) pending -= drain(e.ident);
+            }
+        }
+    }
+
+    r.total_time = bench_clock::now()-start;
+
+    for (int fd : socks.receivers) {
+        q.delete_event(fd, EVFILT_READ);
+    }
+    return r;
+}
+
+static void report(const char* backend, const char* scenario, const BenchResult& r) {
+    double secs = std::chrono::duration<double>(r.total_time).count();
+    double wait_ns = std::chrono::duration<double,std::nano>(r.wait_time).count();
+    printf("%-12s %-10s wakeups=%-8llu events=%-8llu %10.0f wakeups/s %8.1f ev/wakeup %8.1f ns/event (get_events)\n",
+           backend, scenario,
+           (unsigned long long)r.wakeups, (unsigned long long)r.events,
+           r.wakeups/secs, (double)r.events/r.wakeups, wait_ns/r.events);
+}
+
+template<typename Q, typename... Args>
+void bench_backend(const char* name, int rounds, int n_socks, Args... args) {
+    {
+        Q q(args...);
+        LoopbackSockets socks(1);
+        report(name, "pingpong", run(q, socks, rounds*n_socks));
+        q.close();
+    }
+    {
+        Q q(args...);
+        LoopbackSockets socks(n_socks);
+        report(name, "fanin", run(q, socks, rounds));
+        q.close();
+    }
+}
+
+void print_usage() {
+    std::cout << "usage: bench_event_queue [-r rounds] [-n num_sockets]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+
+    int rounds = 2000;
+    int n_socks = 64;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:n:")) != -1) {
+        switch (opt) {
+            case 'r': rounds = std::stoi(std::string(optarg)); break;
+            case 'n': n_socks = std::stoi(std::string(optarg)); break;
+            default:
+                print_usage();
+                return 0;
+        }
+    }
+
+#ifdef HAVE_EPOLL
+    bench_backend<EpollEventQueue>("epoll", rounds, n_socks, false);
+    bench_backend<EpollEventQueue>("epoll-et", rounds, n_socks, true);
+#endif
+#ifdef HAVE_IO_URING
+    bench_backend<UringEventQueue>("io_uring", rounds, n_socks);
+#endif
+#ifdef HAVE_KQUEUE
+    bench_backend<KqueueEventQueue>("kqueue", rounds, n_socks, false);
+    bench_backend<KqueueEventQueue>("kqueue-clr", rounds, n_socks, true);
+#endif
+
+    return 0;
+}
@@ -0,0 +1,70 @@
+// P2P benchmark: runs the transfer in bench_common.hpp once with the server
+// relaying every chunk and once in P2P mode (server -P), where it only tells
+// clients which peers have what. For both, prints how long it took and how
+// many bytes the server queued for its clients over the run (control messages
+// included).
+//
+// Both runs start with the same initial distribution, which is one copy of
+// the file out of the server, so that's the least it can get away with.
+// Peers always talk over UDP.
+//
+// -T picks the transport, like for the server: tcp has TCP control/UDP data,
+// udp (the default) UDP control/TCP data.
+
+#include "bench_common.hpp"
+
+// what the clients use to stop, see client.hpp
+volatile bool running = true;
+
+void print_usage() {
+    std::cout << "usage: bench_p2p [-T tcp|udp] [-c num_clients] [-f file_mb] [-m cache_mb] [-s chunk_size] "
+                 "[-k shards] [-t timeout_s] [-p port] [-u]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+
+    BenchOptions o(16, 120, 17500);
+    int chunk_size = 8192;
+    int n_shards = 1;
+
+    bool ok = o.parse(argc, argv, "s:k:", [&](int opt, const char* arg) {
+        switch (opt) {
+            case 's': chunk_size = std::stoi(std::string(arg)); return true;
+            case 'k': n_shards = std::stoi(std::string(arg)); return true;
+            default: return false;
+        }
+    });
+    if (!ok or chunk_size <= 0 or chunk_size > (int)MAX_CHUNK_SIZE or n_shards <= 0) {
+        print_usage();
+        return 0;
+    }
+
+    raise_fd_limit();
+
+    BenchFiles files("bench_p2p", o.file_mb);
+    if (!files.ok()) return 1;
+
+    const char* desc = with_transport(o.transport, [](auto tp) { return tp.description(); });
+    printf("%s, %d clients, %d MB file, %d byte chunks, %d MB cache, %d shards\n",
+           desc, o.n_clients, o.file_mb, chunk_size, o.cache_mb, n_shards);
+
+    for (int p2p=0; p2p<2; p2p++) {
+        const char* mode = p2p ? "p2p" : "relay";
+        RunResult r = with_transport(o.transport, [&](auto tp) {
+            using T = decltype(tp);
+            return run_transfer<T>(o, o.port+p2p, n_shards, files, [&](ShardedServer<T>& srv) {
+                srv.set_p2p(p2p);
+                srv.load_file(files.file(), chunk_size);
+            });
+        });
+        if (!r.ok) {
+            printf("%-6s timed out after %.1fs (%d/%d clients done)\n", mode, r.secs, r.completed, o.n_clients);
+            continue;
+        }
+        double mb = r.egress_bytes/(1024.0*1024.0);
+        printf("%-6s %8.2fs  server egress %9.1f MB (%5.2fx the file)  (%d/%d files correct)\n",
+               mode, r.secs, mb, mb/o.file_mb, r.correct, o.n_clients);
+    }
+
+    return 0;
+}
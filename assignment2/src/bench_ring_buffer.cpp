@@ -0,0 +1,199 @@
+// Microbenchmark for handing items from one thread to another through the
+// rings in ring_buffer.hpp, against a std::queue behind a std::mutex (bounded
+// to the same capacity, so both push back on a producer that gets ahead).
+//
+//   throughput: -p producers (1 for SpscRing) push -o items between them as
+//               fast as they can, one consumer pops them all.
+//   latency:    every item carries the time it was pushed at, and the
+//               producer waits for each one to be taken before it pushes the
+//               next, so this is the handoff through an idle queue (with
+//               the one producer only).
+//
+// Whoever can't get on (full, or nothing there) yields rather than spins,
+// which on a machine with fewer cores than threads is what actually lets the
+// other side run. Each throughput result is the best of -r runs.
+
+#include <getopt.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#include "ring_buffer.hpp"
+
+using bench_clock = std::chrono::steady_clock;
+
+struct Item {
+    uint64_t seq = 0;
+    bench_clock::time_point pushed;
+};
+
+// the lock it replaces
+template<typename T>
+class MutexQueue {
+
+    std::mutex _lock;
+    std::queue<T> _q;
+    size_t _capacity;
+
+public:
+
+    explicit MutexQueue(size_t capacity): _capacity{capacity} {}
+
+    bool try_push(T&& v) {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_q.size() >= _capacity) return false;
+        _q.push(std::move(v));
+        return true;
+    }
+
+    bool try_pop(T& out) {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_q.empty()) return false;
+        out = std::move(_q.front());
+        _q.pop();
+        return true;
+    }
+};
+
+// SpscRing's try_push takes its argument by value
+template<typename Q>
+static bool push(Q& q, Item&& it) {
+    return q.try_push(std::move(it));
+}
+
+// seconds for n_producers to get n_items through q
+template<typename Q>
+static double throughput(Q& q, size_t n_producers, size_t n_items) {
+    std::atomic<bool> go{false};
+    std::vector<std::thread> producers;
+    for (size_t p=0; p<n_producers; p++) {
+        producers.emplace_back([&,p]() {
+            while (!go) std::this_thread::yield();
+            for (size_t i=p; i<n_items; i+=n_producers) {
+                Item it;
+                it.seq = i;
+                while (!push(q, std::move(it))) std::this_thread::yield();
+            }
+        });
+    }
+
+    auto start = bench_clock::now();
+    go = true;
+    uint64_t sum = 0;
+    Item it;
+    for (size_t got=0; got<n_items; ) {
+        if (q.try_pop(it)) {
+            sum += it.seq;
+            got++;
+        }
+        else std::this_thread::yield();
+    }
+    double secs = std::chrono::duration<double>(bench_clock::now()-start).count();
+    for (auto& t : producers) {
+        t.join();
+    }
+
+    if (sum != (uint64_t)n_items*(n_items-1)/2) printf("lost items (checksum %lu)\n", (unsigned long)sum);
+    return secs;
+}
+
+// handoff delays of n_items items, one at a time, sorted
+template<typename Q>
+static std::vector<double> latency(Q& q, size_t n_items) {
+    std::atomic<uint64_t> taken{0};
+    std::vector<double> delays;
+    delays.reserve(n_items);
+
+    std::thread producer([&]() {
+        for (size_t i=0; i<n_items; i++) {
+            Item it;
+            it.seq = i;
+            it.pushed = bench_clock::now();
+            while (!push(q, std::move(it))) std::this_thread::yield();
+            while (taken.load(std::memory_order_acquire) <= i) std::this_thread::yield();
+        }
+    });
+
+    Item it;
+    while (delays.size() < n_items) {
+        if (q.try_pop(it)) {
+            delays.push_back(std::chrono::duration<double,std::nano>(bench_clock::now()-it.pushed).count());
+            taken.store(delays.size(), std::memory_order_release);
+        }
+        else std::this_thread::yield();
+    }
+    producer.join();
+
+    std::sort(delays.begin(), delays.end());
+    return delays;
+}
+
+template<typename Q>
+static void report(const char* name, size_t capacity, size_t n_producers, size_t n_items,
+                   size_t n_pings, int runs) {
+    double best = 0;
+    for (int r=0; r<runs; r++) {
+        Q q(capacity);
+        double secs = throughput(q, n_producers, n_items);
+        if (r == 0 or secs < best) best = secs;
+    }
+    printf("%-22s %8.2f Mitems/s", name, n_items/best/1e6);
+    if (n_pings > 0) {
+        Q q(capacity);
+        std::vector<double> d = latency(q, n_pings);
+        printf(" %9.0f ns p50 %9.0f ns p99", d[d.size()/2], d[std::min(d.size()-1, d.size()*99/100)]);
+    }
+    printf("\n");
+}
+
+void print_usage() {
+    std::cout << "usage: bench_ring_buffer [-p producers] [-c capacity] [-o items] [-l pings] [-r runs]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+
+    int n_producers = 4;
+    int capacity = 1024;
+    int n_items = 2000000;
+    int n_pings = 20000;
+    int runs = 3;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:c:o:l:r:")) != -1) {
+        switch (opt) {
+            case 'p': n_producers = std::stoi(std::string(optarg)); break;
+            case 'c': capacity = std::stoi(std::string(optarg)); break;
+            case 'o': n_items = std::stoi(std::string(optarg)); break;
+            case 'l': n_pings = std::stoi(std::string(optarg)); break;
+            case 'r': runs = std::stoi(std::string(optarg)); break;
+            default:
+                print_usage();
+                return 0;
+        }
+    }
+    if (n_producers <= 0 or capacity <= 0 or n_items <= 0 or n_pings <= 0 or runs <= 0) {
+        print_usage();
+        return 0;
+    }
+
+    printf("%d items through a queue of %d, %d pings for the latency, %u cores\n",
+           n_items, capacity, n_pings, std::thread::hardware_concurrency());
+
+    printf("1 producer\n");
+    report<SpscRing<Item>>("  SpscRing", capacity, 1, n_items, n_pings, runs);
+    report<MpscRing<Item>>("  MpscRing", capacity, 1, n_items, n_pings, runs);
+    report<MutexQueue<Item>>("  std::queue+mutex", capacity, 1, n_items, n_pings, runs);
+
+    printf("%d producers\n", n_producers);
+    report<MpscRing<Item>>("  MpscRing", capacity, n_producers, n_items, 0, runs);
+    report<MutexQueue<Item>>("  std::queue+mutex", capacity, n_producers, n_items, 0, runs);
+
+    return 0;
+}
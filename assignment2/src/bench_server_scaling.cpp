@@ -0,0 +1,529 @@
+// Scaling benchmark for the sharded server: runs an in-process ShardedServer
+// with 1, 2, 4, ... up to max_shards reactor threads and measures how many
+// chunk requests per second it serves to num_clients clients on loopback.
+//
+// Each run goes through the same steps:
+//   1. a seed client connects first and gets the whole file distributed to it
+//   2. a warm-up client requests every chunk once, so that the server pulls
+//      them all from the seed into its cache
+//   3. num_clients clients connect, spread over a few load threads
+//   4. for -d seconds every client keeps -w requests for random (cached)
+//      chunks in flight, and we count the chunks that come back
+//
+// Requests that don't come back within 500ms are given up on (UDP may drop
+// them) and replaced with a new one, so a lost datagram only costs throughput.
+//
+// -T picks the transport, like for the server: tcp speaks TCP control/UDP
+// data, udp (the default) the other way around.
+
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <random>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+
+#include "sharded_server.hpp"
+
+using bench_clock = std::chrono::steady_clock;
+using namespace std::literals;
+
+static bool control_on_tcp = false;
+
+static const auto REQUEST_TIMEOUT = 500ms;
+
+// chunks that made it into the server's cache during warm-up
+static std::vector<uint32_t> cached_chunks;
+static uint32_t num_chunks;
+static int window = 8;
+
+struct Peer {
+
+    enum Role { SEED, WARMER, LOADER };
+
+    Role role;
+    int tcp = -1;
+    int udp = -1;
+    uint32_t id = 0;
+    bool registered = false;
+    bool open = false;
+    bool announced = false;
+    bool write_armed = false;
+
+    FrameReader in;
+    ChunkBuffer frame_chunk{MAX_CHUNK_SIZE};
+    std::vector<char> out;
+
+    // SEED: the chunks we have
+    std::vector<std::shared_ptr<FileChunk>> store;
+    std::vector<bool> have;
+    uint32_t n_have = 0;
+
+    // WARMER / LOADER
+    std::unordered_map<uint32_t, bench_clock::time_point> outstanding;
+    uint32_t next_warm = 0;
+    uint64_t received = 0;
+    std::minstd_rand rng;
+
+    Peer(Role r, uint32_t seed): role{r}, rng{seed} {}
+
+    ~Peer() {
+        if (tcp != -1) close(tcp);
+        if (udp != -1) close(udp);
+    }
+
+    // both sockets on the same local port, bound before connecting, the same
+    // way Client does it
+    bool connect_to(uint16_t port) {
+        struct sockaddr_in server;
+        memset(&server, 0, sizeof(server));
+        server.sin_family = AF_INET;
+        server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        server.sin_port = htons(port);
+
+        for (int attempt=0; attempt<10; attempt++) {
+            tcp = socket(AF_INET, SOCK_STREAM, 0);
+            udp = socket(AF_INET, SOCK_DGRAM, 0);
+
+            struct sockaddr_in local;
+            memset(&local, 0, sizeof(local));
+            local.sin_family = AF_INET;
+            local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            socklen_t len = sizeof(local);
+
+            if (bind(tcp, (struct sockaddr*)&local, len) == 0 and
+                getsockname(tcp, (struct sockaddr*)&local, &len) == 0 and
+                bind(udp, (struct sockaddr*)&local, len) == 0) {
+                break;
+            }
+            // the port TCP got is taken for UDP, try another
+            close(tcp);
+            close(udp);
+            tcp = udp = -1;
+        }
+        if (tcp == -1) return false;
+
+        // the whole file gets distributed to the seed in one burst
+        if (role == SEED) {
+            const int rcvbuf = 4 << 20;
+            setsockopt(udp, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        }
+
+        if (connect(tcp, (struct sockaddr*)&server, sizeof(server)) == -1) return false;
+        if (connect(udp, (struct sockaddr*)&server, sizeof(server)) == -1) return false;
+
+        const int one = 1;
+        setsockopt(tcp, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(tcp, F_SETFL, O_NONBLOCK);
+        fcntl(udp, F_SETFL, O_NONBLOCK);
+        return true;
+    }
+
+    // one length-prefixed frame, see stream_codec.hpp
+    void send_stream(Frame f) {
+        uint32_t len = htonl((uint32_t)f.len);
+        out.insert(out.end(), (const char*)&len, (const char*)&len + sizeof(len));
+        out.insert(out.end(), (const char*)f.data, (const char*)f.data + f.len);
+        flush_stream();
+    }
+
+    void flush_stream() {
+        size_t off = 0;
+        while (off < out.size()) {
+            ssize_t nb = send(tcp, out.data()+off, out.size()-off, MSG_NOSIGNAL);
+            if (nb <= 0) break;
+            off += nb;
+        }
+        out.erase(out.begin(), out.begin()+off);
+    }
+
+    void send_control(const ControlPacket& p) {
+        if (control_on_tcp) send_stream({ &p, p.size() });
+        else send(udp, &p, p.size(), 0);
+    }
+
+    void send_chunk(const FileChunk& c) {
+        if (control_on_tcp) send(udp, &c, chunk_wire_size(c), 0);
+        else send_stream(chunk_frame(c));
+    }
+
+    void request(uint32_t chunk_id) {
+        outstanding[chunk_id] = bench_clock::now();
+        send_control(ControlMessage{REQ, id, chunk_id});
+    }
+
+    void top_up() {
+        if (!open or role == SEED) return;
+        while ((int)outstanding.size() < window) {
+            if (role == WARMER) {
+                if (next_warm >= num_chunks) return;
+                request(next_warm++);
+            }
+            else {
+                if (cached_chunks.empty()) return;
+                uint32_t c = cached_chunks[rng() % cached_chunks.size()];
+                if (outstanding.find(c) != outstanding.end()) return;
+                request(c);
+            }
+        }
+    }
+
+    void expire(bench_clock::time_point now) {
+        for (auto it = outstanding.begin(); it != outstanding.end(); ) {
+            if (now-it->second > REQUEST_TIMEOUT) it = outstanding.erase(it);
+            else ++it;
+        }
+        top_up();
+    }
+
+    void received_control(const ControlPacket& p) {
+        const ControlMessage& m = p.msg;
+        if (m.msgtype == REG and !registered) {
+            id = m.client_id;
+            registered = true;
+            if (role == SEED) {
+                store.resize(m.chunk_id);
+                have.assign(m.chunk_id, false);
+            }
+        }
+        else if (m.msgtype == OPEN) {
+            open = true;
+            // the server only asks clients that said they have a chunk
+            if (role == SEED and !announced) {
+                std::vector<uint32_t> ids;
+                for (uint32_t c=0; c<have.size(); c++) {
+                    if (have[c]) ids.push_back(c);
+                }
+                encode_chunk_haves(id, ids, [this](const ControlPacket& p) { send_control(p); });
+                announced = true;
+            }
+            top_up();
+        }
+        else if (role == SEED) {
+            for_each_requested_chunk(p, have.size(), [this](uint32_t chunk_id) {
+                if (have[chunk_id]) send_chunk(*store[chunk_id]);
+            });
+        }
+    }
+
+    void received_chunk(const FileChunk& c) {
+        if (role == SEED) {
+            // the distribution can beat the registration
+            if (c.id >= store.size()) {
+                store.resize(c.id+1);
+                have.resize(c.id+1, false);
+            }
+            if (!have[c.id]) {
+                store[c.id] = copy_chunk(c);
+                have[c.id] = true;
+                n_have++;
+            }
+            return;
+        }
+        if (outstanding.erase(c.id) > 0) {
+            received++;
+            if (role == WARMER) cached_chunks.push_back(c.id);
+        }
+        top_up();
+    }
+
+    void read_tcp() {
+        while (in.fill(tcp) > 0) {
+            in.for_each_frame([this](const char* p, size_t len) {
+                ControlPacket m;
+                if (control_on_tcp and control_from_frame(p, len, m)) received_control(m);
+                else if (!control_on_tcp and chunk_from_frame(p, len, frame_chunk)) received_chunk(frame_chunk.get());
+            });
+        }
+    }
+
+    void read_udp() {
+        FileChunk buf;
+        ssize_t nb;
+        while ((nb = recv(udp, &buf, sizeof(buf), 0)) > 0) {
+            if (control_on_tcp and chunk_complete(buf, nb)) received_chunk(buf);
+            else if (!control_on_tcp) {
+                ControlPacket m;
+                if (ControlPacket::parse(&buf, nb, m)) received_control(m);
+            }
+        }
+    }
+};
+
+// one event loop driving a set of peers
+class Loader {
+
+    static const uintptr_t TICK = 1 << 20;
+
+    EventQueue _q;
+    std::vector<Peer*> _peers;
+    std::unordered_map<uintptr_t, Peer*> _by_fd;
+
+public:
+
+    Loader() {
+        _q.add_timer_event(TICK, 20);
+    }
+
+    ~Loader() {
+        _q.close();
+    }
+
+    void add(Peer* p) {
+        _peers.push_back(p);
+        _by_fd[p->tcp] = p;
+        _by_fd[p->udp] = p;
+        _q.add_event(p->tcp, EVFILT_READ);
+        _q.add_event(p->udp, EVFILT_READ);
+    }
+
+    const std::vector<Peer*>& peers() {
+        return _peers;
+    }
+
+    template<typename Done>
+    void run_until(Done done) {
+        while (!done()) {
+            for (const auto& e : _q.get_events()) {
+                if (e.ident == TICK) {
+                    auto now = bench_clock::now();
+                    for (auto p : _peers) p->expire(now);
+                }
+                else {
+                    auto it = _by_fd.find(e.ident);
+                    if (it == _by_fd.end()) continue;
+                    Peer* p = it->second;
+                    if (e.filter == EVFILT_WRITE) p->flush_stream();
+                    else if ((int)e.ident == p->tcp) p->read_tcp();
+                    else p->read_udp();
+                }
+            }
+
+            // the tick catches anyone whose stream backed up without an event
+            for (auto p : _peers) {
+                bool want = !p->out.empty();
+                if (want != p->write_armed) {
+                    if (want) _q.add_event(p->tcp, EVFILT_WRITE);
+                    else _q.delete_event(p->tcp, EVFILT_WRITE);
+                    p->write_armed = want;
+                }
+            }
+        }
+    }
+};
+
+struct RunResult {
+    bool ok = false;
+    uint32_t cached = 0;
+    uint64_t received = 0;
+    double secs = 0;
+};
+
+template<typename Transport>
+static RunResult bench_shards(uint16_t port, uint32_t n_shards, int n_clients, int n_loaders,
+                              int duration_s, const std::string& file, bool use_io_uring) {
+    RunResult r;
+
+    // the server gets chatty with a thousand clients; keep it out of the output
+    std::stringstream sink;
+    std::streambuf* saved = std::cout.rdbuf(sink.rdbuf());
+
+    volatile bool srv_running = true;
+    ShardedServer<Transport> srv(port, 1, (size_t)num_chunks*DEFAULT_CHUNK_SIZE, n_shards, use_io_uring);
+    srv.load_file(file);
+    std::thread srv_thread(&ShardedServer<Transport>::run, &srv, std::ref(srv_running));
+    std::this_thread::sleep_for(100ms);
+
+    cached_chunks.clear();
+    std::vector<std::unique_ptr<Peer>> peers;
+    Loader setup;
+
+    do {
+        // 1. seed
+        peers.emplace_back(new Peer(Peer::SEED, 1));
+        Peer* seed = peers.back().get();
+        if (!seed->connect_to(port)) break;
+        setup.add(seed);
+        auto deadline = bench_clock::now()+10s;
+        setup.run_until([&]{ return (seed->registered and seed->n_have == num_chunks) or
+                                    bench_clock::now() > deadline; });
+        if (seed->n_have != num_chunks) break;
+
+        // 2. warm-up. Stop once nothing has come back for a second: a chunk
+        // whose reply got lost can stay stuck on the server
+        peers.emplace_back(new Peer(Peer::WARMER, 2));
+        Peer* warmer = peers.back().get();
+        int saved_window = window;
+        window = 16;
+        if (!warmer->connect_to(port)) break;
+        setup.add(warmer);
+        auto last_progress = bench_clock::now();
+        uint64_t last_received = 0;
+        setup.run_until([&]{
+            auto now = bench_clock::now();
+            if (warmer->received != last_received) {
+                last_received = warmer->received;
+                last_progress = now;
+            }
+            return warmer->received == num_chunks or now-last_progress > 1s;
+        });
+        window = saved_window;
+        r.cached = cached_chunks.size();
+        if (cached_chunks.empty()) break;
+
+        // 3. load clients
+        std::vector<std::unique_ptr<Loader>> loaders;
+        for (int i=0; i<n_loaders; i++) loaders.emplace_back(new Loader);
+        bool connected = true;
+        for (int i=0; i<n_clients and connected; i++) {
+            peers.emplace_back(new Peer(Peer::LOADER, 100+i));
+            connected = peers.back()->connect_to(port);
+            if (connected) loaders[i % n_loaders]->add(peers.back().get());
+        }
+        if (!connected) break;
+
+        // wait until everyone's registered and allowed to request. Nobody
+        // requests yet since there's no window.
+        window = 0;
+        std::vector<std::thread> threads;
+        for (auto& l : loaders) {
+            Loader* lp = l.get();
+            threads.emplace_back([lp]{
+                auto deadline = bench_clock::now()+30s;
+                lp->run_until([&]{
+                    if (bench_clock::now() > deadline) return true;
+                    for (auto p : lp->peers()) if (!p->open) return false;
+                    return true;
+                });
+            });
+        }
+        for (auto& t : threads) t.join();
+        threads.clear();
+
+        // 4. measure
+        window = saved_window;
+        auto start = bench_clock::now();
+        auto end = start+std::chrono::seconds(duration_s);
+        for (auto& l : loaders) {
+            Loader* lp = l.get();
+            threads.emplace_back([lp, end]{
+                for (auto p : lp->peers()) p->top_up();
+                lp->run_until([&]{ return bench_clock::now() > end; });
+            });
+        }
+        for (auto& t : threads) t.join();
+        r.secs = std::chrono::duration<double>(bench_clock::now()-start).count();
+
+        for (auto& l : loaders) {
+            for (auto p : l->peers()) r.received += p->received;
+        }
+        r.ok = true;
+    } while (false);
+
+    peers.clear();
+    srv_running = false;
+    srv.wake();
+    srv_thread.join();
+
+    std::cout.rdbuf(saved);
+    return r;
+}
+
+static void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 and rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+void print_usage() {
+    std::cout << "usage: bench_server_scaling [-T tcp|udp] [-s max_shards] [-c num_clients] [-k num_chunks] "
+                 "[-w window] [-d seconds] [-l load_threads] [-p port] [-u]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+
+    int max_shards = std::max(1u, std::thread::hardware_concurrency());
+    int n_clients = 1024;
+    int n_loaders = 2;
+    int duration_s = 3;
+    int port = 16000;
+    bool use_io_uring = false;
+    num_chunks = 1024;
+    Transport transport = Transport::UDP_CONTROL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:c:k:w:d:l:p:uT:")) != -1) {
+        switch (opt) {
+            case 's': max_shards = std::stoi(std::string(optarg)); break;
+            case 'c': n_clients = std::stoi(std::string(optarg)); break;
+            case 'k': num_chunks = std::stoi(std::string(optarg)); break;
+            case 'w': window = std::stoi(std::string(optarg)); break;
+            case 'd': duration_s = std::stoi(std::string(optarg)); break;
+            case 'l': n_loaders = std::stoi(std::string(optarg)); break;
+            case 'p': port = std::stoi(std::string(optarg)); break;
+            case 'u': use_io_uring = true; break;
+            case 'T':
+                if (!parse_transport(std::string(optarg), transport)) {
+                    print_usage();
+                    return 0;
+                }
+                break;
+            default:
+                print_usage();
+                return 0;
+        }
+    }
+    if (n_loaders < 1) n_loaders = 1;
+    control_on_tcp = transport == Transport::TCP_CONTROL;
+
+    raise_fd_limit();
+
+    // a file of exactly num_chunks full chunks
+    std::string file = "/tmp/bench_server_scaling_" + std::to_string(getpid()) + ".txt";
+    {
+        std::ofstream f(file);
+        std::minstd_rand rng{42};
+        for (size_t i=0; i<(size_t)num_chunks*1024-1; i++) f.put('a' + rng()%26);
+    }
+
+    printf("%s control, %d clients, %u chunks, window %d, %d load threads, %ds per run\n",
+           control_on_tcp ? "TCP" : "UDP", n_clients, num_chunks, window, n_loaders, duration_s);
+
+    std::vector<int> shard_counts;
+    for (int s=1; s<max_shards; s*=2) shard_counts.push_back(s);
+    shard_counts.push_back(max_shards);
+
+    double base = 0;
+    for (size_t i=0; i<shard_counts.size(); i++) {
+        int s = shard_counts[i];
+        RunResult r = control_on_tcp
+            ? bench_shards<TcpControl>(port+i, s, n_clients, n_loaders, duration_s, file, use_io_uring)
+            : bench_shards<UdpControl>(port+i, s, n_clients, n_loaders, duration_s, file, use_io_uring);
+        if (!r.ok) {
+            printf("shards=%-3d setup failed (%u chunks cached)\n", s, r.cached);
+            continue;
+        }
+        double rate = r.received/r.secs;
+        if (base == 0) base = rate;
+        printf("shards=%-3d %10.0f chunks/s  %6.2fx  (%u/%u chunks cached)\n",
+               s, rate, rate/base, r.cached, num_chunks);
+    }
+
+    unlink(file.c_str());
+    return 0;
+}
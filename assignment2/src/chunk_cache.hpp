@@ -0,0 +1,839 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+
+// The server's chunk cache, with a choice of eviction policies. All of them
+// keep to a budget in bytes (and a number of entries, the budget over the
+// chunk size) and never allocate once reserve() has run: entries, their
+// links and any ghost entries live in one preallocated CacheTable.
+//
+//   lru      evicts the least recently used chunk
+//   clock    LRU approximated with a reference bit, so hits don't relink
+//   arc      adaptive replacement: balances recency against frequency using
+//            ghost lists of recently evicted keys
+//   s3fifo   a small FIFO that filters out one-hit wonders (like a client
+//            scanning the whole file) before they reach the main FIFO
+//   tinylfu  W-TinyLFU: a small LRU window in front of a segmented LRU, and a
+//            count-min sketch that only lets a chunk into the main part if it
+//            has been asked for more often than the one it would evict
+
+enum class CachePolicy {
+    LRU,
+    CLOCK,
+    ARC,
+    S3FIFO,
+    TINYLFU
+};
+
+inline const char* cache_policy_name(CachePolicy p) {
+    switch (p) {
+        case CachePolicy::LRU:      return "lru";
+        case CachePolicy::CLOCK:    return "clock";
+        case CachePolicy::ARC:      return "arc";
+        case CachePolicy::S3FIFO:   return "s3fifo";
+        case CachePolicy::TINYLFU:  return "tinylfu";
+    }
+    return "?";
+}
+
+// false if s doesn't name a policy
+inline bool parse_cache_policy(const std::string& s, CachePolicy& p) {
+    for (CachePolicy q : { CachePolicy::LRU, CachePolicy::CLOCK, CachePolicy::ARC,
+                           CachePolicy::S3FIFO, CachePolicy::TINYLFU }) {
+        if (s == cache_policy_name(q)) {
+            p = q;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct CacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t insertions = 0;
+    uint64_t evictions = 0;
+    // chunks turned away: bigger than the whole cache, or (tinylfu) not asked
+    // for as often as the chunk they would have replaced
+    uint64_t rejected = 0;
+
+    void print(std::ostream& out, const std::string& label) const {
+        uint64_t lookups = hits+misses;
+        out << label << ": " << hits << " hits, " << misses << " misses (hit rate "
+            << (lookups ? 100.0*hits/lookups : 0.0) << "%), " << insertions << " insertions, "
+            << evictions << " evictions, " << rejected << " rejected" << std::endl;
+    }
+};
+
+// Entries, an open addressing index (linear probing) from keys to entries,
+// and up to MAX_LISTS intrusive doubly linked lists (by entry index) that the
+// policies keep their entries on. Every entry in use is on exactly one list.
+template<typename K, typename V>
+class CacheTable {
+
+public:
+
+    static const uint32_t NONE = UINT32_MAX;
+    static const size_t MAX_LISTS = 4;
+
+    struct Entry {
+        K key;
+        V value;
+        size_t bytes;
+        uint32_t prev;
+        uint32_t next;      // also links the free list
+        uint8_t list;
+        uint8_t freq;       // whatever the policy wants to count
+    };
+
+    struct List {
+        uint32_t head;      // most recent
+        uint32_t tail;
+        size_t size;
+        size_t bytes;
+    };
+
+private:
+
+    std::vector<Entry> _entries;
+    std::vector<uint32_t> _index;   // entry index, or NONE
+    size_t _mask = 0;
+    uint32_t _free = NONE;
+    List _lists[MAX_LISTS];
+
+    size_t home(const K& key) const {
+        // fibonacci hashing, so that runs of consecutive ids spread out
+        return (size_t)((std::hash<K>()(key) * 0x9E3779B97F4A7C15ull) >> 32) & _mask;
+    }
+
+    // the index slot that holds key, or the empty one where it would go
+    size_t find_slot(const K& key) const {
+        size_t i = home(key);
+        while (_index[i] != NONE and !(_entries[_index[i]].key == key)) {
+            i = (i+1) & _mask;
+        }
+        return i;
+    }
+
+    // empties index slot i, shifting back any entries further along the probe
+    // sequence that would otherwise become unreachable (so no tombstones)
+    void erase_slot(size_t i) {
+        size_t j = i;
+        while (true) {
+            j = (j+1) & _mask;
+            if (_index[j] == NONE) break;
+            size_t h = home(_entries[_index[j]].key);
+            // the entry at j can move to i if its home isn't in (i, j]
+            bool movable = (i <= j) ? (h <= i or h > j) : (h <= i and h > j);
+            if (movable) {
+                _index[i] = _index[j];
+                i = j;
+            }
+        }
+        _index[i] = NONE;
+    }
+
+public:
+
+    // drops everything and makes room for max_entries entries
+    void reserve(size_t max_entries) {
+        if (max_entries > NONE-1) max_entries = NONE-1;
+
+        _entries.assign(max_entries, Entry());
+        _free = NONE;
+        for (size_t e=max_entries; e-- > 0;) {
+            _entries[e].next = _free;
+            _free = e;
+        }
+
+        // at most half full, so probe sequences stay short
+        size_t n = 1;
+        while (n < 2*max_entries) n <<= 1;
+        _index.assign(n, NONE);
+        _mask = n-1;
+
+        for (auto& l : _lists) l = List{ NONE, NONE, 0, 0 };
+    }
+
+    uint32_t find(const K& key) const {
+        if (_entries.empty()) return NONE;
+        return _index[find_slot(key)];
+    }
+
+    bool full() const {
+        return _free == NONE;
+    }
+
+    Entry& operator[](uint32_t e) {
+        return _entries[e];
+    }
+
+    const Entry& operator[](uint32_t e) const {
+        return _entries[e];
+    }
+
+    const List& list(uint8_t l) const {
+        return _lists[l];
+    }
+
+    // a new entry for key (which mustn't be in the table yet) at the front of
+    // list l. The table mustn't be full.
+    uint32_t add(const K& key, size_t bytes, uint8_t l) {
+        uint32_t e = _free;
+        _free = _entries[e].next;
+        _index[find_slot(key)] = e;
+
+        Entry& x = _entries[e];
+        x.key = key;
+        x.bytes = bytes;
+        x.freq = 0;
+        push_front(e, l);
+        return e;
+    }
+
+    void remove(uint32_t e) {
+        unlink(e);
+        erase_slot(find_slot(_entries[e].key));
+        _entries[e].value = V();
+        _entries[e].next = _free;
+        _free = e;
+    }
+
+    void push_front(uint32_t e, uint8_t l) {
+        Entry& x = _entries[e];
+        List& list = _lists[l];
+        x.list = l;
+        x.prev = NONE;
+        x.next = list.head;
+        if (list.head != NONE) _entries[list.head].prev = e;
+        list.head = e;
+        if (list.tail == NONE) list.tail = e;
+        list.size++;
+        list.bytes += x.bytes;
+    }
+
+    void unlink(uint32_t e) {
+        Entry& x = _entries[e];
+        List& list = _lists[x.list];
+        if (x.prev != NONE) _entries[x.prev].next = x.next; else list.head = x.next;
+        if (x.next != NONE) _entries[x.next].prev = x.prev; else list.tail = x.prev;
+        list.size--;
+        list.bytes -= x.bytes;
+    }
+
+    void move_to_front(uint32_t e, uint8_t l) {
+        if (_entries[e].list == l and _lists[l].head == e) return;
+        unlink(e);
+        push_front(e, l);
+    }
+};
+
+template<typename K, typename V>
+const uint32_t CacheTable<K,V>::NONE;
+
+template<typename K, typename V>
+const size_t CacheTable<K,V>::MAX_LISTS;
+
+// What the server sees of a cache. access() counts a hit or a miss and hands
+// out a pointer to the cached value (not a copy), which stays valid until
+// the next insert. insert() is for keys that access() just missed.
+template<typename K, typename V>
+class ChunkCache {
+
+protected:
+
+    using Table = CacheTable<K,V>;
+    static const uint32_t NONE = Table::NONE;
+
+    Table _table;
+    size_t _max_bytes;
+    size_t _max_entries = 0;
+
+    // what's resident, ghost entries don't count
+    size_t _bytes = 0;
+    size_t _size = 0;
+
+    CacheStats _stats;
+
+    bool over_budget() const {
+        return _size > _max_entries or _bytes > _max_bytes;
+    }
+
+    bool fits(size_t bytes) const {
+        return _size < _max_entries and _bytes+bytes <= _max_bytes;
+    }
+
+    // the policy's own idea of which lists hold values
+    virtual bool resident(uint8_t list) const = 0;
+
+    uint32_t find_resident(const K& key) const {
+        uint32_t e = _table.find(key);
+        if (e == NONE or !resident(_table[e].list)) return NONE;
+        return e;
+    }
+
+    uint32_t admit(const K& key, V value, size_t bytes, uint8_t list) {
+        uint32_t e = _table.add(key, bytes, list);
+        _table[e].value = std::move(value);
+        _bytes += bytes;
+        _size++;
+        _stats.insertions++;
+        return e;
+    }
+
+    void evict(uint32_t e) {
+        _bytes -= _table[e].bytes;
+        _size--;
+        _table.remove(e);
+        _stats.evictions++;
+    }
+
+    // keeps the key around (without its value) on ghost list `list`
+    void evict_to_ghost(uint32_t e, uint8_t list) {
+        _bytes -= _table[e].bytes;
+        _size--;
+        _table.unlink(e);
+        _table[e].value = V();
+        _table[e].bytes = 0;
+        _table.push_front(e, list);
+        _stats.evictions++;
+    }
+
+    // a ghost comes back to life
+    void revive(uint32_t e, V value, size_t bytes, uint8_t list) {
+        _table.unlink(e);
+        _table[e].value = std::move(value);
+        _table[e].bytes = bytes;
+        _table.push_front(e, list);
+        _bytes += bytes;
+        _size++;
+        _stats.insertions++;
+    }
+
+    // handles the things every policy does the same way on insert: refusing
+    // what can never fit, and replacing the value of a key that's already
+    // cached. Returns true if there's nothing left to do.
+    bool insert_handled(const K& key, V& value, size_t bytes) {
+        if (bytes > _max_bytes or _max_entries == 0) {
+            _stats.rejected++;
+            return true;
+        }
+        uint32_t e = find_resident(key);
+        if (e == NONE) return false;
+
+        uint8_t list = _table[e].list;
+        _table.unlink(e);
+        _bytes -= _table[e].bytes;
+        _table[e].value = std::move(value);
+        _table[e].bytes = bytes;
+        _bytes += bytes;
+        _table.push_front(e, list);
+        return true;
+    }
+
+public:
+
+    explicit ChunkCache(size_t max_bytes):
+        _max_bytes{max_bytes} {}
+
+    virtual ~ChunkCache() {}
+
+    virtual const char* name() const = 0;
+
+    virtual V* access(const K& key) = 0;
+
+    virtual void insert(const K& key, V value, size_t bytes) = 0;
+
+    // drops everything and makes room for max_entries cached values (more
+    // than that would go over the byte budget anyway)
+    virtual void reserve(size_t max_entries) {
+        _max_entries = max_entries;
+        // ghosts and the odd entry over budget in between get room too
+        _table.reserve(2*max_entries+1);
+        _bytes = 0;
+        _size = 0;
+    }
+
+    // the cached value without counting a lookup or touching its recency,
+    // for when a chunk arrives rather than being asked for
+    V* peek(const K& key) {
+        uint32_t e = find_resident(key);
+        return e == NONE ? nullptr : &_table[e].value;
+    }
+
+    const CacheStats& stats() const {
+        return _stats;
+    }
+
+    size_t size() const {
+        return _size;
+    }
+
+    size_t bytes() const {
+        return _bytes;
+    }
+
+    size_t max_bytes() const {
+        return _max_bytes;
+    }
+
+    size_t max_entries() const {
+        return _max_entries;
+    }
+};
+
+template<typename K, typename V>
+class LruPolicy : public ChunkCache<K,V> {
+
+    using Base = ChunkCache<K,V>;
+    using Base::_table;
+    using Base::_stats;
+
+    static const uint8_t LRU = 0;
+
+    bool resident(uint8_t) const override {
+        return true;
+    }
+
+public:
+
+    using Base::Base;
+
+    const char* name() const override {
+        return "lru";
+    }
+
+    V* access(const K& key) override {
+        uint32_t e = _table.find(key);
+        if (e == Base::NONE) {
+            _stats.misses++;
+            return nullptr;
+        }
+        _stats.hits++;
+        _table.move_to_front(e, LRU);
+        return &_table[e].value;
+    }
+
+    void insert(const K& key, V value, size_t bytes) override {
+        if (Base::insert_handled(key, value, bytes)) return;
+        while (!Base::fits(bytes)) Base::evict(_table.list(LRU).tail);
+        Base::admit(key, std::move(value), bytes, LRU);
+    }
+};
+
+template<typename K, typename V>
+class ClockPolicy : public ChunkCache<K,V> {
+
+    using Base = ChunkCache<K,V>;
+    using Base::_table;
+    using Base::_stats;
+
+    // the clock is a FIFO with second chances: the hand is at the tail, and
+    // an entry with its reference bit (freq) set goes back to the front
+    static const uint8_t CLOCK = 0;
+
+    bool resident(uint8_t) const override {
+        return true;
+    }
+
+public:
+
+    using Base::Base;
+
+    const char* name() const override {
+        return "clock";
+    }
+
+    V* access(const K& key) override {
+        uint32_t e = _table.find(key);
+        if (e == Base::NONE) {
+            _stats.misses++;
+            return nullptr;
+        }
+        _stats.hits++;
+        _table[e].freq = 1;
+        return &_table[e].value;
+    }
+
+    void insert(const K& key, V value, size_t bytes) override {
+        if (Base::insert_handled(key, value, bytes)) return;
+        while (!Base::fits(bytes)) {
+            uint32_t e = _table.list(CLOCK).tail;
+            if (_table[e].freq) {
+                _table[e].freq = 0;
+                _table.move_to_front(e, CLOCK);
+            }
+            else {
+                Base::evict(e);
+            }
+        }
+        Base::admit(key, std::move(value), bytes, CLOCK);
+    }
+};
+
+// Megiddo and Modha's ARC, with the cache size c counted in entries. T1 holds
+// chunks seen once recently, T2 chunks seen at least twice, and B1/B2 the
+// keys most recently evicted from each. A hit in B1 means T1 should have been
+// bigger, so its target size p grows; a hit in B2 shrinks it.
+template<typename K, typename V>
+class ArcPolicy : public ChunkCache<K,V> {
+
+    using Base = ChunkCache<K,V>;
+    using Base::_table;
+    using Base::_stats;
+    using Base::_max_entries;
+
+    static const uint8_t T1 = 0;
+    static const uint8_t T2 = 1;
+    static const uint8_t B1 = 2;
+    static const uint8_t B2 = 3;
+
+    size_t _p = 0;
+
+    bool resident(uint8_t list) const override {
+        return list == T1 or list == T2;
+    }
+
+    size_t size(uint8_t list) const {
+        return _table.list(list).size;
+    }
+
+    void drop_ghost(uint8_t list) {
+        _table.remove(_table.list(list).tail);
+    }
+
+    // makes room by moving the LRU end of T1 or T2 to its ghost list
+    void replace(bool in_b2) {
+        size_t t1 = size(T1);
+        if (t1 > 0 and ((in_b2 and t1 == _p) or t1 > _p or size(T2) == 0)) {
+            Base::evict_to_ghost(_table.list(T1).tail, B1);
+        }
+        else if (size(T2) > 0) {
+            Base::evict_to_ghost(_table.list(T2).tail, B2);
+        }
+    }
+
+public:
+
+    using Base::Base;
+
+    const char* name() const override {
+        return "arc";
+    }
+
+    void reserve(size_t max_entries) override {
+        Base::reserve(max_entries);
+        _p = 0;
+    }
+
+    V* access(const K& key) override {
+        uint32_t e = Base::find_resident(key);
+        if (e == Base::NONE) {
+            _stats.misses++;
+            return nullptr;
+        }
+        _stats.hits++;
+        _table.move_to_front(e, T2);
+        return &_table[e].value;
+    }
+
+    void insert(const K& key, V value, size_t bytes) override {
+        if (Base::insert_handled(key, value, bytes)) return;
+        size_t c = _max_entries;
+
+        uint32_t e = _table.find(key);
+        if (e != Base::NONE and _table[e].list == B1) {
+            _p = std::min(c, _p + std::max<size_t>(1, size(B2)/size(B1)));
+            while (!Base::fits(bytes) and Base::size() > 0) replace(false);
+            Base::revive(e, std::move(value), bytes, T2);
+            return;
+        }
+        if (e != Base::NONE and _table[e].list == B2) {
+            _p -= std::min(_p, std::max<size_t>(1, size(B1)/size(B2)));
+            while (!Base::fits(bytes) and Base::size() > 0) replace(true);
+            Base::revive(e, std::move(value), bytes, T2);
+            return;
+        }
+
+        // a new key: keep the ghost lists from growing past c entries in all
+        size_t l1 = size(T1) + size(B1);
+        size_t total = l1 + size(T2) + size(B2);
+        if (l1 >= c) {
+            if (size(B1) > 0) drop_ghost(B1);
+            else Base::evict(_table.list(T1).tail);
+        }
+        else if (total >= 2*c and size(B2) > 0) {
+            drop_ghost(B2);
+        }
+        while (!Base::fits(bytes) and Base::size() > 0) replace(false);
+        Base::admit(key, std::move(value), bytes, T1);
+    }
+};
+
+// S3-FIFO (Yang et al., SOSP '23): new chunks go into a small FIFO that gets
+// 10% of the budget. Whatever is asked for again before it falls out of there
+// moves on to the main FIFO, everything else leaves only its key in a ghost
+// FIFO. A key that comes back while it's a ghost goes straight to main. Main
+// evicts like CLOCK, with a 2 bit counter instead of a reference bit.
+template<typename K, typename V>
+class S3FifoPolicy : public ChunkCache<K,V> {
+
+    using Base = ChunkCache<K,V>;
+    using Base::_table;
+    using Base::_stats;
+    using Base::_max_bytes;
+    using Base::_max_entries;
+
+    static const uint8_t SMALL = 0;
+    static const uint8_t MAIN = 1;
+    static const uint8_t GHOST = 2;
+
+    static const uint8_t MAX_FREQ = 3;
+
+    bool resident(uint8_t list) const override {
+        return list == SMALL or list == MAIN;
+    }
+
+    void evict_main() {
+        while (_table.list(MAIN).size > 0) {
+            uint32_t e = _table.list(MAIN).tail;
+            if (_table[e].freq > 0) {
+                _table[e].freq--;
+                _table.move_to_front(e, MAIN);
+            }
+            else {
+                Base::evict(e);
+                return;
+            }
+        }
+    }
+
+    void evict_small() {
+        while (_table.list(SMALL).size > 0) {
+            uint32_t e = _table.list(SMALL).tail;
+            if (_table[e].freq > 1) {
+                _table[e].freq = 0;
+                _table.move_to_front(e, MAIN);
+            }
+            else {
+                Base::evict_to_ghost(e, GHOST);
+                // the ghost FIFO remembers as many keys as main could hold
+                while (_table.list(GHOST).size > _max_entries) {
+                    _table.remove(_table.list(GHOST).tail);
+                }
+                return;
+            }
+        }
+        // everything in small was promoted
+        evict_main();
+    }
+
+    void evict_one() {
+        const auto& small = _table.list(SMALL);
+        if (small.size > 0 and (small.bytes >= _max_bytes/10 or _table.list(MAIN).size == 0)) {
+            evict_small();
+        }
+        else {
+            evict_main();
+        }
+    }
+
+public:
+
+    using Base::Base;
+
+    const char* name() const override {
+        return "s3fifo";
+    }
+
+    V* access(const K& key) override {
+        uint32_t e = Base::find_resident(key);
+        if (e == Base::NONE) {
+            _stats.misses++;
+            return nullptr;
+        }
+        _stats.hits++;
+        if (_table[e].freq < MAX_FREQ) _table[e].freq++;
+        return &_table[e].value;
+    }
+
+    void insert(const K& key, V value, size_t bytes) override {
+        if (Base::insert_handled(key, value, bytes)) return;
+
+        // forget the ghost first, making room could push it out anyway
+        uint32_t e = _table.find(key);
+        bool was_ghost = e != Base::NONE;
+        if (was_ghost) _table.remove(e);
+
+        while (!Base::fits(bytes)) evict_one();
+        Base::admit(key, std::move(value), bytes, was_ghost ? MAIN : SMALL);
+    }
+};
+
+// A count-min sketch of how often keys were asked for: 4 rows of counters
+// that saturate at 15, an estimate is the smallest of a key's 4 counters.
+// Once there have been 10 times as many increments as the cache has entries,
+// every counter is halved, so old popularity fades.
+template<typename K>
+class FrequencySketch {
+
+    static const int ROWS = 4;
+
+    std::vector<uint8_t> _counters;
+    size_t _mask = 0;
+    size_t _increments = 0;
+    size_t _sample_size = 0;
+
+    size_t slot(const K& key, int row) const {
+        static const uint64_t SEEDS[ROWS] = {
+            0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0xD6E8FEB86659FD93ull
+        };
+        uint64_t h = (std::hash<K>()(key) + 1) * SEEDS[row];
+        return row*(_mask+1) + ((h >> 32) & _mask);
+    }
+
+public:
+
+    void reserve(size_t max_entries) {
+        size_t width = 64;
+        while (width < max_entries) width <<= 1;
+        _counters.assign(ROWS*width, 0);
+        _mask = width-1;
+        _increments = 0;
+        _sample_size = 10*std::max<size_t>(max_entries, 1);
+    }
+
+    void increment(const K& key) {
+        for (int r=0; r<ROWS; r++) {
+            uint8_t& c = _counters[slot(key, r)];
+            if (c < 15) c++;
+        }
+        if (++_increments >= _sample_size) {
+            for (auto& c : _counters) c >>= 1;
+            _increments /= 2;
+        }
+    }
+
+    uint8_t estimate(const K& key) const {
+        uint8_t f = 15;
+        for (int r=0; r<ROWS; r++) f = std::min(f, _counters[slot(key, r)]);
+        return f;
+    }
+};
+
+// W-TinyLFU (Einziger et al.): new chunks go into an LRU window that gets 1%
+// of the budget. What falls out of the window only makes it into the main
+// cache if the sketch says it's asked for more often than main's next victim;
+// otherwise it's rejected. Main is a segmented LRU: a hit in probation
+// promotes to protected (80% of main), protected overflows back to probation.
+template<typename K, typename V>
+class TinyLfuPolicy : public ChunkCache<K,V> {
+
+    using Base = ChunkCache<K,V>;
+    using Base::_table;
+    using Base::_stats;
+    using Base::_max_bytes;
+
+    static const uint8_t WINDOW = 0;
+    static const uint8_t PROBATION = 1;
+    static const uint8_t PROTECTED = 2;
+
+    FrequencySketch<K> _sketch;
+
+    bool resident(uint8_t) const override {
+        return true;
+    }
+
+    size_t window_bytes() const {
+        return _max_bytes/100;
+    }
+
+    size_t protected_bytes() const {
+        return (_max_bytes-window_bytes())/10*8;
+    }
+
+    uint32_t main_victim() {
+        uint32_t e = _table.list(PROBATION).tail;
+        return e != Base::NONE ? e : _table.list(PROTECTED).tail;
+    }
+
+public:
+
+    using Base::Base;
+
+    const char* name() const override {
+        return "tinylfu";
+    }
+
+    void reserve(size_t max_entries) override {
+        Base::reserve(max_entries);
+        _sketch.reserve(max_entries);
+    }
+
+    V* access(const K& key) override {
+        _sketch.increment(key);
+
+        uint32_t e = _table.find(key);
+        if (e == Base::NONE) {
+            _stats.misses++;
+            return nullptr;
+        }
+        _stats.hits++;
+
+        uint8_t list = _table[e].list;
+        _table.move_to_front(e, list == WINDOW ? WINDOW : PROTECTED);
+        while (_table.list(PROTECTED).bytes > protected_bytes()) {
+            _table.move_to_front(_table.list(PROTECTED).tail, PROBATION);
+        }
+        return &_table[e].value;
+    }
+
+    void insert(const K& key, V value, size_t bytes) override {
+        if (Base::insert_handled(key, value, bytes)) return;
+        Base::admit(key, std::move(value), bytes, WINDOW);
+
+        // whatever the window can't hold is a candidate for main
+        while (_table.list(WINDOW).bytes > window_bytes() and _table.list(WINDOW).size > 1) {
+            uint32_t candidate = _table.list(WINDOW).tail;
+            uint32_t victim = main_victim();
+            if (!Base::over_budget() or victim == Base::NONE) {
+                _table.move_to_front(candidate, PROBATION);
+            }
+            else if (_sketch.estimate(_table[candidate].key) > _sketch.estimate(_table[victim].key)) {
+                Base::evict(victim);
+                _table.move_to_front(candidate, PROBATION);
+            }
+            else {
+                Base::evict(candidate);
+                _stats.rejected++;
+            }
+        }
+
+        while (Base::over_budget()) {
+            uint32_t victim = main_victim();
+            Base::evict(victim != Base::NONE ? victim : _table.list(WINDOW).tail);
+        }
+    }
+};
+
+template<typename K, typename V>
+std::unique_ptr<ChunkCache<K,V>> make_chunk_cache(CachePolicy p, size_t max_bytes, size_t max_entries) {
+    std::unique_ptr<ChunkCache<K,V>> c;
+    switch (p) {
+        case CachePolicy::LRU:      c.reset(new LruPolicy<K,V>(max_bytes)); break;
+        case CachePolicy::CLOCK:    c.reset(new ClockPolicy<K,V>(max_bytes)); break;
+        case CachePolicy::ARC:      c.reset(new ArcPolicy<K,V>(max_bytes)); break;
+        case CachePolicy::S3FIFO:   c.reset(new S3FifoPolicy<K,V>(max_bytes)); break;
+        case CachePolicy::TINYLFU:  c.reset(new TinyLfuPolicy<K,V>(max_bytes)); break;
+    }
+    c->reserve(max_entries);
+    return c;
+}
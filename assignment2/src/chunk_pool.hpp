@@ -0,0 +1,244 @@
+#pragma once
+
+#include <new>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+
+#include "protocol.hpp"
+
+// Chunk buffers for the server, which copies every chunk that comes back
+// from a client out of its receive buffer and keeps it until it's out of the
+// cache and every queue it went into. make_chunk costs two mallocs per chunk
+// (the buffer and shared_ptr's control block), and the frees then happen on
+// whichever shard let go of the chunk last.
+//
+// A ChunkPool hands out buffers for chunks of up to chunk_size bytes, carved
+// out of slabs of SLAB_CHUNKS at a time, and takes them back onto a free list
+// when the last ChunkHandle to one goes away. The reference count sits in
+// front of the chunk, in the same buffer. Once there are enough buffers for
+// what's cached and queued at the same time, nothing allocates anymore;
+// slab_allocations() shows whether that happened.
+
+class ChunkPool;
+
+namespace chunk_pool_detail {
+
+// what's in front of every pooled chunk
+struct Block {
+    std::atomic<uint32_t> refs;
+    ChunkPool* pool;
+    Block* next_free;
+
+    FileChunk* chunk() {
+        return (FileChunk*)((char*)this + HEADER);
+    }
+
+    static const size_t HEADER = (sizeof(std::atomic<uint32_t>) + 2*sizeof(void*) + 7) & ~(size_t)7;
+};
+
+}
+
+// Shared ownership of a pooled chunk, like a shared_ptr<FileChunk> (and used
+// the same way), but the count is in the chunk's own buffer.
+class ChunkHandle {
+
+    using Block = chunk_pool_detail::Block;
+
+    Block* _b = nullptr;
+
+    friend class ChunkPool;
+
+    explicit ChunkHandle(Block* b): _b{b} {}
+
+    void drop();
+
+public:
+
+    ChunkHandle() = default;
+
+    ChunkHandle(std::nullptr_t) {}
+
+    ChunkHandle(const ChunkHandle& h): _b{h._b} {
+        if (_b != nullptr) _b->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    ChunkHandle(ChunkHandle&& h) noexcept: _b{h._b} {
+        h._b = nullptr;
+    }
+
+    ChunkHandle& operator=(ChunkHandle h) noexcept {
+        std::swap(_b, h._b);
+        return *this;
+    }
+
+    ~ChunkHandle() {
+        drop();
+    }
+
+    FileChunk* get() const {
+        return _b != nullptr ? _b->chunk() : nullptr;
+    }
+
+    FileChunk* operator->() const {
+        return _b->chunk();
+    }
+
+    FileChunk& operator*() const {
+        return *_b->chunk();
+    }
+
+    explicit operator bool() const {
+        return _b != nullptr;
+    }
+
+    bool operator==(std::nullptr_t) const {
+        return _b == nullptr;
+    }
+
+    bool operator!=(std::nullptr_t) const {
+        return _b != nullptr;
+    }
+};
+
+class ChunkPool {
+
+    using Block = chunk_pool_detail::Block;
+
+    size_t _chunk_size;
+    size_t _stride;
+
+    // Any shard may let go of a chunk, so the free list is behind a lock,
+    // which is only held to push or pop one buffer (or to add a slab).
+    std::mutex _lock;
+    Block* _free = nullptr;
+    std::vector<std::unique_ptr<uint64_t[]>> _slabs;
+
+    uint64_t _acquired = 0;
+    uint64_t _in_use = 0;
+    uint64_t _high_water = 0;
+
+    friend class ChunkHandle;
+
+    void release(Block* b) {
+        std::lock_guard<std::mutex> guard(_lock);
+        b->next_free = _free;
+        _free = b;
+        _in_use--;
+    }
+
+    // with _lock held
+    void add_slab() {
+        _slabs.emplace_back(new uint64_t[SLAB_CHUNKS*_stride/sizeof(uint64_t)]);
+        char* p = (char*)_slabs.back().get();
+        for (size_t i=0; i<SLAB_CHUNKS; i++) {
+            Block* b = new (p + i*_stride) Block;
+            b->pool = this;
+            b->next_free = _free;
+            _free = b;
+        }
+    }
+
+public:
+
+    static const size_t SLAB_CHUNKS = 256;
+
+    explicit ChunkPool(size_t chunk_size):
+        _chunk_size{chunk_size},
+        _stride{Block::HEADER + chunk_alloc_size(chunk_size)} {}
+
+    ChunkPool(const ChunkPool&) = delete;
+    ChunkPool& operator=(const ChunkPool&) = delete;
+
+    // (every handle has to be gone by now)
+    ~ChunkPool() = default;
+
+    size_t chunk_size() const {
+        return _chunk_size;
+    }
+
+    // a buffer for a chunk of up to chunk_size() bytes; id and size are for
+    // the caller to fill in
+    ChunkHandle acquire() {
+        Block* b;
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            if (_free == nullptr) add_slab();
+            b = _free;
+            _free = b->next_free;
+            _acquired++;
+            if (++_in_use > _high_water) _high_water = _in_use;
+        }
+        b->refs.store(1, std::memory_order_relaxed);
+        return ChunkHandle(b);
+    }
+
+    // a pooled copy of c, which has to fit
+    ChunkHandle copy(const FileChunk& c) {
+        ChunkHandle h = acquire();
+        memcpy(h.get(), &c, chunk_wire_size(c));
+        return h;
+    }
+
+    // chunks handed out, slabs allocated for them, and the most that were
+    // in use at once
+    uint64_t acquired() {
+        std::lock_guard<std::mutex> guard(_lock);
+        return _acquired;
+    }
+
+    uint64_t slab_allocations() {
+        std::lock_guard<std::mutex> guard(_lock);
+        return _slabs.size();
+    }
+
+    uint64_t high_water() {
+        std::lock_guard<std::mutex> guard(_lock);
+        return _high_water;
+    }
+
+    void print(std::ostream& out, const std::string& label) {
+        std::lock_guard<std::mutex> guard(_lock);
+        out << label << ": " << _acquired << " chunks handed out from " << _slabs.size()*SLAB_CHUNKS
+            << " buffers (" << _slabs.size() << " slab allocations), at most " << _high_water
+            << " in use at once, " << _in_use << " still in use" << std::endl;
+    }
+};
+
+inline void ChunkHandle::drop() {
+    if (_b == nullptr) return;
+    if (_b->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) _b->pool->release(_b);
+    _b = nullptr;
+}
+
+// A chunk queued for sending: the header and the data go out back to back,
+// but don't have to sit next to each other. A pooled chunk keeps itself alive
+// through `owner`; chunks of a mapped file have no owner and point into the
+// mapping, which outlives every connection.
+struct ChunkRef {
+    const void* header;
+    const char* data;
+    uint32_t id;
+    uint16_t size;
+    ChunkHandle owner;
+
+    ChunkRef(): header{nullptr}, data{nullptr}, id{0}, size{0} {}
+
+    ChunkRef(ChunkHandle c):
+        header{c.get()}, data{c->data}, id{c->id}, size{c->size}, owner{std::move(c)} {}
+
+    ChunkRef(const ChunkHeader& h, const char* d):
+        header{&h}, data{d}, id{h.id}, size{h.size} {}
+
+    static const size_t HEADER = offsetof(FileChunk, data);
+
+    size_t wire_size() const {
+        return HEADER + size;
+    }
+};
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include "protocol.hpp"
+
+// Packing sets of chunk ids into REQ / REQ_RANGE / REQ_BITMAP packets (or
+// their HAVE counterparts) and unpacking them again (see BulkRequest in
+// protocol.hpp).
+
+// appends v as a varint (7 bits per byte, low bits first); false if it
+// doesn't fit
+inline bool put_varint(BulkRequest& r, uint32_t v) {
+    do {
+        if (r.count >= BULK_RUN_BYTES) return false;
+        uint8_t b = v & 0x7f;
+        v >>= 7;
+        r.runs[r.count++] = b | (v ? 0x80 : 0);
+    } while (v);
+    return true;
+}
+
+// false on a truncated varint
+inline bool get_varint(const BulkRequest& r, size_t& pos, uint32_t& v) {
+    v = 0;
+    for (int shift=0; shift<35; shift+=7) {
+        if (pos >= r.count) return false;
+        uint8_t b = r.runs[pos++];
+        v |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+// Calls emit(ControlPacket) with as few packets as it takes to list ids,
+// which must be sorted and unique. A lone chunk is a plain `one`, a
+// contiguous run a `range`, anything else goes into `bitmap`s.
+template<typename F>
+void encode_chunk_set(uint8_t one, uint8_t range, uint8_t bitmap, uint32_t client_id,
+                      const std::vector<uint32_t>& ids, F emit) {
+    BulkRequest r;
+    uint32_t end = 0;       // one past the last chunk covered by r
+    size_t n_runs = 0;
+    uint32_t first_take = 0;
+
+    auto flush = [&]() {
+        if (n_runs == 0) return;
+        if (n_runs == 1 and first_take == 1) {
+            emit(ControlPacket(ControlMessage{one, client_id, r.chunk_id}));
+        }
+        else if (n_runs == 1) {
+            r.msgtype = range;
+            r.count = first_take;
+            emit(ControlPacket(r));
+        }
+        else {
+            emit(ControlPacket(r));
+        }
+        n_runs = 0;
+    };
+
+    size_t i = 0;
+    while (i < ids.size()) {
+        // the next run of consecutive ids
+        size_t j = i+1;
+        while (j < ids.size() and ids[j] == ids[j-1]+1) j++;
+        uint32_t start = ids[i];
+        uint32_t take = j-i;
+
+        bool added = false;
+        if (n_runs > 0) {
+            uint32_t used = r.count;
+            added = put_varint(r, start-end) and put_varint(r, take);
+            if (!added) r.count = used;
+        }
+        if (!added) {
+            flush();
+            r.msgtype = bitmap;
+            r.client_id = client_id;
+            r.chunk_id = start;
+            r.count = 0;
+            put_varint(r, 0);
+            put_varint(r, take);
+            first_take = take;
+        }
+        n_runs++;
+        end = start+take;
+        i = j;
+    }
+    flush();
+}
+
+// asks for ids (sorted and unique)
+template<typename F>
+void encode_chunk_requests(uint32_t client_id, const std::vector<uint32_t>& ids, F emit) {
+    encode_chunk_set(REQ, REQ_RANGE, REQ_BITMAP, client_id, ids, emit);
+}
+
+// tells the server we have ids (sorted and unique)
+template<typename F>
+void encode_chunk_haves(uint32_t client_id, const std::vector<uint32_t>& ids, F emit) {
+    encode_chunk_set(HAVE, HAVE_RANGE, HAVE_BITMAP, client_id, ids, emit);
+}
+
+// calls f(chunk_id) for every chunk below tot_chunks that p asks for (or
+// announces, for HAVEs)
+template<typename F>
+void for_each_requested_chunk(const ControlPacket& p, uint32_t tot_chunks, F f) {
+    if (p.type() == REQ or p.type() == HAVE) {
+        if (p.msg.chunk_id < tot_chunks) f(p.msg.chunk_id);
+    }
+    else if (is_range_msg(p.type())) {
+        uint64_t end = (uint64_t)p.bulk.chunk_id + p.bulk.count;
+        if (end > tot_chunks) end = tot_chunks;
+        for (uint64_t id=p.bulk.chunk_id; id<end; id++) f((uint32_t)id);
+    }
+    else if (is_bitmap_msg(p.type())) {
+        uint64_t id = p.bulk.chunk_id;
+        size_t pos = 0;
+        uint32_t skip, take;
+        while (id < tot_chunks and get_varint(p.bulk, pos, skip) and get_varint(p.bulk, pos, take)) {
+            id += skip;
+            uint64_t end = id + take;
+            if (end > tot_chunks) end = tot_chunks;
+            for (; id<end; id++) f((uint32_t)id);
+            id = end;
+        }
+    }
+}
+
+// Calls emit(ControlPacket) with as few AVAIL packets as it takes to send
+// avail (one entry per chunk): varint pairs of how many chunks in a row and
+// how available each of them is. Most of a file tends to be equally
+// available, so this is usually a handful of packets.
+template<typename F>
+void encode_availability(uint32_t client_id, const std::vector<uint8_t>& avail, F emit) {
+    BulkRequest r;
+    r.msgtype = AVAIL;
+    r.client_id = client_id;
+    r.chunk_id = 0;
+    r.count = 0;
+
+    size_t i = 0;
+    while (i < avail.size()) {
+        size_t j = i+1;
+        while (j < avail.size() and avail[j] == avail[i]) j++;
+
+        uint32_t used = r.count;
+        if (!(put_varint(r, j-i) and put_varint(r, avail[i]))) {
+            r.count = used;
+            emit(ControlPacket(r));
+            r.chunk_id = i;
+            r.count = 0;
+            put_varint(r, j-i);
+            put_varint(r, avail[i]);
+        }
+        i = j;
+    }
+    if (r.count > 0) emit(ControlPacket(r));
+}
+
+// calls f(chunk_id, availability) for every chunk below tot_chunks in an AVAIL
+template<typename F>
+void for_each_availability(const ControlPacket& p, uint32_t tot_chunks, F f) {
+    if (p.type() != AVAIL) return;
+    uint64_t id = p.bulk.chunk_id;
+    size_t pos = 0;
+    uint32_t run, avail;
+    while (id < tot_chunks and get_varint(p.bulk, pos, run) and get_varint(p.bulk, pos, avail)) {
+        uint64_t end = id + run;
+        if (end > tot_chunks) end = tot_chunks;
+        for (; id<end; id++) f((uint32_t)id, avail);
+    }
+}
+
+// calls emit(ControlPacket) with the PEERS packets it takes to send entries
+template<typename F>
+void encode_peer_list(uint32_t client_id, const std::vector<PeerEntry>& entries, F emit) {
+    PeerList l;
+    l.msgtype = PEERS;
+    l.client_id = client_id;
+    for (size_t i=0; i<entries.size(); i+=MAX_PEER_ENTRIES) {
+        l.count = std::min(entries.size()-i, MAX_PEER_ENTRIES);
+        std::copy(entries.begin()+i, entries.begin()+i+l.count, l.peers);
+        emit(ControlPacket(l));
+    }
+}
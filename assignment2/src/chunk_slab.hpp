@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "protocol.hpp"
+
+// n chunks of up to chunk_size bytes each, back to back in one allocation
+// (FileChunk itself is sized for the biggest chunk there can be).
+class ChunkSlab {
+
+    std::vector<uint64_t> _mem;
+    size_t _stride = 0;
+    size_t _n = 0;
+
+public:
+
+    void assign(size_t n, size_t chunk_size) {
+        _stride = chunk_alloc_size(chunk_size);
+        _n = n;
+        _mem.assign(n*_stride/sizeof(uint64_t), 0);
+    }
+
+    size_t size() {
+        return _n;
+    }
+
+    FileChunk& operator[](size_t i) {
+        return *(FileChunk*)((char*)_mem.data() + i*_stride);
+    }
+};
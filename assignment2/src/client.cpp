@@ -10,9 +10,20 @@ void terminate(int signal) {
 // args:
 // 1. Server address
 // 2. Server port
+// 3. -u: use the io_uring engine instead of epoll/kqueue (linux only)
+// 4. -b: max datagrams per sendmmsg
+// 5. -r: ask for the rarest chunks first rather than going through the file
+//        in order
+// 6. -q: how much of the chunks the server asked for may wait to go out (in
+//        kB); asks beyond that are dropped (0 for no limit)
+// 7. -T: which layer carries control messages, tcp or udp (the default); has
+//        to be the server's
+// 8. -w: the most chunk requests to keep outstanding; the window grows up to
+//        this while chunks come in and is halved on timeouts (down to 4, or
+//        -w itself if that's less)
 
 void print_usage() {
-    std::cout << "usage: client_(tcp|udp) [-a address] [-p port] [-o output_folder]" << std::endl;
+    std::cout << "usage: client [-T tcp|udp] [-a address] [-p port] [-o output_folder] [-u] [-b udp_batch_size] [-r] [-q max_queued_kb] [-w max_window]" << std::endl;
 }
 
 int main(int argc, char** argv) {
@@ -24,23 +35,52 @@ int main(int argc, char** argv) {
     std::string addr = "127.0.0.1";
     int port = 15000;
     std::string out_folder = ".";
+    bool use_io_uring = false;
+    int udp_batch_size = 32;
+    bool rarest_first = false;
+    int max_queued_kb = -1;
+    int max_window = RequestWindow::DEFAULT_MAX;
+    Transport transport = Transport::UDP_CONTROL;
 
     char opt;
-    while ((opt = getopt(argc, argv, "a:p:o:")) != -1) {
-        std::cout << "Got opt " << opt << " with arg " << std::string(optarg) << std::endl;
+    while ((opt = getopt(argc, argv, "a:p:o:ub:rq:T:w:")) != -1) {
+        std::cout << "Got opt " << opt << (optarg ? " with arg " + std::string(optarg) : "") << std::endl;
         switch (opt) {
             case 'a': addr = std::string(optarg); break;
             case 'p': port = std::stoi(std::string(optarg)); break;
             case 'o': out_folder = std::string(optarg); break;
+            case 'u': use_io_uring = true; break;
+            case 'b': udp_batch_size = std::stoi(std::string(optarg)); break;
+            case 'r': rarest_first = true; break;
+            case 'q': max_queued_kb = std::stoi(std::string(optarg)); break;
+            case 'w': max_window = std::stoi(std::string(optarg)); break;
+            case 'T':
+                if (!parse_transport(std::string(optarg), transport)) {
+                    std::cout << "client: unknown transport " << optarg << std::endl;
+                    print_usage();
+                    return 0;
+                }
+                break;
             default:
                 print_usage();
                 return 0;
         }
     }
 
-    Client clt(addr, port, out_folder);
+    if (max_window <= 0) {
+        print_usage();
+        return 0;
+    }
+
+    with_transport(transport, [&](auto tp) {
+        Client<decltype(tp)> clt(addr, port, out_folder, use_io_uring);
+        clt.set_udp_batch_size(udp_batch_size);
+        clt.set_rarest_first(rarest_first);
+        if (max_queued_kb >= 0) clt.set_max_pending((size_t)max_queued_kb*1024);
+        clt.set_max_window(max_window);
 
-    clt.run(running);
+        clt.run(running);
+    });
 
     return 0;
 }
@@ -13,6 +13,7 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <queue>
+#include <deque>
 #include <random>
 #include <memory>
 #include <fstream>
@@ -21,6 +22,13 @@
 
 #include "event_queue.hpp"
 #include "protocol.hpp"
+#include "udp_batch.hpp"
+#include "reactor_stats.hpp"
+#include "stream_codec.hpp"
+#include "chunk_requests.hpp"
+#include "chunk_slab.hpp"
+#include "transport.hpp"
+#include "request_window.hpp"
 
 using namespace std::literals;
 
@@ -28,6 +36,9 @@ using udpaddr_t = struct sockaddr_in;
 
 extern volatile bool running;
 
+// Transport says which layer carries control and which carries chunks, and
+// has to be the server's (see transport.hpp)
+template<typename Transport>
 class Client {
 
     uintptr_t _tcp_sock;
@@ -41,6 +52,19 @@ class Client {
     std::unordered_map<uint32_t, std::chrono::microseconds> 
         _chunk_rtt_times;
 
+    // how many of those there may be at once (see request_window.hpp), and
+    // what it was, how much came in and how much was lost, every timer tick
+    struct WindowSample {
+        int64_t ms;
+        size_t window;
+        RequestWindow::Sample s;
+    };
+
+    RequestWindow _window;
+    std::vector<WindowSample> _window_log;
+    std::chrono::steady_clock::time_point _window_log_start;
+    std::chrono::steady_clock::time_point _last_window_sample;
+
     EventQueue _evt_queue;
 
     bool _registered = false;
@@ -51,13 +75,54 @@ class Client {
     uint32_t _num_chunks;
     uint32_t _num_rcvd_chunks = 0;
 
-    std::vector<std::unique_ptr<FileChunk>> _chunks;
+    // one contiguous slab, sized once we know how many chunks there are and
+    // how big they are. _rcvd_chunks says which slots are actually filled in.
+    uint32_t _chunk_size = DEFAULT_CHUNK_SIZE;
+    ChunkSlab _chunks;
     std::vector<bool> _rcvd_chunks;
 
-    std::queue<uint32_t> _chunk_buffer;
-    std::queue<ControlMessage> _control_msg_buffer;
+    std::deque<uint32_t> _chunk_buffer;
+    std::deque<ControlPacket> _control_msg_buffer;
+
+    // Chunks the server or a peer asked us for are only queued up to
+    // _max_pending bytes (0 for no limit), between them; asks beyond that
+    // are dropped, and asked again (of someone else) once they time out.
+    // High water marks for the report.
+    static const size_t DEFAULT_MAX_PENDING = 4*1024*1024;
+    size_t _max_pending = DEFAULT_MAX_PENDING;
+    size_t _bytes_pending = 0;
+    size_t _high_water_bytes = 0;
+    size_t _high_water_chunks = 0;
+    uint64_t _asks_dropped = 0;
+    uint64_t _peer_asks_dropped = 0;
+    uint64_t _udp_send_full = 0;
+
+    // what a datagram coming in on UDP can be at most, see Server::udp_slot_size
+    static size_t udp_slot_size(size_t chunk_size) {
+        return Transport::CONTROL_OVER_TCP ? chunk_alloc_size(chunk_size) : sizeof(ControlPacket)+1;
+    }
+
+    // Receive buffers are sized for the biggest chunk there is until REG
+    // tells us the chunk size (chunks can get here before it does), and for
+    // that chunk size from then on.
+    static const size_t DEFAULT_UDP_BATCH_SIZE = 32;
+    UdpBatch _udp_batch{DEFAULT_UDP_BATCH_SIZE};
+    UdpRecvBatch _udp_recv_batch{DEFAULT_UDP_BATCH_SIZE, udp_slot_size(MAX_CHUNK_SIZE)};
+
+    std::queue<std::shared_ptr<FileChunk>> _recv_chunk_cache;
 
-    std::queue<std::unique_ptr<FileChunk>> _recv_chunk_cache;
+    // framing state for whatever the TCP stream carries, and where a chunk
+    // coming in on it is taken apart
+    FrameReader _tcp_reader{64*1024};
+    FrameWriter _tcp_writer;
+    ChunkBuffer _frame_chunk{MAX_CHUNK_SIZE};
+
+    // EVFILT_WRITE is only registered while the matching buffer has
+    // something in it, see update_write_interest()
+    bool _tcp_write_armed = false;
+    bool _udp_write_armed = false;
+
+    ReactorStats _stats;
 
     // chunk requests may be randomized across clients while testing
     // solution: have a random permutation of chunk id's that we'll use and then
@@ -66,39 +131,115 @@ class Client {
 
     size_t _next_chunk_idx = 0;
 
+    // Rarest first: rather than going through the file in order, ask for the
+    // chunks the fewest clients have first (going by the server's AVAIL), so
+    // they get copied while whoever has them is still around. _shuffled is
+    // this client's own random order, to break ties differently from
+    // everyone else.
+    bool _rarest_first = false;
+    std::vector<uint32_t> _shuffled;
+    std::vector<uint8_t> _availability;
+    bool _availability_changed = false;
+
+    // chunks picked for requesting in this loop iteration
+    std::vector<uint32_t> _new_requests;
+
+    // chunks we got that the server hasn't heard about from us yet
+    std::vector<uint32_t> _new_haves;
+
+    // P2P mode (the server said REG_P2P): chunks come from other clients,
+    // over _peer_sock, which also serves ours to them. The server only tells
+    // us who has what (PEERS); it needs our port for that (PEER), which goes
+    // out again every timer tick until something comes back that shows the
+    // server got it. Chunks for peers count against _max_pending, our
+    // requests to them are only ever what the request window lets out.
+    struct PeerDatagram {
+        udpaddr_t to;
+        uint8_t kind;           // PEER_REQUEST or PEER_CHUNK
+        uint32_t chunk_id;      // PEER_CHUNK
+        ControlPacket request;  // PEER_REQUEST
+    };
+
+    bool _p2p = false;
+    bool _peer_port_known = false;
+    uintptr_t _peer_sock = -1;
+    uint16_t _peer_port = 0;
+    bool _peer_write_armed = false;
+    std::deque<PeerDatagram> _peer_buffer;
+    // one datagram from a peer, big enough for any chunk
+    std::shared_ptr<FileChunk> _peer_recv = make_chunk(MAX_CHUNK_SIZE);
+    // scratch space for sorting PEERS by peer
+    std::unordered_map<uint64_t,std::vector<uint32_t>> _requests_by_peer;
+
     std::string _output_folder;
     std::string _rtt_file_name;
 
     std::function<void(void)> _save_file_callback;
     bool _save_file_callback_bound = false;
 
+#ifdef HAVE_IO_URING
+    // receive slots registered with the ring, see Server::_io_recv_slots.
+    // Only set up once REG says how big they have to be; until then, UDP is
+    // read the readiness way.
+    static const size_t IO_RECV_SLOTS = 64;
+    std::vector<uint64_t> _io_recv_slots;
+    size_t _io_recv_stride = 0;
+
+    FileChunk& io_recv_slot(size_t slot) {
+        return *(FileChunk*)((char*)_io_recv_slots.data() + slot*_io_recv_stride);
+    }
+    std::vector<size_t> _io_recv_unqueued;
+    std::vector<size_t> _io_recv_requeueing;
+
+    void queue_recv(size_t slot) {
+        if (!_evt_queue.io_uring()->queue_recv_fixed(_udp_sock, &io_recv_slot(slot), _io_recv_stride, slot)) {
+            _io_recv_unqueued.push_back(slot);
+        }
+    }
+
+    void requeue_recvs() {
+        _io_recv_requeueing.swap(_io_recv_unqueued);
+        for (auto slot : _io_recv_requeueing) {
+            queue_recv(slot);
+        }
+        _io_recv_requeueing.clear();
+    }
+#endif
+
 public:
 
-    Client(std::string server_addr, uint16_t server_port, std::string output_folder):
+    Client(std::string server_addr, uint16_t server_port, std::string output_folder,
+           bool use_io_uring = false):
+           _evt_queue{use_io_uring},
            _output_folder{output_folder} {
 
         struct addrinfo* dest_addr = addr_info(server_addr, server_port, SOCK_STREAM);
         _tcp_sock = create_socket(dest_addr);
 
-        if (_tcp_sock == -1) {
+        if (_tcp_sock == (uintptr_t)-1) {
             std::cout << "Could not make TCP socket" << std::endl;
             return;
         }
 
         configure_tcp(_tcp_sock);
 
-        // connect TCP socket
-        int err = connect(_tcp_sock, dest_addr->ai_addr, dest_addr->ai_addrlen);
+        // bind TCP to an ephemeral port up front, so that the UDP socket can
+        // take the same port *before* we connect. The server starts sending
+        // datagrams as soon as it accepts us, and anything that shows up
+        // before the UDP socket is bound is silently dropped.
+        struct sockaddr_in src_addr;
+        memset(&src_addr, 0, sizeof(src_addr));
+        src_addr.sin_family = AF_INET;
+        src_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        src_addr.sin_port = 0;
+        socklen_t len = sizeof(src_addr);
+
+        int err = bind(_tcp_sock, (struct sockaddr*)&src_addr, len);
         if (err == -1) {
-            std::cout << "Could not connect socket (errno " << errno << ")" << std::endl;
+            std::cout << "Could not bind TCP socket (errno " << errno << ")" << std::endl;
             running = false;
             return;
-            //err = connect(_tcp_sock, dest_addr->ai_addr, dest_addr->ai_addrlen);
         }
-
-        // get TCP socket local address
-        struct sockaddr_in src_addr;
-        socklen_t len = sizeof(src_addr);
         getsockname(_tcp_sock, (struct sockaddr*)&src_addr, &len);
 
         // we use this to initialize UDP, as we want it to be bound at the same
@@ -107,10 +248,12 @@ public:
         dest_addr->ai_protocol = IPPROTO_UDP;
         _udp_sock = create_socket(dest_addr);
 
-        if (_udp_sock == -1) {
+        if (_udp_sock == (uintptr_t)-1) {
             std::cout << "Could not make UDP socket" << std::endl;
             return;
         }
+        setsockopt(_udp_sock, SOL_SOCKET, SO_RCVBUF, &UDP_SOCKET_BUFFER, sizeof(UDP_SOCKET_BUFFER));
+        setsockopt(_udp_sock, SOL_SOCKET, SO_SNDBUF, &UDP_SOCKET_BUFFER, sizeof(UDP_SOCKET_BUFFER));
 
         err = bind(_udp_sock, (struct sockaddr*)&src_addr, len);
         if (err == -1) {
@@ -119,6 +262,17 @@ public:
             return;
         }
 
+        // connect TCP socket
+        dest_addr->ai_socktype = SOCK_STREAM;
+        dest_addr->ai_protocol = IPPROTO_TCP;
+        err = connect(_tcp_sock, dest_addr->ai_addr, dest_addr->ai_addrlen);
+        if (err == -1) {
+            std::cout << "Could not connect socket (errno " << errno << ")" << std::endl;
+            running = false;
+            return;
+            //err = connect(_tcp_sock, dest_addr->ai_addr, dest_addr->ai_addrlen);
+        }
+
         // connect UDP socket now
         err = connect(_udp_sock, dest_addr->ai_addr, dest_addr->ai_addrlen);
         if (err == -1) {
@@ -136,6 +290,23 @@ public:
         std::cout << "Created client and connected to server" << std::endl;
     }
 
+    void set_udp_batch_size(size_t n) {
+        _udp_batch.resize(n);
+        _udp_recv_batch.resize(n);
+    }
+
+    void set_rarest_first(bool on) {
+        _rarest_first = on;
+    }
+
+    void set_max_pending(size_t bytes) {
+        _max_pending = bytes;
+    }
+
+    void set_max_window(size_t chunks) {
+        _window.set_limits(RequestWindow::DEFAULT_MIN, chunks);
+    }
+
     void on_save_file(std::function<void(void)> save_file_callback) {
         _save_file_callback = save_file_callback;
         _save_file_callback_bound = true;
@@ -167,7 +338,7 @@ public:
         }
 
         uintptr_t fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-        if (fd == -1) {
+        if (fd == (uintptr_t)-1) {
             std::cout << "ERROR: failed to allocate socket (errno " << errno << ")" << std::endl;
             return -1;
         }
@@ -179,17 +350,176 @@ public:
 
     void setup_evt_queue() {
         _evt_queue.add_event(_tcp_sock, EVFILT_READ);
-        _evt_queue.add_event(_tcp_sock, EVFILT_WRITE);
         _evt_queue.add_event(_udp_sock, EVFILT_READ);
-        _evt_queue.add_event(_udp_sock, EVFILT_WRITE);
+    }
+
+    void update_write_interest() {
+        bool tcp = wants_write_TCP(), udp = wants_write_UDP();
+        if (tcp != _tcp_write_armed) {
+            if (tcp) _evt_queue.add_event(_tcp_sock, EVFILT_WRITE);
+            else _evt_queue.delete_event(_tcp_sock, EVFILT_WRITE);
+            _tcp_write_armed = tcp;
+        }
+        if (udp != _udp_write_armed) {
+            if (udp) _evt_queue.add_event(_udp_sock, EVFILT_WRITE);
+            else _evt_queue.delete_event(_udp_sock, EVFILT_WRITE);
+            _udp_write_armed = udp;
+        }
+        bool peer = !_peer_buffer.empty();
+        if (_p2p and peer != _peer_write_armed) {
+            if (peer) _evt_queue.add_event(_peer_sock, EVFILT_WRITE);
+            else _evt_queue.delete_event(_peer_sock, EVFILT_WRITE);
+            _peer_write_armed = peer;
+        }
+    }
+
+    // an unconnected UDP socket on any port, for the other clients to reach
+    // us on
+    bool open_peer_socket() {
+        _peer_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (_peer_sock == (uintptr_t)-1) {
+            std::cout << "Could not make peer socket (errno " << errno << ")" << std::endl;
+            return false;
+        }
+        setsockopt(_peer_sock, SOL_SOCKET, SO_RCVBUF, &UDP_SOCKET_BUFFER, sizeof(UDP_SOCKET_BUFFER));
+        setsockopt(_peer_sock, SOL_SOCKET, SO_SNDBUF, &UDP_SOCKET_BUFFER, sizeof(UDP_SOCKET_BUFFER));
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = 0;
+        socklen_t len = sizeof(addr);
+        if (bind(_peer_sock, (struct sockaddr*)&addr, len) == -1 or
+            getsockname(_peer_sock, (struct sockaddr*)&addr, &len) == -1) {
+            std::cout << "Could not bind peer socket (errno " << errno << ")" << std::endl;
+            close(_peer_sock);
+            return false;
+        }
+        _peer_port = ntohs(addr.sin_port);
+
+        fcntl(_peer_sock, F_SETFL, O_NONBLOCK);
+        _evt_queue.add_event(_peer_sock, EVFILT_READ);
+        std::cout << "Serving peers on port " << _peer_port << std::endl;
+        return true;
+    }
+
+    void announce_peer_port() {
+        _control_msg_buffer.push_back(ControlMessage{PEER,_client_id,_peer_port});
+    }
+
+    // the server says where to get some of the chunks we asked it for; every
+    // peer gets one request for all of its chunks
+    void received_peers(const PeerList& l) {
+        for (auto& r : _requests_by_peer) r.second.clear();
+        for (uint32_t i=0; i<l.count; i++) {
+            const PeerEntry& e = l.peers[i];
+            if (e.chunk_id >= _num_chunks or _rcvd_chunks[e.chunk_id]) continue;
+            _requests_by_peer[((uint64_t)e.addr<<16) | e.port].push_back(e.chunk_id);
+        }
+
+        for (auto& r : _requests_by_peer) {
+            if (r.second.empty()) continue;
+            udpaddr_t to;
+            memset(&to, 0, sizeof(to));
+            to.sin_family = AF_INET;
+            to.sin_addr.s_addr = (uint32_t)(r.first >> 16);
+            to.sin_port = (uint16_t)r.first;
+
+            std::sort(r.second.begin(), r.second.end());
+            r.second.erase(std::unique(r.second.begin(), r.second.end()), r.second.end());
+            encode_chunk_requests(_client_id, r.second, [this,&to](const ControlPacket& p) {
+                _peer_buffer.push_back(PeerDatagram{ to, PEER_REQUEST, 0, p });
+            });
+        }
+    }
+
+    void can_read_peer() {
+        uint8_t kind;
+        struct sockaddr_in from;
+        struct iovec iov[2] = {
+            { &kind, 1 },
+            { _peer_recv.get(), chunk_alloc_size(MAX_CHUNK_SIZE) }
+        };
+
+        // don't let a flood of peers starve the server's socket
+        for (int i=0; i<64; i++) {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_name = &from;
+            msg.msg_namelen = sizeof(from);
+            msg.msg_iov = iov;
+            msg.msg_iovlen = 2;
+
+            ssize_t n = recvmsg(_peer_sock, &msg, 0);
+            if (n == -1) {
+                if (errno != EAGAIN and errno != EWOULDBLOCK) {
+                    std::cerr << "Error while reading from peer socket (errno " << errno << ")" << std::endl;
+                }
+                return;
+            }
+            if (n < 1) continue;
+
+            if (kind == PEER_CHUNK) {
+                if (chunk_complete(*_peer_recv, n-1)) received_chunk(*_peer_recv);
+            }
+            else if (kind == PEER_REQUEST and _registered) {
+                ControlPacket p;
+                if (!ControlPacket::parse(_peer_recv.get(), n-1, p)) continue;
+                if (p.type() != REQ and p.type() != REQ_RANGE and p.type() != REQ_BITMAP) continue;
+                // only the server hands out our port, so it has it
+                _peer_port_known = true;
+                for_each_requested_chunk(p, _num_chunks, [this,&from](uint32_t chunk_id) {
+                    if (_rcvd_chunks[chunk_id]) send_chunk_to_peer(from, chunk_id);
+                });
+            }
+        }
+    }
+
+    void send_chunk_to_peer(const udpaddr_t& to, uint32_t chunk_id) {
+        size_t bytes = chunk_wire_size(_chunks[chunk_id]);
+        if (_max_pending > 0 and _bytes_pending + bytes > _max_pending) {
+            _peer_asks_dropped++;
+            return;
+        }
+        _peer_buffer.push_back(PeerDatagram{ to, PEER_CHUNK, chunk_id, {} });
+        _bytes_pending += bytes;
+        _high_water_bytes = std::max(_high_water_bytes, _bytes_pending);
+    }
+
+    void can_write_peer() {
+        while (!_peer_buffer.empty()) {
+            PeerDatagram& d = _peer_buffer.front();
+            struct iovec iov[2];
+            iov[0] = { &d.kind, 1 };
+            if (d.kind == PEER_CHUNK) iov[1] = { &_chunks[d.chunk_id], chunk_wire_size(_chunks[d.chunk_id]) };
+            else iov[1] = { &d.request, d.request.size() };
+
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_name = &d.to;
+            msg.msg_namelen = sizeof(d.to);
+            msg.msg_iov = iov;
+            msg.msg_iovlen = 2;
+
+            if (sendmsg(_peer_sock, &msg, 0) == -1) {
+                if (errno == EAGAIN or errno == EWOULDBLOCK) return;
+                // the peer went away, or whatever it was, it won't get better
+                std::cerr << "Error while writing to peer socket (errno " << errno << ")" << std::endl;
+            }
+            if (d.kind == PEER_CHUNK) {
+                _bytes_pending -= std::min(_bytes_pending, chunk_wire_size(_chunks[d.chunk_id]));
+            }
+            _peer_buffer.pop_front();
+        }
     }
 
     void init_chunk_request_sequence(bool randomize) {
         _req_sequence.resize(_num_chunks);
-        _chunks.resize(_num_chunks);
+        _chunks.assign(_num_chunks, _chunk_size);
         _rcvd_chunks.resize(_num_chunks, false);
 
-        std::cout << "There are " << _num_chunks << " chunks making up the file" << std::endl;
+        std::cout << "There are " << _num_chunks << " chunks of " << _chunk_size << " bytes making up the file" << std::endl;
 
         for (uint32_t i=0; i<_num_chunks; i++) {
             _req_sequence[i] = i;
@@ -203,6 +533,37 @@ public:
 
             std::shuffle(_req_sequence.begin(), _req_sequence.end(), rng);
         }
+
+        if (_rarest_first) {
+            _shuffled = _req_sequence;
+            _availability.assign(_num_chunks, 0);
+        }
+    }
+
+    // rebuilds _req_sequence from the chunks we neither have nor are waiting
+    // for, least available first (a counting sort, the file can have millions
+    // of chunks). Chunks nobody is known to have go last.
+    void reorder_rarest_first() {
+        const size_t LAST = MAX_AVAILABILITY+1;
+        size_t start[LAST+2] = {0};
+
+        auto key = [this](uint32_t id) -> size_t {
+            return _availability[id] == 0 ? LAST : _availability[id];
+        };
+        auto wanted = [this](uint32_t id) {
+            return !_rcvd_chunks[id] and _chunk_request_times.find(id) == _chunk_request_times.end();
+        };
+
+        for (uint32_t id : _shuffled) {
+            if (wanted(id)) start[key(id)+1]++;
+        }
+        for (size_t k=1; k<LAST+2; k++) start[k] += start[k-1];
+
+        _req_sequence.resize(start[LAST+1]);
+        for (uint32_t id : _shuffled) {
+            if (wanted(id)) _req_sequence[start[key(id)]++] = id;
+        }
+        _next_chunk_idx = 0;
     }
 
     void save_file() {
@@ -213,8 +574,8 @@ public:
         std::string outfile = _output_folder+"/outfile_"+std::to_string(_client_id)+".txt";
         std::ofstream f(outfile);
 
-        for (int i=0; i<_num_chunks; i++) {
-            f.write(_chunks[i]->data, _chunks[i]->size);
+        for (uint32_t i=0; i<_num_chunks; i++) {
+            f.write(_chunks[i].data, _chunks[i].size);
         }
 
         f.close();
@@ -234,7 +595,39 @@ public:
         out.close();
     }
 
-    // implementation defined
+    // what the request window did since the last sample; printed, and kept
+    // for save_window_log
+    void sample_window() {
+        auto now = std::chrono::steady_clock::now();
+        double secs = std::chrono::duration<double>(now - _last_window_sample).count();
+        _last_window_sample = now;
+
+        WindowSample w;
+        w.ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - _window_log_start).count();
+        w.window = _window.size();
+        w.s = _window.take_sample();
+        _window_log.push_back(w);
+
+        std::cout << "Client " << _client_id << " window " << w.window
+                  << (_window.slow_start() ? " (slow start), " : ", ")
+                  << (secs > 0 ? (uint64_t)(w.s.delivered/secs) : 0) << " chunks/s, "
+                  << w.s.timed_out << " timed out, " << w.s.duplicates << " duplicates, "
+                  << _chunk_request_times.size() << " outstanding" << std::endl;
+    }
+
+    // one line per sample: ms since registering, window, chunks delivered,
+    // timed out and duplicated since the one before
+    void save_window_log() {
+        std::ofstream out(_output_folder+"/window_"+std::to_string(_client_id)+".csv");
+        for (const auto& w : _window_log) {
+            out << w.ms << "," << w.window << "," << w.s.delivered << "," << w.s.timed_out << ","
+                << w.s.duplicates << std::endl;
+        }
+
+        out.close();
+    }
+
+    // transport specific, see client_tcp.cpp and client_udp.cpp
     void configure_tcp(uintptr_t tcp_fd);
 
     void can_read_TCP();
@@ -245,6 +638,20 @@ public:
 
     void can_write_UDP();
 
+    bool wants_write_TCP() {
+        return Transport::CONTROL_OVER_TCP ? !_control_msg_buffer.empty() : !_chunk_buffer.empty();
+    }
+
+    bool wants_write_UDP() {
+        return Transport::CONTROL_OVER_TCP ? !_chunk_buffer.empty() : !_control_msg_buffer.empty();
+    }
+
+#ifdef HAVE_IO_URING
+    void setup_io_uring();
+
+    void io_completed(const IoCompletion& c);
+#endif
+
     // callbacks
 
     void sent_chunk(uint32_t chunk_id) {
@@ -252,7 +659,7 @@ public:
         std::cout << "Sent chunk " << chunk_id << std::endl;
     }
 
-    void received_chunk(std::unique_ptr<FileChunk>&& chunk) {
+    void received_chunk(const FileChunk& chunk) {
 
         // If we receive a chunk while we're not registered, what do we do?
         // Solution: cache the chunk, and once we're registered, insert the 
@@ -262,14 +669,20 @@ public:
         // Because to init the chunks, we need the number of chunks. 
 
         if (!_registered) {
-            _recv_chunk_cache.push(std::move(chunk));
+            _recv_chunk_cache.push(copy_chunk(chunk));
         }
         else {
-            const auto chunk_id = chunk->id;
-            if (!_rcvd_chunks[chunk_id]) {                
-                _chunks[chunk_id] = std::move(chunk);
+            const auto chunk_id = chunk.id;
+            if (chunk_id >= _num_chunks or chunk.size > _chunk_size) return;
+            if (_rcvd_chunks[chunk_id]) {
+                _window.duplicate();
+            }
+            else {
+                memcpy(&_chunks[chunk_id], &chunk, chunk_wire_size(chunk));
                 _rcvd_chunks[chunk_id] = true;
+                _new_haves.push_back(chunk_id);
                 if (_chunk_request_times.find(chunk_id) != _chunk_request_times.end()) {
+                    _window.delivered();
                     auto curr_time = std::chrono::high_resolution_clock::now();
                     _chunk_rtt_times[chunk_id] = 
                         std::chrono::duration_cast<std::chrono::microseconds>(
@@ -282,8 +695,10 @@ public:
             }
 
             if (_num_rcvd_chunks == _num_chunks and !_saved_file) {
+                sample_window();
                 save_file();
                 save_RTT_times();
+                save_window_log();
                 _saved_file = true;
             }
         }
@@ -302,38 +717,101 @@ public:
 
     void clear_chunk_cache() {
         while (!_recv_chunk_cache.empty()) {
-            received_chunk(std::move(_recv_chunk_cache.front()));
+            received_chunk(*_recv_chunk_cache.front());
             _recv_chunk_cache.pop();
         }
     }
 
-    void received_control(ControlMessage& m) {
+    void received_control(const ControlPacket& p) {
+        const ControlMessage& m = p.msg;
         if (m.msgtype == OPEN) {
+            if (_rarest_first and !_can_request) {
+                _control_msg_buffer.push_back(ControlMessage{AVAIL_REQ,_client_id,0});
+            }
             _can_request = true;
         }
+        else if (m.msgtype == AVAIL and _registered and _rarest_first) {
+            for_each_availability(p, _num_chunks, [this](uint32_t chunk_id, uint32_t avail) {
+                _availability[chunk_id] = avail;
+            });
+            _availability_changed = true;
+        }
         else if (m.msgtype == REG and !_registered) {
             std::cout << "Reading registration data" << std::endl;
             _client_id = m.client_id;
             _num_chunks = m.chunk_id;
+            _chunk_size = p.reg.chunk_size;
+            if (_chunk_size == 0 or _chunk_size > MAX_CHUNK_SIZE) _chunk_size = DEFAULT_CHUNK_SIZE;
             _registered = true;
 
-            init_chunk_request_sequence(false);
+            _udp_recv_batch.set_slot_size(udp_slot_size(_chunk_size));
+            _frame_chunk.resize(_chunk_size);
+#ifdef HAVE_IO_URING
+            if (_evt_queue.io_uring() != nullptr) {
+                setup_io_uring();
+            }
+#endif
+            _window_log_start = _last_window_sample = std::chrono::steady_clock::now();
+
+            if ((p.reg.flags & REG_P2P) and open_peer_socket()) {
+                _p2p = true;
+                announce_peer_port();
+            }
+
+            init_chunk_request_sequence(_rarest_first);
             clear_chunk_cache();
             std::cout << "registered with client_id " << _client_id << std::endl;
         }
-        else if (_registered and m.msgtype == REQ and _chunks[m.chunk_id] != nullptr) {
-            send_chunk(m.chunk_id);
+        else if (m.msgtype == PEERS and _registered and _p2p) {
+            _peer_port_known = true;
+            received_peers(p.peers);
+        }
+        else if (_registered and (m.msgtype == REQ or m.msgtype == REQ_RANGE or m.msgtype == REQ_BITMAP)) {
+            // send whichever of the requested chunks we have
+            for_each_requested_chunk(p, _num_chunks, [this](uint32_t chunk_id) {
+                if (_rcvd_chunks[chunk_id]) send_chunk(chunk_id);
+            });
         }
     }
 
     // send requests/queue
 
-    void request_chunk(uint32_t chunk_id) {
-        _control_msg_buffer.push({REQ,_client_id,chunk_id});
+    // ids gets sorted (and deduplicated, a re-request can show up twice); the
+    // whole lot goes out in as few packets as possible
+    void request_chunks(std::vector<uint32_t>& ids) {
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        encode_chunk_requests(_client_id, ids, [this](const ControlPacket& p) {
+            _control_msg_buffer.push_back(p);
+        });
+    }
+
+    // the server only asks clients that said they have a chunk
+    void report_haves(std::vector<uint32_t>& ids) {
+        std::sort(ids.begin(), ids.end());
+        encode_chunk_haves(_client_id, ids, [this](const ControlPacket& p) {
+            _control_msg_buffer.push_back(p);
+        });
     }
 
     void send_chunk(uint32_t chunk_id) {
-        _chunk_buffer.push(chunk_id);
+        size_t bytes = chunk_wire_size(_chunks[chunk_id]);
+        if (_max_pending > 0 and _bytes_pending + bytes > _max_pending) {
+            _asks_dropped++;
+            return;
+        }
+        _chunk_buffer.push_back(chunk_id);
+        _bytes_pending += bytes;
+        _high_water_bytes = std::max(_high_water_bytes, _bytes_pending);
+        _high_water_chunks = std::max(_high_water_chunks, _chunk_buffer.size());
+    }
+
+    // the chunk at the front of _chunk_buffer went out; returns its id
+    uint32_t pop_chunk() {
+        uint32_t chunk_id = _chunk_buffer.front();
+        _chunk_buffer.pop_front();
+        _bytes_pending -= std::min(_bytes_pending, chunk_wire_size(_chunks[chunk_id]));
+        return chunk_id;
     }
 
     void periodic_resend_requests() {
@@ -343,60 +821,109 @@ public:
             // send a registration request to the server; the registration packet
             // might have been lost somewhere
             std::cout << "Not registered, trying to send a request" << std::endl;
-            _control_msg_buffer.push({REG,0,0});
+            _control_msg_buffer.push_back(Registration{REG,0,0,0,0});
         }
         else if (!_can_request and _registered) {
             std::cout << "Checking if can request" << std::endl;
-            _control_msg_buffer.push({OPEN,_client_id,0});
+            _control_msg_buffer.push_back(ControlMessage{OPEN,_client_id,0});
         }
         else if (_registered and _can_request) {
 
+            if (_p2p and !_peer_port_known) {
+                announce_peer_port();
+            }
+
+            // availability changes as the swarm copies chunks around
+            if (_rarest_first) {
+                _control_msg_buffer.push_back(ControlMessage{AVAIL_REQ,_client_id,0});
+            }
+
             // for (auto p : _chunk_request_times) {
             //     std::cout << p.first << "," << (curr_time-p.second)/1ms << std::endl;
             // }
 
+            uint64_t timed_out = 0;
             for (auto it = _chunk_request_times.cbegin(); it != _chunk_request_times.cend(); ) {
                 if ((curr_time-it->second)/1ms > 5000) {
                     // re-request chunk
                     _req_sequence.push_back(it->first);
                     _chunk_request_times.erase(it++);
+                    timed_out++;
                     continue;
                 }     
                 else {
                     ++it;
                 }
             }
+            _window.timed_out(timed_out);
+
+            if (!_saved_file) sample_window();
         }
     }
 
     void run(volatile bool& running) {
         _evt_queue.add_timer_event(TIMER_FD, 1000);
+        _stats.start();
 
         while (running) {
 
-            std::vector<event_t> evts = _evt_queue.get_events();
+            _stats.begin_wait();
+            const std::vector<event_t>& evts = _evt_queue.get_events();
+            _stats.woke_up(evts.size());
 
             for (const auto& e : evts) {
                 if (e.ident == _tcp_sock) {
                     if (e.filter == EVFILT_READ) can_read_TCP();
-                    if (e.filter == EVFILT_WRITE) can_write_TCP();
+                    if (e.filter == EVFILT_WRITE) {
+                        if (!wants_write_TCP()) _stats.idle_event();
+                        can_write_TCP();
+                    }
                 }
                 else if (e.ident == _udp_sock) {
                     if (e.filter == EVFILT_READ) can_read_UDP();
-                    else if (e.filter == EVFILT_WRITE) can_write_UDP();
+                    else if (e.filter == EVFILT_WRITE) {
+                        if (!wants_write_UDP()) _stats.idle_event();
+                        can_write_UDP();
+                    }
+                }
+                else if (_p2p and e.ident == _peer_sock) {
+                    if (e.filter == EVFILT_READ) can_read_peer();
+                    else if (e.filter == EVFILT_WRITE) {
+                        if (_peer_buffer.empty()) _stats.idle_event();
+                        can_write_peer();
+                    }
                 }
                 else if (e.ident == TIMER_FD and e.filter == EVFILT_TIMER) {
                     periodic_resend_requests();
                 }
             }
 
-            // have a cap of 100 so that we don't overburden the network with 
-            // too many requests at once
-            if (_can_request and _registered and _chunk_request_times.size() < 100) {
+#ifdef HAVE_IO_URING
+            if (_evt_queue.io_uring() != nullptr) {
+                for (const auto& c : _evt_queue.io_uring()->completions()) {
+                    io_completed(c);
+                }
+                requeue_recvs();
+            }
+#endif
+
+            // keep no more requests outstanding than the window allows, so
+            // that we don't overburden the network with too many at once.
+            // The loop only wakes up when there's something to do now, so
+            // top the window up in one go rather than one request per
+            // iteration. Everything picked here is sent as ranges/bitmaps
+            // rather than one message per chunk.
+            if (_availability_changed) {
+                reorder_rarest_first();
+                _availability_changed = false;
+            }
+
+            _new_requests.clear();
+            while (_can_request and _registered and _chunk_request_times.size() < _window.size()) {
 
-                // request the chunks we don't have on UDP, once in every loop
+                // request the chunks we don't have on UDP
                 while (_next_chunk_idx < _req_sequence.size() and 
-                       _chunks[_req_sequence[_next_chunk_idx]] != nullptr) {
+                       _rcvd_chunks[_req_sequence[_next_chunk_idx]]) {
                     _next_chunk_idx++;
                 }
                 if (_next_chunk_idx < _req_sequence.size()) {
@@ -404,11 +931,14 @@ public:
                     // would just be server tcp socket id + 1
                     //std::cout << "Requesting chunk " << _req_sequence[_next_chunk_idx] << std::endl;
                     //std::cout << _chunks[_req_sequence[_next_chunk_idx]] <<
-                    request_chunk(_req_sequence[_next_chunk_idx]);
+                    _new_requests.push_back(_req_sequence[_next_chunk_idx]);
                     _chunk_request_times[_req_sequence[_next_chunk_idx]] = 
                         std::chrono::high_resolution_clock::now();
                     _next_chunk_idx++;
                 }
+                else {
+                    break;
+                }
                 // The timer takes care of this
                 // if (_next_chunk_idx >= _req_sequence.size()) {
                 //     std::cout << "Requested all chunks in sequence" << std::endl;
@@ -417,16 +947,65 @@ public:
                 // }
             }
 
+            if (!_new_requests.empty()) {
+                request_chunks(_new_requests);
+            }
+
+            // whatever came in this time around, all in one go (the first
+            // time, that's everything we got before we were registered)
+            if (_registered and !_new_haves.empty()) {
+                report_haves(_new_haves);
+                _new_haves.clear();
+            }
+
+            update_write_interest();
+            _stats.dispatched();
         }
 
         if (!_saved_file) {
             save_RTT_times();
+            if (_registered) {
+                sample_window();
+                save_window_log();
+            }
         }
 
+        _udp_batch.print_histogram(std::cout, "Client " + std::to_string(_client_id) + " UDP send");
+        _udp_recv_batch.print_histogram(std::cout, "Client " + std::to_string(_client_id) + " UDP receive");
+        _tcp_writer.print_histogram(std::cout, "Client " + std::to_string(_client_id) + " TCP send");
+        _tcp_reader.print_histogram(std::cout, "Client " + std::to_string(_client_id) + " TCP receive");
+        _stats.print(std::cout, "Client " + std::to_string(_client_id) + " reactor");
+        std::cout << "Client " << _client_id << " send queue high water: " << _high_water_bytes << " bytes, "
+                  << _high_water_chunks << " chunks; " << _asks_dropped << " asks (and " << _peer_asks_dropped
+                  << " from peers) dropped, UDP socket full "
+                  << _udp_send_full << " times" << std::endl;
+        std::cout << "Client " << _client_id << " request window: " << _window.size() << " at the end, at most "
+                  << _window.high_water() << ", halved " << _window.decreases() << " times" << std::endl;
+
         // shutdown things here
         _evt_queue.close();
         close(_tcp_sock);
         close(_udp_sock);
+        if (_p2p) close(_peer_sock);
     }
 
 };
+
+template<> void Client<TcpControl>::configure_tcp(uintptr_t tcp_fd);
+template<> void Client<TcpControl>::can_read_TCP();
+template<> void Client<TcpControl>::can_read_UDP();
+template<> void Client<TcpControl>::can_write_TCP();
+template<> void Client<TcpControl>::can_write_UDP();
+
+template<> void Client<UdpControl>::configure_tcp(uintptr_t tcp_fd);
+template<> void Client<UdpControl>::can_read_TCP();
+template<> void Client<UdpControl>::can_read_UDP();
+template<> void Client<UdpControl>::can_write_TCP();
+template<> void Client<UdpControl>::can_write_UDP();
+
+#ifdef HAVE_IO_URING
+template<> void Client<TcpControl>::setup_io_uring();
+template<> void Client<TcpControl>::io_completed(const IoCompletion& c);
+template<> void Client<UdpControl>::setup_io_uring();
+template<> void Client<UdpControl>::io_completed(const IoCompletion& c);
+#endif
@@ -1,18 +1,30 @@
 #pragma once
 
-#include <queue>
+#include <deque>
+#include <chrono>
+#include <algorithm>
 #include <memory>
 #include <string>
-#include <functional>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
-
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "protocol.hpp"
+#include "event_queue.hpp"
+#include "udp_batch.hpp"
+#include "stream_codec.hpp"
+#include "reactor_stats.hpp"
+#include "transport.hpp"
+
+template<typename Transport>
+class Server;
 
+template<typename Transport>
 class ClientConnection {
 
     uint32_t _client_id;
@@ -20,58 +32,253 @@ class ClientConnection {
     uintptr_t _udp_fd;
     struct sockaddr_in _client_addr;
 
-    std::function<void(std::shared_ptr<FileChunk>)> _recv_chunk_callback;
-    std::function<void(uint32_t, uint32_t)> _send_chunk_callback;
-    std::function<void(ControlMessage, struct sockaddr_in)> _recv_control_msg_callback;
-    std::function<void(uint32_t)> _disconnect_callback;
+    // everything that happens to us (chunks and control messages coming in,
+    // chunks going out, output queued so that write interest gets armed,
+    // becoming congested and not anymore, disconnecting) goes straight to
+    // the shard that owns us; congestion only to be handled later
+    Server<Transport>& _server;
+
+    // what's waiting to go out, and since when
+    struct QueuedControl {
+        ControlPacket msg;
+        std::chrono::steady_clock::time_point queued_at;
+    };
+    struct QueuedChunk {
+        ChunkRef chunk;
+        std::chrono::steady_clock::time_point queued_at;
+    };
+
+    // deques rather than queues so that a UDP batch can look past the front
+    std::deque<QueuedControl> _control_msg_buffer;
+    std::deque<QueuedChunk> _chunk_buffer;
+
+    // framing state for whatever the TCP stream carries, and where a chunk
+    // coming in on it is taken apart (see set_chunk_size)
+    FrameReader _tcp_reader;
+    FrameWriter _tcp_writer;
+    ChunkBuffer _frame_chunk{DEFAULT_CHUNK_SIZE};
+
+    // whether EVFILT_WRITE is currently registered for _tcp_fd
+    bool _tcp_write_armed = false;
+
+    // everything ever queued for this client, control and data, in bytes
+    uint64_t _bytes_queued = 0;
+
+    // What's in the two buffers right now, and the most there ever was.
+    // Once it reaches _max_pending bytes (0 for no limit) the connection is
+    // congested, and stays so until it's down to half of that.
+    size_t _bytes_pending = 0;
+    size_t _max_pending = 0;
+    bool _congested = false;
+    size_t _high_water_bytes = 0;
+    size_t _high_water_msgs = 0;
+    uint32_t _times_congested = 0;
+
+    // Set when _congested flips, until the server gets round to it. That's
+    // once it's done dispatching (see Server::handle_congestion_changes),
+    // since it may be going through its connections when we queue or send.
+    bool _congestion_changed = false;
 
-    std::queue<ControlMessage> _control_msg_buffer;
-    std::queue<std::shared_ptr<FileChunk>> _chunk_buffer;
+    // Messages that only ask for something (asks for chunks, and peers to
+    // get them from) are dropped once MAX_CONTROL_BACKLOG control messages
+    // are waiting: whatever they were for times out and is asked for again.
+    // The rest (registration, OPEN, availability) is a few per client.
+    enum { MAX_CONTROL_BACKLOG = 1024 };
+    uint64_t _control_dropped = 0;
+
+    void congestion_flipped() {
+        if (_congestion_changed) return;
+        _congestion_changed = true;
+        _server.congestion_noted(_client_id);
+    }
+
+    void account_queued(size_t bytes) {
+        _bytes_queued += bytes;
+        _bytes_pending += bytes;
+        _high_water_bytes = std::max(_high_water_bytes, _bytes_pending);
+        _high_water_msgs = std::max(_high_water_msgs, _control_msg_buffer.size() + _chunk_buffer.size());
+        if (!_congested and _max_pending > 0 and _bytes_pending >= _max_pending) {
+            _congested = true;
+            _times_congested++;
+            congestion_flipped();
+        }
+    }
+
+    void account_sent(size_t bytes) {
+        _bytes_pending -= std::min(bytes, _bytes_pending);
+        if (_congested and _bytes_pending <= _max_pending/2) {
+            _congested = false;
+            congestion_flipped();
+        }
+    }
+
+    // how long what went out waited in the two buffers
+    DelayHistogram _control_delay;
+    DelayHistogram _chunk_delay;
+
+    // the n control messages at the front went out
+    void pop_control(size_t n) {
+        auto now = std::chrono::steady_clock::now();
+        for (size_t i=0; i<n; i++) {
+            _control_delay.add(now - _control_msg_buffer.front().queued_at);
+            size_t bytes = _control_msg_buffer.front().msg.size();
+            _control_msg_buffer.pop_front();
+            account_sent(bytes);
+        }
+    }
+
+    // the chunk at the front went out; returns its id
+    uint32_t pop_chunk() {
+        const QueuedChunk& q = _chunk_buffer.front();
+        uint32_t chunk_id = q.chunk.id;
+        size_t bytes = q.chunk.wire_size();
+        _chunk_delay.add(std::chrono::steady_clock::now() - q.queued_at);
+        _chunk_buffer.pop_front();
+        account_sent(bytes);
+        return chunk_id;
+    }
+
+#ifdef HAVE_IO_URING
+    // if set, data goes out through the ring instead of one syscall per chunk
+    UringEventQueue* _uring = nullptr;
+#endif
 
 public:
 
-    ClientConnection(uint32_t client_id, uintptr_t tcp_fd, uintptr_t udp_fd, struct sockaddr_in client_addr);
+    ClientConnection(uint32_t client_id, uintptr_t tcp_fd, uintptr_t udp_fd, struct sockaddr_in client_addr,
+                     Server<Transport>& server):
+        _client_id{client_id},
+        _tcp_fd{tcp_fd},
+        _udp_fd{udp_fd},
+        _client_addr(client_addr),
+        _server(server) {
 
-    // These four methods are implementation specific: the client(s) can choose
-    // whether they want to share control over a TCP layer or over a UDP layer
+        // set tcp_fd to be non blocking
+        fcntl(_tcp_fd, F_SETFL, O_NONBLOCK);
+
+        // whatever the stream carries is framed and coalesced into one write
+        // by us, so Nagle would only add latency
+        const int one = 1;
+        setsockopt(_tcp_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    // These three methods are specific to the transport (see
+    // client_connection_tcp.cpp and client_connection_udp.cpp): the clients
+    // can either share control over a TCP layer or over a UDP layer
 
     void can_write_TCP();
 
     void can_read_TCP();
 
-    void can_write_UDP();
+#ifdef HAVE_IO_URING
+    // hands the next datagram pending on UDP to the ring instead, false if
+    // the ring had no room for it
+    bool submit_UDP();
+#endif
+
+    // which of the two sockets we have something queued for (depends on
+    // which layer carries control and which carries data)
+
+    bool wants_write_TCP() {
+        return Transport::CONTROL_OVER_TCP ? !_control_msg_buffer.empty() : !_chunk_buffer.empty();
+    }
+
+    bool wants_write_UDP() {
+        return Transport::CONTROL_OVER_TCP ? !_chunk_buffer.empty() : !_control_msg_buffer.empty();
+    }
+
+    // UDP goes out in batches shared by all connections: gather_UDP adds the
+    // idx'th pending datagram (if there is one) to the batch, and once the
+    // batch is flushed sent_UDP is told how many of ours made it out.
+    // (Called for every datagram, so they're in here rather than with the
+    // rest.)
+
+    bool gather_UDP(UdpBatch& batch, size_t idx) {
+        if (Transport::CONTROL_OVER_TCP) {
+            if (idx >= _chunk_buffer.size()) return false;
+            const ChunkRef& c = _chunk_buffer[idx].chunk;
+            batch.add(c.header, ChunkRef::HEADER, c.data, c.size, &_client_addr, _client_id);
+        }
+        else {
+            // not worrying about network byte order for now.
+            if (idx >= _control_msg_buffer.size()) return false;
+            const ControlPacket& m = _control_msg_buffer[idx].msg;
+            batch.add(&m, m.size(), &_client_addr, _client_id);
+        }
+        return true;
+    }
+
+    // the size of the idx'th pending datagram, 0 if there's none, and
+    // whether datagrams carry control messages rather than chunks (the
+    // server schedules those first)
+
+    size_t UDP_size(size_t idx) {
+        if (Transport::CONTROL_OVER_TCP) {
+            return idx < _chunk_buffer.size() ? _chunk_buffer[idx].chunk.wire_size() : 0;
+        }
+        return idx < _control_msg_buffer.size() ? _control_msg_buffer[idx].msg.size() : 0;
+    }
 
-    void on_recv_chunk(std::function<void(std::shared_ptr<FileChunk>)> cb) {
-        _recv_chunk_callback = cb;
+    bool UDP_is_control() {
+        return !Transport::CONTROL_OVER_TCP;
     }
 
-    void on_send_chunk(std::function<void(uint32_t, uint32_t)> cb) {
-        _send_chunk_callback = cb;
+    void sent_UDP(size_t n) {
+        if (!Transport::CONTROL_OVER_TCP) {
+            // datagram oriented protocol, so no worries here
+            pop_control(n);
+            return;
+        }
+        for (size_t i=0; i<n; i++) {
+            uint32_t chunk_id = pop_chunk();
+            _server.sent_chunk(_client_id, chunk_id);
+        }
     }
 
-    void on_recv_control_msg(std::function<void(ControlMessage,struct sockaddr_in)> cb) {
-        _recv_control_msg_callback = cb;
+#ifdef HAVE_IO_URING
+    void use_io_uring(UringEventQueue* uring) {
+        _uring = uring;
     }
+#endif
 
-    void on_disconnect(std::function<void(uint32_t)> cb) {
-        _disconnect_callback = cb;
+    // Chunks aren't capped as such: congestion only tells the server to stop
+    // queueing them (and asks) for us, and what is queued always goes out.
+    // Control messages are, see MAX_CONTROL_BACKLOG.
+    void send_control_msg(const ControlPacket& msg) {
+        _control_msg_buffer.push_back({ msg, std::chrono::steady_clock::now() });
+        account_queued(msg.size());
+        _server.output_queued(*this);
     }
 
-    void send_control_msg(ControlMessage msg) {
-        _control_msg_buffer.push(msg);
+    // an ask or a referral, which can go if there's no room; returns whether
+    // it was queued
+    bool offer_control_msg(const ControlPacket& msg) {
+        if (_control_msg_buffer.size() >= MAX_CONTROL_BACKLOG) {
+            _control_dropped++;
+            return false;
+        }
+        send_control_msg(msg);
+        return true;
     }
 
     void req_chunk(uint32_t chunk_id) {
-        _control_msg_buffer.push({ REQ, 0, chunk_id });
+        _control_msg_buffer.push_back({ ControlMessage{ REQ, 0, chunk_id }, std::chrono::steady_clock::now() });
+        account_queued(sizeof(ControlMessage));
+        _server.output_queued(*this);
     }
 
-    void send_chunk(std::shared_ptr<FileChunk> chunk) {
-        _chunk_buffer.push(chunk);
+    void send_chunk(ChunkRef chunk) {
+        size_t bytes = chunk.wire_size();
+        _chunk_buffer.push_back({ std::move(chunk), std::chrono::steady_clock::now() });
+        account_queued(bytes);
+        _server.output_queued(*this);
     }
 
     void close_client() {
-        _disconnect_callback(_client_id);
-        close(_tcp_fd);
+        // the server destroys us, so hang on to the fd
+        uintptr_t fd = _tcp_fd;
+        _server.client_disconnected(_client_id);
+        close(fd);
     }
 
     uintptr_t get_tcp_fd() {
@@ -82,6 +289,78 @@ public:
         return _udp_fd;
     }
 
+    FrameReader& tcp_reader() {
+        return _tcp_reader;
+    }
+
+    FrameWriter& tcp_writer() {
+        return _tcp_writer;
+    }
+
+    bool tcp_write_armed() {
+        return _tcp_write_armed;
+    }
+
+    void set_tcp_write_armed(bool armed) {
+        _tcp_write_armed = armed;
+    }
+
+    uint64_t bytes_queued() {
+        return _bytes_queued;
+    }
+
+    void set_max_pending(size_t bytes) {
+        _max_pending = bytes;
+    }
+
+    void set_chunk_size(size_t chunk_size) {
+        _frame_chunk.resize(chunk_size);
+    }
+
+    bool congested() {
+        return _congested;
+    }
+
+    // whether congested() flipped since the last call
+    bool take_congestion_change() {
+        bool changed = _congestion_changed;
+        _congestion_changed = false;
+        return changed;
+    }
+
+    size_t bytes_pending() {
+        return _bytes_pending;
+    }
+
+    // the most bytes, and messages plus chunks, ever waiting at once, how
+    // often the connection got congested, and how many control messages
+    // there was no room for
+    size_t high_water_bytes() {
+        return _high_water_bytes;
+    }
+
+    size_t high_water_msgs() {
+        return _high_water_msgs;
+    }
+
+    uint32_t times_congested() {
+        return _times_congested;
+    }
+
+    uint64_t control_dropped() {
+        return _control_dropped;
+    }
+
+    // how long control messages and chunks sat in our buffers before going
+    // out (into the socket, or to the ring)
+    const DelayHistogram& control_delay() {
+        return _control_delay;
+    }
+
+    const DelayHistogram& chunk_delay() {
+        return _chunk_delay;
+    }
+
     uint32_t get_client_id() {
         return _client_id;
     }
@@ -98,3 +377,16 @@ public:
         return _client_addr;
     }
 };
+
+// the transport specific parts, defined in client_connection_tcp.cpp and
+// client_connection_udp.cpp
+
+template<> void ClientConnection<TcpControl>::can_write_TCP();
+template<> void ClientConnection<TcpControl>::can_read_TCP();
+template<> void ClientConnection<UdpControl>::can_write_TCP();
+template<> void ClientConnection<UdpControl>::can_read_TCP();
+
+#ifdef HAVE_IO_URING
+template<> bool ClientConnection<TcpControl>::submit_UDP();
+template<> bool ClientConnection<UdpControl>::submit_UDP();
+#endif
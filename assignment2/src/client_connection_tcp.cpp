@@ -1,70 +1,72 @@
 // this implementation uses a TCP control layer over a UDP data layer
 
-#include <fcntl.h>
 #include <errno.h>
 #include <iostream>
 
 #include "client_connection.hpp"
 #include "server.hpp"
 
-ClientConnection::ClientConnection(
-    uint32_t client_id, uintptr_t tcp_fd, uintptr_t udp_fd, struct sockaddr_in client_addr):
-    _client_id{client_id},
-    _tcp_fd{tcp_fd},
-    _udp_fd{udp_fd} {
+template<>
+void ClientConnection<TcpControl>::can_write_TCP() {
+    // everything queued goes out in one sendmsg; a message the kernel only
+    // took part of stays at the front until the rest of it is written
+    ssize_t n = _tcp_writer.write(_tcp_fd, _control_msg_buffer.size(), [this](size_t i) {
+        const ControlPacket& m = _control_msg_buffer[i].msg;
+        return Frame{ &m, m.size() };
+    });
 
-    // set tcp_fd to be non blocking
-    fcntl(_tcp_fd, F_SETFL, O_NONBLOCK);
-
-    // set socket low-water mark value for input to be the size of one control message
-    const int sock_recv_lwm = sizeof(ControlMessage);
-    setsockopt(_tcp_fd, SOL_SOCKET, SO_RCVLOWAT, &sock_recv_lwm, sizeof(sock_recv_lwm));
-    
-    _client_addr = client_addr;
-}
-
-void ClientConnection::can_write_TCP() {
-    if (!_control_msg_buffer.empty()) {
-        auto p = _control_msg_buffer.front();
-        ssize_t nb = send(_tcp_fd, &p, sizeof(p), 0);
-        if (nb == -1) {
+    if (n == -1) {
+        if (errno != EAGAIN and errno != EWOULDBLOCK) {
             std::cerr << "Error while writing to TCP socket " << get_addr_str() << " (errno " << errno << ")" << std::endl;
         }
-        else {
-            _control_msg_buffer.pop();
-        }
+        return;
     }
+    pop_control(n);
 }
 
-void ClientConnection::can_read_TCP() {
-    ControlMessage req_data;
-    int nb = recv(_tcp_fd, &req_data, sizeof(req_data), 0);
+template<>
+void ClientConnection<TcpControl>::can_read_TCP() {
+    ssize_t nb = _tcp_reader.fill(_tcp_fd);
 
     if (nb == -1) {
-        std::cerr << "Error while reading from TCP socket " << get_addr_str() << " (errno " << errno << ")" << std::endl;
+        if (errno != EAGAIN and errno != EWOULDBLOCK) {
+            std::cerr << "Error while reading from TCP socket " << get_addr_str() << " (errno " << errno << ")" << std::endl;
+        }
+        return;
     }
     else if (nb == 0) {
         // this happens when the socket has disconnected
         // have a callback that detatches this socket from everything
         close_client();
+        return;
     }
-    else {
-        _recv_control_msg_callback(req_data, _client_addr);
+
+    // a recv can end anywhere, the reader keeps the tail of a message around
+    // until the rest of it comes in
+    bool ok = _tcp_reader.for_each_frame([this](const char* p, size_t len) {
+        ControlPacket m;
+        if (control_from_frame(p, len, m)) _server.received_control_msg(m, _client_addr);
+    });
+    if (!ok) {
+        std::cerr << "Garbage on TCP socket " << get_addr_str() << ", disconnecting" << std::endl;
+        close_client();
     }
 }
 
-void ClientConnection::can_write_UDP() {
-    if (!_chunk_buffer.empty()) {
-        auto p = _chunk_buffer.front();
-        socklen_t len = sizeof(_client_addr);
-        ssize_t nb = sendto(_udp_fd, p.get(), sizeof(FileChunk), 0, 
-                            (struct sockaddr*)&_client_addr, len);
-        if (nb == -1) {
-            std::cerr << "Error while writing to UDP socket " << get_addr_str() << " (errno " << errno << ")" << std::endl;
-        }
-        else {
-            _chunk_buffer.pop();
-            _send_chunk_callback(_client_id, p->id);
-        }
+#ifdef HAVE_IO_URING
+template<>
+bool ClientConnection<TcpControl>::submit_UDP() {
+    // goes out with the next io_uring_enter. Completion (and the sent
+    // callback) is handled by the server, which is why the token carries the
+    // client id. The send holds on to a copy of the chunk's ref, which keeps
+    // it alive and comes back with the completion (to be queued again if the
+    // send failed).
+    const ChunkRef& c = _chunk_buffer.front().chunk;
+    uint64_t token = ((uint64_t)_client_id << 32) | c.id;
+    if (!_uring->queue_send(_udp_fd, c, &_client_addr, token)) {
+        return false;
     }
+    pop_chunk();
+    return true;
 }
+#endif
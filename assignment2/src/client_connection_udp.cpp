@@ -2,7 +2,6 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
-#include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <cstring>
@@ -10,87 +9,80 @@
 #include <iostream>
 
 #include "client_connection.hpp"
+#include "server.hpp"
 #include "protocol.hpp"
 
 // this implementation uses a UDP control layer over a TCP data layer
 
-ClientConnection::ClientConnection(
-    uint32_t client_id, uintptr_t tcp_fd, uintptr_t udp_fd, struct sockaddr_in client_addr):
-    _client_id{client_id},
-    _tcp_fd{tcp_fd},
-    _udp_fd{udp_fd} {
+// socket buffer sizes are generally big enough (on my mac, it's 128 kB) for
+// buffer overflows to be a non-issue, so we don't tweak the default buffer
+// size
 
-    // set tcp_fd to be non blocking
-    fcntl(_tcp_fd, F_SETFL, O_NONBLOCK);
+// TCP only guarantees the bytes arrive in order, not that a recv returns a
+// whole chunk, so every chunk goes out as a length-prefixed frame (see
+// stream_codec.hpp).
 
-    // set socket low-water mark value for input to be the size of one file chunk
-    const int sock_recv_lwm = sizeof(FileChunk);
-    setsockopt(_tcp_fd, SOL_SOCKET, SO_RCVLOWAT, &sock_recv_lwm, sizeof(sock_recv_lwm));
+// timeouts are also ok; let's not change those.
 
-    // we don't have to do something similar for send, as that would slow down 
-    // the speed at which we're sending. Just having this at one end is okay
+template<>
+void ClientConnection<UdpControl>::can_write_TCP() {
+    // everything queued goes out in one sendmsg, straight from the shared
+    // chunks; a chunk the kernel only took part of stays at the front until
+    // the rest of it is written
+    ssize_t n = _tcp_writer.write(_tcp_fd, _chunk_buffer.size(), [this](size_t i) {
+        return chunk_frame(_chunk_buffer[i].chunk);
+    });
 
-    // socket buffer sizes are generally big enough (on my mac, it's 128 kB) for
-    // buffer overflows to be a non-issue, so we don't tweak the default buffer
-    // size
-
-    // The sequentiality of TCP guarantees that we're always reading a contiguous
-    // chunk sent by client/server. So we don't need a protocol indicating length 
-    // or anything of that sort; just chunk into 1024 bytes while reading.
-
-    // timeouts are also ok; let's not change those.
-    
-    _client_addr = client_addr;
-}
-
-void ClientConnection::can_write_TCP() {
-    if (!_chunk_buffer.empty()) {
-        auto p = _chunk_buffer.front();
-        ssize_t nb = send(_tcp_fd, p.get(), sizeof(FileChunk), 0);
-        if (nb == -1) {
+    if (n == -1) {
+        if (errno != EAGAIN and errno != EWOULDBLOCK) {
             std::cerr << "Error while writing to TCP socket " << get_addr_str() << " (errno " << errno << ")" << std::endl;
         }
-        else {
-            _chunk_buffer.pop();
-            _send_chunk_callback(_client_id, p->id);
-        }
+        return;
+    }
+    for (ssize_t i=0; i<n; i++) {
+        uint32_t chunk_id = pop_chunk();
+        _server.sent_chunk(_client_id, chunk_id);
     }
 }
 
-void ClientConnection::can_read_TCP() {
-    std::shared_ptr<FileChunk> c(new FileChunk);
-    ssize_t nb = recv(_tcp_fd, c.get(), sizeof(FileChunk), 0);
+template<>
+void ClientConnection<UdpControl>::can_read_TCP() {
+    ssize_t nb = _tcp_reader.fill(_tcp_fd);
 
     if (nb == -1) {
-        std::cerr << "Error while reading from TCP socket " << get_addr_str() << " (errno " << errno << ")" << std::endl;
+        if (errno != EAGAIN and errno != EWOULDBLOCK) {
+            std::cerr << "Error while reading from TCP socket " << get_addr_str() << " (errno " << errno << ")" << std::endl;
+        }
+        return;
     }
     else if (nb == 0) {
         // this happens when the socket has disconnected
         // have a callback that detatches this socket from everything
         close_client();
+        return;
     }
-    else {
-        // handle the event where we don't read a complete filechunk in...
-        // actually, such an event won't come up due to the low-water level
-        // we've set.
-        _recv_chunk_callback(c);
+
+    // a recv can end anywhere, the reader keeps the tail of a chunk around
+    // until the rest of it comes in
+    bool ok = _tcp_reader.for_each_frame([this](const char* p, size_t len) {
+        if (chunk_from_frame(p, len, _frame_chunk)) _server.received_chunk(_frame_chunk.get());
+    });
+    if (!ok) {
+        std::cerr << "Garbage on TCP socket " << get_addr_str() << ", disconnecting" << std::endl;
+        close_client();
     }
 }
 
-void ClientConnection::can_write_UDP() {
-    if (!_control_msg_buffer.empty()) {
-        auto p = _control_msg_buffer.front(); // not worrying about network byte order for now.
-        socklen_t len = sizeof(_client_addr);
-        int nb = sendto(_udp_fd, &p, sizeof(p), 0, 
-                        (struct sockaddr*)&_client_addr, len);
-
-        if (nb == -1) {
-            std::cerr << "Error while writing to UDP socket (err " << errno << ")" << std::endl;
-        }
-        else {
-            // datagram oriented protocol, so no worries here
-            //std::cout << "Wrote " << data << " (" << nb << " bytes) to UDP socket " << ntohs(p.first.sin_port) << std::endl;
-            _control_msg_buffer.pop();
-        }
+#ifdef HAVE_IO_URING
+template<>
+bool ClientConnection<UdpControl>::submit_UDP() {
+    // the message is popped before the kernel gets to it, so the send keeps
+    // a copy of its own
+    uint64_t token = (uint64_t)_client_id << 32;
+    if (!_uring->queue_send(_udp_fd, _control_msg_buffer.front().msg, &_client_addr, token)) {
+        return false;
     }
+    pop_control(1);
+    return true;
 }
+#endif
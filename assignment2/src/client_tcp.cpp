@@ -1,72 +1,162 @@
 // this uses a TCP control layer over a UDP data layer
 
 #include <sys/socket.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include "client.hpp"
 
-void Client::configure_tcp(uintptr_t tcp_fd) {
-    // set socket low-water mark value for input to be the size of one control message
-    const int sock_recv_lwm = sizeof(ControlMessage);
-    setsockopt(_tcp_sock, SOL_SOCKET, SO_RCVLOWAT, &sock_recv_lwm, sizeof(sock_recv_lwm));
+template<>
+void Client<TcpControl>::configure_tcp(uintptr_t tcp_fd) {
+    // control messages are framed and coalesced into one write by us, so Nagle would
+    // only add latency
+    const int one = 1;
+    setsockopt(tcp_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 }
 
-void Client::can_read_TCP() {
-    ControlMessage m;
-    ssize_t nb = recv(_tcp_sock, &m, sizeof(m), 0);
+template<>
+void Client<TcpControl>::can_read_TCP() {
+    ssize_t nb = _tcp_reader.fill(_tcp_sock);
 
     if (nb == -1) {
-        std::cerr << "Error while reading from TCP socket (errno " << errno << ")" << std::endl;
+        if (errno != EAGAIN and errno != EWOULDBLOCK) {
+            std::cerr << "Error while reading from TCP socket (errno " << errno << ")" << std::endl;
+        }
+        return;
     }
     else if (nb == 0) {
         // this happens when the socket has disconnected
         // have a callback that detatches this socket from everything
         disconnected();
+        return;
+    }
+
+    // a recv can end anywhere, the reader keeps the tail of a message around
+    // until the rest of it comes in
+    bool ok = _tcp_reader.for_each_frame([this](const char* p, size_t len) {
+        ControlPacket m;
+        if (control_from_frame(p, len, m)) received_control(m);
+    });
+    if (!ok) {
+        std::cerr << "Garbage on TCP socket, disconnecting" << std::endl;
+        disconnected();
     }
-    else {
-        // handle the event where we don't read a complete filechunk in...
-        // actually, such an event won't come up due to the low-water level
-        // we've set.
-        received_control(m);
-    }   
 }
 
-void Client::can_read_UDP() {
-    // ControlMessage req_data;
-    std::unique_ptr<FileChunk> c = std::make_unique<FileChunk>();
-    ssize_t nb = recvfrom(_udp_sock, c.get(), sizeof(FileChunk), 0, nullptr, 0);
+template<>
+void Client<TcpControl>::can_read_UDP() {
+    int n = _udp_recv_batch.receive(_udp_sock);
 
-    if (nb == -1) {
-        std::cerr << "Error while reading from UDP socket (errno " << errno << ")" << std::endl;
+    if (n == -1) {
+        if (errno != EAGAIN and errno != EWOULDBLOCK) {
+            std::cerr << "Error while reading from UDP socket (errno " << errno << ")" << std::endl;
+        }
+        return;
     }
-    else {
-        received_chunk(std::move(c));
+
+    for (int i=0; i<n; i++) {
+        const FileChunk& c = *(FileChunk*)_udp_recv_batch.slot(i);
+        if (!chunk_complete(c, _udp_recv_batch.length(i))) continue;
+        received_chunk(c);
     }
 }
 
-void Client::can_write_TCP() {
-    if (!_control_msg_buffer.empty()) {
-        ControlMessage c = _control_msg_buffer.front(); // not worrying about network byte order for now.
-        ssize_t nb = send(_tcp_sock, &c, sizeof(c), 0);
-        if (nb == -1) {
+template<>
+void Client<TcpControl>::can_write_TCP() {
+    // everything queued goes out in one sendmsg; a message the kernel only
+    // took part of stays at the front until the rest of it is written
+    ssize_t n = _tcp_writer.write(_tcp_sock, _control_msg_buffer.size(), [this](size_t i) {
+        return Frame{ &_control_msg_buffer[i], _control_msg_buffer[i].size() }; // not worrying about network byte order for now.
+    });
+
+    if (n == -1) {
+        if (errno != EAGAIN and errno != EWOULDBLOCK) {
             std::cerr << "Error while writing to TCP socket (errno " << errno << ")" << std::endl;
         }
-        else {
-            _control_msg_buffer.pop();
+        return;
+    }
+    _control_msg_buffer.erase(_control_msg_buffer.begin(), _control_msg_buffer.begin()+n);
+}
+
+template<>
+void Client<TcpControl>::can_write_UDP() {
+#ifdef HAVE_IO_URING
+    if (_evt_queue.io_uring() != nullptr) {
+        // queue everything we owe; chunks live as long as the client does,
+        // so the ring can send them from where they are
+        while (!_chunk_buffer.empty()) {
+            uint32_t p = _chunk_buffer.front();
+            if (!_evt_queue.io_uring()->queue_send(_udp_sock, &_chunks[p], chunk_wire_size(_chunks[p]),
+                                                   nullptr, p)) {
+                break;
+            }
+            pop_chunk();
         }
+        return;
+    }
+#endif
+    _udp_batch.clear();
+    for (size_t i=0; i<_chunk_buffer.size() and !_udp_batch.full(); i++) {
+        uint32_t p = _chunk_buffer[i];
+        _udp_batch.add(&_chunks[p], chunk_wire_size(_chunks[p]), nullptr, p);
+    }
+
+    int n = _udp_batch.flush(_udp_sock);
+    if (n == -1) {
+        // no room in the socket buffer, try again once there is
+        if (errno == EAGAIN or errno == EWOULDBLOCK or errno == ENOBUFS) _udp_send_full++;
+        else std::cerr << "Error while writing to UDP socket (err " << errno << ")" << std::endl;
+        return;
+    }
+    for (int i=0; i<n; i++) {
+        sent_chunk(pop_chunk());
     }
 }
 
-void Client::can_write_UDP() {
-    if (!_chunk_buffer.empty()) {
-        uint32_t p = _chunk_buffer.front();
-        ssize_t nb = sendto(_udp_sock, _chunks[p].get(), sizeof(FileChunk), 0, nullptr, 0);
+#ifdef HAVE_IO_URING
+
+template<>
+void Client<TcpControl>::setup_io_uring() {
+    UringEventQueue* uring = _evt_queue.io_uring();
 
-        if (nb == -1) {
-            std::cerr << "Error while writing to UDP socket (err " << errno << ")" << std::endl;
+    _io_recv_stride = chunk_alloc_size(_chunk_size);
+    _io_recv_slots.resize(IO_RECV_SLOTS*_io_recv_stride/sizeof(uint64_t));
+    if (!uring->register_buffer(_io_recv_slots.data(), IO_RECV_SLOTS*_io_recv_stride)) {
+        std::cerr << "Could not register receive buffers with io_uring (errno " << errno << ")" << std::endl;
+        _io_recv_slots.clear();
+        return;
+    }
+
+    _evt_queue.delete_event(_udp_sock, EVFILT_READ);
+    for (size_t i=0; i<IO_RECV_SLOTS; i++) {
+        queue_recv(i);
+    }
+}
+
+template<>
+void Client<TcpControl>::io_completed(const IoCompletion& c) {
+    if (c.is_send) {
+        if (c.res < 0) {
+            if (c.res == -EAGAIN or c.res == -EWOULDBLOCK or c.res == -ENOBUFS) _udp_send_full++;
+            else std::cerr << "Error while writing to UDP socket (err " << -c.res << ")" << std::endl;
+            // back in the queue (it was only let go of when it was handed
+            // to the ring, so it fits)
+            _chunk_buffer.push_back((uint32_t)c.token);
+            _bytes_pending += chunk_wire_size(_chunks[(uint32_t)c.token]);
         }
         else {
-            _chunk_buffer.pop();
-            sent_chunk(p);
+            sent_chunk((uint32_t)c.token);
         }
+        return;
+    }
+
+    FileChunk& slot = io_recv_slot(c.token);
+    if (c.res < 0) {
+        std::cerr << "Error while reading from UDP socket (errno " << -c.res << ")" << std::endl;
+    }
+    else if (chunk_complete(slot, c.res)) {
+        received_chunk(slot);
     }
+    queue_recv(c.token);
 }
+
+#endif
@@ -1,74 +1,113 @@
 // this uses a UDP control layer over a TCP data layer
 
 #include <sys/socket.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include "client.hpp"
 
-void Client::configure_tcp(uintptr_t tcp_fd) {
-    // set socket low-water mark value for input to be the size of one file chunk
-    const int sock_recv_lwm = sizeof(FileChunk);
-    setsockopt(_tcp_sock, SOL_SOCKET, SO_RCVLOWAT, &sock_recv_lwm, sizeof(sock_recv_lwm));
+template<>
+void Client<UdpControl>::configure_tcp(uintptr_t tcp_fd) {
+    // chunks are framed and coalesced into one write by us, so Nagle would
+    // only add latency
+    const int one = 1;
+    setsockopt(tcp_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 }
 
-void Client::can_read_TCP() {
-    std::unique_ptr<FileChunk> c = std::make_unique<FileChunk>();
-    ssize_t nb = recv(_tcp_sock, c.get(), sizeof(FileChunk), 0);
+template<>
+void Client<UdpControl>::can_read_TCP() {
+    ssize_t nb = _tcp_reader.fill(_tcp_sock);
 
     if (nb == -1) {
-        std::cerr << "Error while reading from TCP socket (errno " << errno << ")" << std::endl;
+        if (errno != EAGAIN and errno != EWOULDBLOCK) {
+            std::cerr << "Error while reading from TCP socket (errno " << errno << ")" << std::endl;
+        }
+        return;
     }
     else if (nb == 0) {
         // this happens when the socket has disconnected
         // have a callback that detatches this socket from everything
         disconnected();
+        return;
     }
-    else {
-        // handle the event where we don't read a complete filechunk in...
-        // actually, such an event won't come up due to the low-water level
-        // we've set.
-        received_chunk(std::move(c));
+
+    // a recv can end anywhere, the reader keeps the tail of a chunk around
+    // until the rest of it comes in
+    bool ok = _tcp_reader.for_each_frame([this](const char* p, size_t len) {
+        if (chunk_from_frame(p, len, _frame_chunk)) received_chunk(_frame_chunk.get());
+    });
+    if (!ok) {
+        std::cerr << "Garbage on TCP socket, disconnecting" << std::endl;
+        disconnected();
     }
 }
 
-void Client::can_read_UDP() {
+template<>
+void Client<UdpControl>::can_read_UDP() {
+    int n = _udp_recv_batch.receive(_udp_sock);
 
-    ControlMessage req_data;
-    int nb = recvfrom(_udp_sock, &req_data, sizeof(req_data), 0, nullptr, 0);
-
-    if (nb == -1) {
-        std::cerr << "Error while reading from UDP socket (errno " << errno << ")" << std::endl;
+    if (n == -1) {
+        if (errno != EAGAIN and errno != EWOULDBLOCK) {
+            std::cerr << "Error while reading from UDP socket (errno " << errno << ")" << std::endl;
+        }
+        return;
     }
-    else {
-        received_control(req_data);
+
+    for (int i=0; i<n; i++) {
+        ControlPacket m;
+        if (!ControlPacket::parse(_udp_recv_batch.slot(i), _udp_recv_batch.length(i), m)) continue;
+        received_control(m);
     }
 }
 
-void Client::can_write_TCP() {
-    if (!_chunk_buffer.empty()) {
-        uint32_t p = _chunk_buffer.front();
-        ssize_t nb = send(_tcp_sock, _chunks[p].get(), sizeof(FileChunk), 0);
-        if (nb == -1) {
+template<>
+void Client<UdpControl>::can_write_TCP() {
+    // everything queued goes out in one sendmsg, straight from the chunk slab;
+    // a chunk the kernel only took part of stays at the front until the rest
+    // of it is written
+    ssize_t n = _tcp_writer.write(_tcp_sock, _chunk_buffer.size(), [this](size_t i) {
+        return chunk_frame(_chunks[_chunk_buffer[i]]);
+    });
+
+    if (n == -1) {
+        if (errno != EAGAIN and errno != EWOULDBLOCK) {
             std::cerr << "Error while writing to TCP socket (errno " << errno << ")" << std::endl;
         }
-        else {
-            _chunk_buffer.pop();
-            sent_chunk(p);
-        }
+        return;
+    }
+    for (ssize_t i=0; i<n; i++) {
+        sent_chunk(pop_chunk());
     }
 }
 
-void Client::can_write_UDP() {
-    if (!_control_msg_buffer.empty()) {
-        ControlMessage c = _control_msg_buffer.front(); // not worrying about network byte order for now.
-        int nb = sendto(_udp_sock, &c, sizeof(c), 0, nullptr, 0);
+template<>
+void Client<UdpControl>::can_write_UDP() {
+    // not worrying about network byte order for now.
+    _udp_batch.clear();
+    for (size_t i=0; i<_control_msg_buffer.size() and !_udp_batch.full(); i++) {
+        _udp_batch.add(&_control_msg_buffer[i], _control_msg_buffer[i].size(), nullptr, 0);
+    }
 
-        if (nb == -1) {
-            std::cerr << "Error while writing to UDP socket (err " << errno << ")" << std::endl;
-        }
-        else {
-            // datagram oriented protocol, so no worries here
-            //std::cout << "Wrote " << data << " (" << nb << " bytes) to UDP socket " << ntohs(p.first.sin_port) << std::endl;
-            _control_msg_buffer.pop();
-        }
+    int n = _udp_batch.flush(_udp_sock);
+    if (n == -1) {
+        // no room in the socket buffer, try again once there is
+        if (errno == EAGAIN or errno == EWOULDBLOCK or errno == ENOBUFS) _udp_send_full++;
+        else std::cerr << "Error while writing to UDP socket (err " << errno << ")" << std::endl;
+        return;
+    }
+    // datagram oriented protocol, so no worries here
+    for (int i=0; i<n; i++) {
+        _control_msg_buffer.pop_front();
     }
 }
+
+#ifdef HAVE_IO_URING
+
+// chunks travel over TCP here and control messages are tiny, so io_uring only
+// changes the event loop.
+template<>
+void Client<UdpControl>::setup_io_uring() {}
+
+template<>
+void Client<UdpControl>::io_completed(const IoCompletion&) {}
+
+#endif
@@ -18,7 +18,7 @@ void terminate(int signal) {
 }
 
 void print_usage() {
-    std::cout << "usage: clientmgr [-a address] [-p port] [-o output_folder] num_clients" << std::endl;
+    std::cout << "usage: clientmgr [-T tcp|udp] [-a address] [-p port] [-o output_folder] [-u] [-b udp_batch_size] [-r] [-q max_queued_kb] [-w max_window] num_clients" << std::endl;
 }
 
 void file_saved() {
@@ -26,6 +26,38 @@ void file_saved() {
     if (n_completed_ctr == n) running = false;
 }
 
+// spawn multiple threads and assign one to each client
+template<typename Transport>
+void run_clients(const std::string& addr, int port, const std::string& out_folder, bool use_io_uring,
+                 int udp_batch_size, bool rarest_first, int max_queued_kb, int max_window) {
+
+    std::vector<std::thread> threads(n);
+    std::vector<std::unique_ptr<Client<Transport>>> clients(n);
+
+
+    for (int i=0; i<n and running; i++) {
+        std::this_thread::sleep_for(200ms);
+        clients[i] = std::unique_ptr<Client<Transport>>(new Client<Transport>(addr, port, out_folder, use_io_uring));
+        clients[i]->set_udp_batch_size(udp_batch_size);
+        clients[i]->set_rarest_first(rarest_first);
+        if (max_queued_kb >= 0) clients[i]->set_max_pending((size_t)max_queued_kb*1024);
+        clients[i]->set_max_window(max_window);
+        clients[i]->on_save_file(file_saved);
+        threads[i] = std::thread(&Client<Transport>::run, clients[i].get(), std::ref(running));
+    }
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    for (int i=0; i<n; i++) {
+        // wait for everyone to finish 
+        threads[i].join();
+    }
+
+    auto end_time = std::chrono::high_resolution_clock::now();
+
+    std::cout << "All clients received file in " << (end_time-start_time)/1ms << " ms" << std::endl;
+}
+
 int main(int argc, char** argv) {
 
     n_completed_ctr = 0;
@@ -37,14 +69,32 @@ int main(int argc, char** argv) {
     std::string addr = "127.0.0.1";
     int port = 15000;
     std::string out_folder = ".";
+    bool use_io_uring = false;
+    int udp_batch_size = 32;
+    bool rarest_first = false;
+    int max_queued_kb = -1;
+    int max_window = RequestWindow::DEFAULT_MAX;
+    Transport transport = Transport::UDP_CONTROL;
 
     char opt;
-    while ((opt = getopt(argc, argv, "a:p:o:")) != -1) {
-        std::cout << "Got opt " << opt << " with arg " << std::string(optarg) << std::endl;
+    while ((opt = getopt(argc, argv, "a:p:o:ub:rq:T:w:")) != -1) {
+        std::cout << "Got opt " << opt << (optarg ? " with arg " + std::string(optarg) : "") << std::endl;
         switch (opt) {
             case 'a': addr = std::string(optarg); break;
             case 'p': port = std::stoi(std::string(optarg)); break;
             case 'o': out_folder = std::string(optarg); break;
+            case 'u': use_io_uring = true; break;
+            case 'b': udp_batch_size = std::stoi(std::string(optarg)); break;
+            case 'r': rarest_first = true; break;
+            case 'q': max_queued_kb = std::stoi(std::string(optarg)); break;
+            case 'w': max_window = std::stoi(std::string(optarg)); break;
+            case 'T':
+                if (!parse_transport(std::string(optarg), transport)) {
+                    std::cout << "clientmgr: unknown transport " << optarg << std::endl;
+                    print_usage();
+                    return 0;
+                }
+                break;
             default:
                 print_usage();
                 return 0;
@@ -57,30 +107,15 @@ int main(int argc, char** argv) {
         return 0;
     }
 
-    // spawn multiple threads and assign one to each client
-
     n = std::stoi(std::string(argv[argc-1]));
-    std::vector<std::thread> threads(n);
-    std::vector<std::unique_ptr<Client>> clients(n);
-
-
-    for (int i=0; i<n and running; i++) {
-        std::this_thread::sleep_for(200ms);
-        clients[i] = std::unique_ptr<Client>(new Client(addr, port, out_folder));
-        clients[i]->on_save_file(file_saved);
-        threads[i] = std::thread(&Client::run, clients[i].get(), std::ref(running));
-    }
-
-    auto start_time = std::chrono::high_resolution_clock::now();
-
-    for (int i=0; i<n; i++) {
-        // wait for everyone to finish 
-        threads[i].join();
+    if (max_window <= 0) {
+        print_usage();
+        return 0;
     }
-
-    auto end_time = std::chrono::high_resolution_clock::now();
-
-    std::cout << "All clients received file in " << (end_time-start_time)/1ms << " ms" << std::endl;
+    with_transport(transport, [&](auto tp) {
+        run_clients<decltype(tp)>(addr, port, out_folder, use_io_uring, udp_batch_size, rarest_first, max_queued_kb,
+                                  max_window);
+    });
 
     return 0;
 }
\ No newline at end of file
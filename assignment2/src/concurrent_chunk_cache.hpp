@@ -0,0 +1,115 @@
+#pragma once
+
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <string>
+#include <functional>
+
+#include "chunk_cache.hpp"
+
+// A ChunkCache that any number of threads can use at once. Keys are spread
+// over independent shards, each a ChunkCache of the chosen policy behind its
+// own mutex, and the budget is split evenly between them. A lock is only held
+// for the policy's bookkeeping and one shared_ptr copy, so threads only wait
+// on each other when they hit the same shard at the same moment.
+//
+// Unlike ChunkCache, access() and peek() return the value itself rather than
+// a pointer into the cache, since the entry may be evicted by another thread
+// as soon as the lock is released.
+template<typename K, typename V>
+class ConcurrentChunkCache {
+
+    struct Shard {
+        std::mutex lock;
+        std::unique_ptr<ChunkCache<K,V>> cache;
+        // keeps neighbouring shards' locks off each other's cache line
+        char pad[64];
+    };
+
+    std::unique_ptr<Shard[]> _shards;
+    size_t _n_shards;
+    size_t _max_bytes;
+    size_t _max_entries;
+
+    Shard& shard_of(const K& key) {
+        // the server's own shards split chunks by id % n, so hash rather than
+        // take the id modulo again, or most cache shards would sit idle
+        uint64_t h = std::hash<K>()(key) * 0x9E3779B97F4A7C15ull;
+        return _shards[(h >> 32) % _n_shards];
+    }
+
+public:
+
+    ConcurrentChunkCache(CachePolicy p, size_t max_bytes, size_t max_entries, size_t n_shards):
+        _shards{new Shard[n_shards > 0 ? n_shards : 1]},
+        _n_shards{n_shards > 0 ? n_shards : 1},
+        _max_bytes{max_bytes},
+        _max_entries{max_entries} {
+
+        for (size_t k=0; k<_n_shards; k++) {
+            _shards[k].cache = make_chunk_cache<K,V>(p, (max_bytes+_n_shards-1)/_n_shards,
+                                                     (max_entries+_n_shards-1)/_n_shards);
+        }
+    }
+
+    // counts a hit or a miss like ChunkCache::access; V() on a miss
+    V access(const K& key) {
+        Shard& s = shard_of(key);
+        std::lock_guard<std::mutex> guard(s.lock);
+        V* v = s.cache->access(key);
+        return v ? *v : V();
+    }
+
+    V peek(const K& key) {
+        Shard& s = shard_of(key);
+        std::lock_guard<std::mutex> guard(s.lock);
+        V* v = s.cache->peek(key);
+        return v ? *v : V();
+    }
+
+    void insert(const K& key, V value, size_t bytes) {
+        Shard& s = shard_of(key);
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.cache->insert(key, std::move(value), bytes);
+    }
+
+    // drops everything; max_entries is for the whole cache
+    void reserve(size_t max_entries) {
+        _max_entries = max_entries;
+        for (size_t k=0; k<_n_shards; k++) {
+            std::lock_guard<std::mutex> guard(_shards[k].lock);
+            _shards[k].cache->reserve((max_entries+_n_shards-1)/_n_shards);
+        }
+    }
+
+    size_t max_bytes() {
+        return _max_bytes;
+    }
+
+    size_t max_entries() {
+        return _max_entries;
+    }
+
+    const char* name() {
+        return _shards[0].cache->name();
+    }
+
+    size_t n_shards() {
+        return _n_shards;
+    }
+
+    CacheStats stats() {
+        CacheStats total;
+        for (size_t k=0; k<_n_shards; k++) {
+            std::lock_guard<std::mutex> guard(_shards[k].lock);
+            const CacheStats& s = _shards[k].cache->stats();
+            total.hits += s.hits;
+            total.misses += s.misses;
+            total.insertions += s.insertions;
+            total.evictions += s.evictions;
+            total.rejected += s.rejected;
+        }
+        return total;
+    }
+};
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <deque>
+#include <cstdint>
+#include <algorithm>
+#include <cstddef>
+#include <unordered_map>
+
+// Deficit round robin over the connections that have UDP output queued, all
+// of which share a shard's one UDP socket (and one sendmmsg batch).
+//
+// Connections take turns in a fixed order. Every turn a connection gets
+// `quantum` bytes more credit and sends datagrams off the front of its queue
+// while it has the credit for them; what it doesn't use carries over to its
+// next turn for as long as it stays backlogged. So a client with a deep
+// queue gets the same bytes per round as everyone else, and a client with a
+// single chunk queued gets it out on its next turn rather than behind the
+// deep queues. A turn that's cut short by a full batch carries on with the
+// next batch, instead of every batch starting over at the same connections.
+//
+// Connections queueing control messages go in a ring of their own, which is
+// served before the data ring, so a REG or an ask never waits behind chunks.
+class DrrScheduler {
+
+    struct Flow {
+        int64_t deficit = 0;
+        bool queued = false;
+        bool has_turn = false;  // credit for the current turn was handed out
+    };
+
+    std::unordered_map<uint32_t,Flow> _flows;
+    std::deque<uint32_t> _rings[2];     // control, data
+    size_t _quantum;
+
+public:
+
+    explicit DrrScheduler(size_t quantum): _quantum{quantum > 0 ? quantum : 1} {}
+
+    // should be at least the biggest datagram, or flows need several turns
+    // to send one
+    void set_quantum(size_t quantum) {
+        _quantum = quantum > 0 ? quantum : 1;
+    }
+
+    bool empty() const {
+        return _rings[0].empty() and _rings[1].empty();
+    }
+
+    // id has output queued (again)
+    void add(uint32_t id, bool control) {
+        Flow& f = _flows[id];
+        if (f.queued) return;
+        f.queued = true;
+        f.deficit = 0;
+        f.has_turn = false;
+        _rings[control ? 0 : 1].push_back(id);
+    }
+
+    // id is gone (only happens once per client, so the walk is fine)
+    void remove(uint32_t id) {
+        auto it = _flows.find(id);
+        if (it == _flows.end()) return;
+        if (it->second.queued) {
+            for (auto& ring : _rings) {
+                ring.erase(std::remove(ring.begin(), ring.end(), id), ring.end());
+            }
+        }
+        _flows.erase(it);
+    }
+
+    // credit back for a datagram of id's that was picked but didn't go out
+    void refund(uint32_t id, size_t bytes) {
+        auto it = _flows.find(id);
+        if (it != _flows.end()) it->second.deficit += bytes;
+    }
+
+    // Picks datagrams until full() says stop or nobody has anything left.
+    // size(id) is the size of id's next datagram that wasn't picked yet (0
+    // if there is none), and take(id) picks it. A flow that ran out is
+    // dropped from its ring, so anything picked but then not sent has to be
+    // add()ed again.
+    template<typename Full, typename Size, typename Take>
+    void pick(Full full, Size size, Take take) {
+        for (auto& ring : _rings) {
+            while (!ring.empty()) {
+                if (full()) return;
+
+                uint32_t id = ring.front();
+                Flow& f = _flows[id];
+                if (!f.has_turn) {
+                    f.deficit += _quantum;
+                    f.has_turn = true;
+                }
+                size_t bytes;
+                while ((bytes = size(id)) > 0 and (int64_t)bytes <= f.deficit) {
+                    // keeps the turn, and what's left of the credit
+                    if (full()) return;
+                    take(id);
+                    f.deficit -= bytes;
+                }
+
+                ring.pop_front();
+                f.has_turn = false;
+                if (bytes == 0) {
+                    f.queued = false;
+                    f.deficit = 0;
+                }
+                else {
+                    ring.push_back(id);
+                }
+            }
+        }
+    }
+};
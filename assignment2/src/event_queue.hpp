@@ -1,44 +1,100 @@
-#include <sys/event.h>
+#pragma once
+
 #include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <cstdint>
 #include <vector>
-#include <unordered_set>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
 
-typedef struct kevent event_t;
+// Backend selection: kqueue is native on macOS/BSD. On linux we default to
+// epoll; kqueue is still available through libkqueue (build with KQUEUE=1),
+// mostly so that the two can be benchmarked against each other.
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(HAVE_LIBKQUEUE)
+#define HAVE_KQUEUE 1
+#include <sys/event.h>
+#endif
 
-class EventQueue {
+#ifdef __linux__
+#define HAVE_EPOLL 1
+#define HAVE_IO_URING 1
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include "io_uring.hpp"
+#include "chunk_pool.hpp"
+#endif
+
+// the epoll backend reuses kqueue's filter names so that callers don't have to
+// care which backend they're on
+#ifndef EVFILT_READ
+#define EVFILT_READ  (-1)
+#define EVFILT_WRITE (-2)
+#define EVFILT_TIMER (-7)
+#endif
+
+// only the fields the reactors actually look at. Both backends translate their
+// native events into this.
+struct event_t {
+    uintptr_t ident;
+    int16_t filter;
+};
+
+#ifdef HAVE_KQUEUE
+
+class KqueueEventQueue {
+
+    static const int MAX_EVENTS = 64;
 
     int _kq;
+    uint16_t _trigger_flags;
+
+    struct kevent _raw[MAX_EVENTS];
+    std::vector<event_t> _events;
 
 public:
-    EventQueue() {
+    // edge triggered mode maps onto EV_CLEAR: an event is reported once and
+    // then only again after the state changes, so handlers have to drain the
+    // socket until EAGAIN.
+    explicit KqueueEventQueue(bool edge_triggered = false):
+        _trigger_flags{(uint16_t)(edge_triggered ? EV_CLEAR : 0)} {
         _kq = kqueue();
+        _events.reserve(MAX_EVENTS);
     }
 
     void add_event(uintptr_t fd, int16_t filter) {
-        event_t evt;
-        EV_SET(&evt, fd, filter, EV_ADD, 0, 0, NULL);
+        struct kevent evt;
+        EV_SET(&evt, fd, filter, EV_ADD|_trigger_flags, 0, 0, NULL);
         kevent(_kq, &evt, 1, NULL, 0, NULL);
     }
 
     void add_timer_event(uintptr_t fd, uint32_t period_in_ms) {
-        event_t evt;
+        struct kevent evt;
         EV_SET(&evt, fd, EVFILT_TIMER, EV_ADD|EV_ENABLE, 0, period_in_ms, NULL);
         kevent(_kq, &evt, 1, NULL, 0, NULL);
     }
 
     void delete_event(uintptr_t fd, int16_t filter) {
-        event_t evt;
+        struct kevent evt;
         EV_SET(&evt, fd, filter, EV_DELETE, 0, 0, NULL);
         kevent(_kq, &evt, 1, NULL, 0, NULL);
     }
 
-    std::vector<event_t> get_events() {
-        event_t evts[64];
-        int n_evts = kevent(_kq, NULL, 0, evts, 64, NULL);
+    // the returned buffer is owned by the queue and is overwritten by the
+    // next call, so don't hold on to it across loop iterations
+    const std::vector<event_t>& get_events() {
+        int n_evts = kevent(_kq, NULL, 0, _raw, MAX_EVENTS, NULL);
 
-        std::vector<event_t> v;
-        v.assign(evts, evts+n_evts);
-        return v;
+        _events.clear();
+        for (int i=0; i<n_evts; i++) {
+            _events.push_back({ _raw[i].ident, _raw[i].filter });
+        }
+        return _events;
     }
 
     void close() {
@@ -49,3 +105,590 @@ public:
         ::close(_kq);
     }
 };
+
+#endif
+
+#ifdef HAVE_EPOLL
+
+class EpollEventQueue {
+
+    static const int MAX_EVENTS = 64;
+
+    // epoll_event.data holds the ident in the low 32 bits. Timers are backed by
+    // a timerfd, which goes in the high 32 bits (offset by one so that zero
+    // means "not a timer").
+    static const int TIMER_SHIFT = 32;
+
+    int _ep;
+    uint32_t _trigger_flags;
+
+    // epoll has one registration per fd, whereas kqueue has one per
+    // (fd, filter). Keep the combined interest mask around so that adding or
+    // removing one filter doesn't clobber the other.
+    std::unordered_map<uintptr_t,uint32_t> _interest;
+    std::unordered_map<uintptr_t,int> _timers;
+
+    struct epoll_event _raw[MAX_EVENTS];
+    std::vector<event_t> _events;
+
+    static uint32_t filter_mask(int16_t filter) {
+        if (filter == EVFILT_READ) return EPOLLIN|EPOLLRDHUP;
+        if (filter == EVFILT_WRITE) return EPOLLOUT;
+        return 0;
+    }
+
+    void update_interest(uintptr_t fd, uint32_t old_mask, uint32_t new_mask) {
+        struct epoll_event evt;
+        evt.events = new_mask|_trigger_flags;
+        evt.data.u64 = fd;
+
+        if (new_mask == 0) {
+            epoll_ctl(_ep, EPOLL_CTL_DEL, fd, &evt);
+        }
+        else if (old_mask == 0) {
+            epoll_ctl(_ep, EPOLL_CTL_ADD, fd, &evt);
+        }
+        else if (epoll_ctl(_ep, EPOLL_CTL_MOD, fd, &evt) == -1 and errno == ENOENT) {
+            // the fd was closed (and dropped out of the epoll set) without us
+            // being told, and has been handed out again since.
+            epoll_ctl(_ep, EPOLL_CTL_ADD, fd, &evt);
+        }
+    }
+
+public:
+    // in edge triggered mode (EPOLLET) readiness is reported once per state
+    // change, so handlers have to drain the socket until EAGAIN.
+    explicit EpollEventQueue(bool edge_triggered = false):
+        _trigger_flags{edge_triggered ? (uint32_t)EPOLLET : 0} {
+        _ep = epoll_create1(EPOLL_CLOEXEC);
+        _events.reserve(2*MAX_EVENTS);
+    }
+
+    void add_event(uintptr_t fd, int16_t filter) {
+        uint32_t& mask = _interest[fd];
+        uint32_t new_mask = mask|filter_mask(filter);
+        if (new_mask != mask) {
+            update_interest(fd, mask, new_mask);
+            mask = new_mask;
+        }
+    }
+
+    void add_timer_event(uintptr_t fd, uint32_t period_in_ms) {
+        int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+
+        struct itimerspec spec;
+        spec.it_interval.tv_sec = period_in_ms/1000;
+        spec.it_interval.tv_nsec = (period_in_ms%1000)*1000000L;
+        spec.it_value = spec.it_interval;
+        timerfd_settime(tfd, 0, &spec, nullptr);
+
+        struct epoll_event evt;
+        evt.events = EPOLLIN;
+        evt.data.u64 = (((uint64_t)tfd+1) << TIMER_SHIFT) | (uint32_t)fd;
+        epoll_ctl(_ep, EPOLL_CTL_ADD, tfd, &evt);
+
+        _timers[fd] = tfd;
+    }
+
+    void delete_event(uintptr_t fd, int16_t filter) {
+        if (filter == EVFILT_TIMER) {
+            auto it = _timers.find(fd);
+            if (it != _timers.end()) {
+                ::close(it->second); // closing also removes it from the set
+                _timers.erase(it);
+            }
+            return;
+        }
+
+        auto it = _interest.find(fd);
+        if (it == _interest.end()) return;
+
+        uint32_t new_mask = it->second & ~filter_mask(filter);
+        update_interest(fd, it->second, new_mask);
+        if (new_mask == 0) _interest.erase(it);
+        else it->second = new_mask;
+    }
+
+    // the returned buffer is owned by the queue and is overwritten by the
+    // next call, so don't hold on to it across loop iterations
+    const std::vector<event_t>& get_events() {
+        int n_evts = epoll_wait(_ep, _raw, MAX_EVENTS, -1);
+
+        _events.clear();
+        for (int i=0; i<n_evts; i++) {
+            uint64_t data = _raw[i].data.u64;
+            uint32_t what = _raw[i].events;
+            uintptr_t ident = (uint32_t)data;
+
+            if (data >> TIMER_SHIFT) {
+                // drain the expiry count, otherwise the timerfd stays readable
+                uint64_t expirations;
+                ssize_t nb = read((int)(data >> TIMER_SHIFT)-1, &expirations, sizeof(expirations));
+                (void)nb;
+                _events.push_back({ ident, EVFILT_TIMER });
+                continue;
+            }
+
+            // hangups and errors are reported as readable so that the next
+            // recv returns 0/-1 and the usual disconnect handling kicks in,
+            // same as kqueue's EV_EOF.
+            if (what & (EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR)) {
+                _events.push_back({ ident, EVFILT_READ });
+            }
+            if (what & EPOLLOUT) {
+                _events.push_back({ ident, EVFILT_WRITE });
+            }
+        }
+        return _events;
+    }
+
+    void close() {
+        for (auto& p : _timers) {
+            ::close(p.second);
+        }
+        _timers.clear();
+        ::close(_ep);
+    }
+};
+
+#endif
+
+#ifdef HAVE_IO_URING
+
+// a send or receive handed to UringEventQueue that has finished. token is
+// whatever the caller passed in, res is the syscall return value (-errno on
+// failure). A chunk send hands its chunk back, so it can be queued again.
+struct IoCompletion {
+    uint64_t token;
+    int res;
+    bool is_send;
+    ChunkRef chunk;
+};
+
+// Completion based backend. Readiness is emulated with one-shot POLL_ADDs that
+// are re-armed after they fire (which keeps level triggered semantics), and
+// on top of that sends and receives can be queued directly. Nothing reaches
+// the kernel until the next get_events(), so registrations, re-arms, sends
+// and receives all go in with a single io_uring_enter.
+class UringEventQueue {
+
+    static const unsigned RING_ENTRIES = 1024;
+    static const unsigned MAX_INFLIGHT_SENDS = 1024;
+
+    // user_data layout: op in the top byte. Polls carry the fd in the low 32
+    // bits, the filter in the next 16 and a generation in the 8 after that,
+    // so that completions of polls we've since deleted can be told apart.
+    static const uint64_t OP_POLL = 1;
+    static const uint64_t OP_TIMER = 2;
+    static const uint64_t OP_SEND = 3;
+    static const uint64_t OP_RECV = 4;
+    static const uint64_t OP_CANCEL = 5;
+    static const int OP_SHIFT = 56;
+    static const int GEN_SHIFT = 48;
+    static const uint64_t PAYLOAD_MASK = (1ULL << OP_SHIFT)-1;
+
+    IoUring _ring;
+    bool _ok;
+
+    std::unordered_map<uint64_t,uint64_t> _polls;   // (fd,filter) -> current user_data
+    uint8_t _poll_gen = 0;
+
+    std::unordered_map<uintptr_t,int> _timers;      // ident -> timerfd
+    std::unordered_map<int,uintptr_t> _timer_idents;
+
+    // the kernel reads msghdr/iovec/address asynchronously, so they have to
+    // stay put until the send completes. Fixed size so they never move.
+    // a chunk goes out as its header and its data
+    static const size_t MAX_SEND_IOVS = 2;
+
+    // What's sent has to stay put too: a chunk is held on to through its
+    // ref, a control message is copied in.
+    struct SendOp {
+        struct msghdr msg;
+        struct iovec iov[MAX_SEND_IOVS];
+        struct sockaddr_in addr;
+        uint64_t token;
+        ChunkRef chunk;
+        ControlPacket control;
+    };
+    std::vector<SendOp> _send_ops;
+    std::vector<uint32_t> _free_send_ops;
+
+    std::vector<event_t> _events;
+    std::vector<IoCompletion> _completions;
+
+    // polls and timers (by user_data) that there was no SQE for, and polls
+    // to cancel likewise; tried again once get_events() has made room
+    std::vector<uint64_t> _unarmed;
+    std::vector<uint64_t> _uncancelled;
+    std::vector<uint64_t> _retrying;
+
+    // null if the SQ ring is full and the kernel won't take any of it right
+    // now either (EBUSY while the CQ ring is backed up, EAGAIN)
+    struct io_uring_sqe* next_sqe() {
+        struct io_uring_sqe* sqe = _ring.get_sqe();
+        if (sqe == nullptr) {
+            // SQ ring full, push what we have to the kernel and try again
+            _ring.submit(0);
+            sqe = _ring.get_sqe();
+        }
+        return sqe;
+    }
+
+    // (there has to be a free one)
+    uint32_t take_send_op(uint64_t token) {
+        uint32_t idx = _free_send_ops.back();
+        _free_send_ops.pop_back();
+        _send_ops[idx].token = token;
+        return idx;
+    }
+
+    // hands op idx, with its first n_iov iovecs filled in, to the ring, or
+    // puts it back if there's no SQE for it
+    bool submit_send(uint32_t idx, size_t n_iov, int fd, const struct sockaddr_in* to) {
+        SendOp& s = _send_ops[idx];
+        memset(&s.msg, 0, sizeof(s.msg));
+        s.msg.msg_iov = s.iov;
+        s.msg.msg_iovlen = n_iov;
+        if (to != nullptr) {
+            s.addr = *to;
+            s.msg.msg_name = &s.addr;
+            s.msg.msg_namelen = sizeof(s.addr);
+        }
+
+        struct io_uring_sqe* sqe = next_sqe();
+        if (sqe == nullptr) {
+            s.chunk = ChunkRef();
+            _free_send_ops.push_back(idx);
+            return false;
+        }
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)&s.msg;
+        sqe->len = 1;
+        sqe->user_data = (OP_SEND << OP_SHIFT) | idx;
+        return true;
+    }
+
+    static uint64_t poll_key(uintptr_t fd, int16_t filter) {
+        return ((uint64_t)(uint16_t)filter << 32) | (uint32_t)fd;
+    }
+
+    void arm_poll(uint64_t user_data) {
+        struct io_uring_sqe* sqe = next_sqe();
+        if (sqe == nullptr) {
+            _unarmed.push_back(user_data);
+            return;
+        }
+        int16_t filter = (int16_t)(uint16_t)(user_data >> 32);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = (int)(uint32_t)user_data;
+        sqe->poll32_events = filter == EVFILT_WRITE ? POLLOUT : POLLIN|POLLRDHUP;
+        sqe->user_data = user_data;
+    }
+
+    static uint64_t timer_user_data(int tfd) {
+        return (OP_TIMER << OP_SHIFT) | (uint32_t)tfd;
+    }
+
+    void arm_timer(int tfd) {
+        struct io_uring_sqe* sqe = next_sqe();
+        if (sqe == nullptr) {
+            _unarmed.push_back(timer_user_data(tfd));
+            return;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = tfd;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = timer_user_data(tfd);
+    }
+
+    void cancel_poll(uint64_t user_data) {
+        struct io_uring_sqe* sqe = next_sqe();
+        if (sqe == nullptr) {
+            _uncancelled.push_back(user_data);
+            return;
+        }
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = user_data;
+        sqe->user_data = OP_CANCEL << OP_SHIFT;
+    }
+
+    // what didn't fit into the SQ ring before, unless it was deleted since
+    void retry_unarmed() {
+        _retrying.swap(_unarmed);
+        for (auto user_data : _retrying) {
+            if ((user_data >> OP_SHIFT) == OP_TIMER) {
+                int tfd = (int)(uint32_t)user_data;
+                if (_timer_idents.find(tfd) != _timer_idents.end()) arm_timer(tfd);
+                continue;
+            }
+            auto it = _polls.find(user_data & ((1ULL << GEN_SHIFT)-1));
+            if (it != _polls.end() and it->second == user_data) arm_poll(user_data);
+        }
+        _retrying.clear();
+
+        _retrying.swap(_uncancelled);
+        for (auto user_data : _retrying) {
+            cancel_poll(user_data);
+        }
+        _retrying.clear();
+    }
+
+    void reap(const struct io_uring_cqe& cqe) {
+        uint64_t op = cqe.user_data >> OP_SHIFT;
+        uint64_t payload = cqe.user_data & PAYLOAD_MASK;
+
+        if (op == OP_POLL) {
+            uint64_t key = payload & ((1ULL << GEN_SHIFT)-1);
+            auto it = _polls.find(key);
+            if (it == _polls.end() or it->second != cqe.user_data) return; // deleted since
+            if (cqe.res < 0) {
+                // fd went away under us (EBADF and friends), don't re-arm
+                _polls.erase(it);
+                return;
+            }
+            _events.push_back({ (uintptr_t)(uint32_t)key, (int16_t)(uint16_t)(key >> 32) });
+            arm_poll(cqe.user_data);
+        }
+        else if (op == OP_TIMER) {
+            int tfd = (int)(uint32_t)payload;
+            auto it = _timer_idents.find(tfd);
+            if (it == _timer_idents.end()) return;
+            uint64_t expirations;
+            ssize_t nb = read(tfd, &expirations, sizeof(expirations));
+            (void)nb;
+            _events.push_back({ it->second, EVFILT_TIMER });
+            arm_timer(tfd);
+        }
+        else if (op == OP_SEND) {
+            SendOp& s = _send_ops[payload];
+            _completions.push_back({ s.token, cqe.res, true, std::move(s.chunk) });
+            s.chunk = ChunkRef();
+            _free_send_ops.push_back((uint32_t)payload);
+        }
+        else if (op == OP_RECV) {
+            _completions.push_back({ payload, cqe.res, false, ChunkRef() });
+        }
+    }
+
+public:
+
+    UringEventQueue():
+        _send_ops(MAX_INFLIGHT_SENDS) {
+        _ok = _ring.init(RING_ENTRIES);
+        for (uint32_t i=MAX_INFLIGHT_SENDS; i>0; i--) {
+            _free_send_ops.push_back(i-1);
+        }
+        _events.reserve(RING_ENTRIES);
+        _completions.reserve(RING_ENTRIES);
+    }
+
+    bool ok() {
+        return _ok;
+    }
+
+    void add_event(uintptr_t fd, int16_t filter) {
+        uint64_t key = poll_key(fd, filter);
+        if (_polls.find(key) != _polls.end()) return;
+
+        uint64_t user_data = (OP_POLL << OP_SHIFT) | ((uint64_t)_poll_gen++ << GEN_SHIFT) | key;
+        _polls[key] = user_data;
+        arm_poll(user_data);
+    }
+
+    void add_timer_event(uintptr_t fd, uint32_t period_in_ms) {
+        int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+
+        struct itimerspec spec;
+        spec.it_interval.tv_sec = period_in_ms/1000;
+        spec.it_interval.tv_nsec = (period_in_ms%1000)*1000000L;
+        spec.it_value = spec.it_interval;
+        timerfd_settime(tfd, 0, &spec, nullptr);
+
+        _timers[fd] = tfd;
+        _timer_idents[tfd] = fd;
+        arm_timer(tfd);
+    }
+
+    void delete_event(uintptr_t fd, int16_t filter) {
+        if (filter == EVFILT_TIMER) {
+            auto it = _timers.find(fd);
+            if (it != _timers.end()) {
+                // (a new timer can get the same fd, so don't leave the old
+                // one waiting to be armed)
+                uint64_t user_data = timer_user_data(it->second);
+                _unarmed.erase(std::remove(_unarmed.begin(), _unarmed.end(), user_data), _unarmed.end());
+                cancel_poll(user_data);
+                _timer_idents.erase(it->second);
+                ::close(it->second);
+                _timers.erase(it);
+            }
+            return;
+        }
+
+        auto it = _polls.find(poll_key(fd, filter));
+        if (it == _polls.end()) return;
+        cancel_poll(it->second);
+        _polls.erase(it);
+    }
+
+    // registers [base, base+len) as fixed buffer 0, for queue_recv_fixed.
+    bool register_buffer(void* base, size_t len) {
+        struct iovec iov;
+        iov.iov_base = base;
+        iov.iov_len = len;
+        return _ring.register_buffers(&iov, 1) == 0;
+    }
+
+    // queues a send of buf on fd (to `to`, or to the connected peer if it's
+    // null). buf has to stay valid until the completion comes back. Returns
+    // false if too many sends are already in flight, or the SQ ring is full.
+    bool queue_send(int fd, const void* buf, size_t len, const struct sockaddr_in* to, uint64_t token) {
+        struct iovec iov = { const_cast<void*>(buf), len };
+        return queue_send(fd, &iov, 1, to, token);
+    }
+
+    // same, but the datagram is gathered from up to MAX_SEND_IOVS buffers
+    bool queue_send(int fd, const struct iovec* iov, size_t n_iov, const struct sockaddr_in* to,
+                    uint64_t token) {
+        if (_free_send_ops.empty() or n_iov > MAX_SEND_IOVS) return false;
+        uint32_t idx = take_send_op(token);
+        SendOp& s = _send_ops[idx];
+        for (size_t i=0; i<n_iov; i++) s.iov[i] = iov[i];
+        return submit_send(idx, n_iov, fd, to);
+    }
+
+    // same for a chunk (its header, then its data), which the op holds on to
+    // until the send completes, so the caller doesn't have to
+    bool queue_send(int fd, const ChunkRef& chunk, const struct sockaddr_in* to, uint64_t token) {
+        if (_free_send_ops.empty()) return false;
+        uint32_t idx = take_send_op(token);
+        SendOp& s = _send_ops[idx];
+        s.chunk = chunk;
+        s.iov[0] = { const_cast<void*>(s.chunk.header), ChunkRef::HEADER };
+        s.iov[1] = { const_cast<char*>(s.chunk.data), s.chunk.size };
+        return submit_send(idx, 2, fd, to);
+    }
+
+    // and for a control message, which is copied into the op
+    bool queue_send(int fd, const ControlPacket& msg, const struct sockaddr_in* to, uint64_t token) {
+        if (_free_send_ops.empty()) return false;
+        uint32_t idx = take_send_op(token);
+        SendOp& s = _send_ops[idx];
+        s.control = msg;
+        s.iov[0] = { &s.control, msg.size() };
+        return submit_send(idx, 1, fd, to);
+    }
+
+    // queues a receive on fd into buf, which must lie inside the buffer
+    // passed to register_buffer(), so the kernel skips pinning it every time.
+    // Returns false if the SQ ring is full.
+    bool queue_recv_fixed(int fd, void* buf, size_t len, uint64_t token) {
+        struct io_uring_sqe* sqe = next_sqe();
+        if (sqe == nullptr) return false;
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = len;
+        sqe->buf_index = 0;
+        sqe->user_data = (OP_RECV << OP_SHIFT) | (token & PAYLOAD_MASK);
+        return true;
+    }
+
+    // sends and receives that finished during the last get_events()
+    const std::vector<IoCompletion>& completions() {
+        return _completions;
+    }
+
+    const std::vector<event_t>& get_events() {
+        _events.clear();
+        _completions.clear();
+
+        _ring.submit(_ring.has_completions() ? 0 : 1);
+        _ring.for_each_cqe([this](const struct io_uring_cqe& cqe) { reap(cqe); });
+        // goes in with the next get_events()
+        retry_unarmed();
+        return _events;
+    }
+
+    void close() {
+        for (auto& p : _timers) {
+            ::close(p.second);
+        }
+        _timers.clear();
+        _timer_idents.clear();
+        _ring.close();
+    }
+};
+
+#endif
+
+#if defined(EVENT_QUEUE_KQUEUE) || !defined(HAVE_EPOLL)
+using NativeEventQueue = KqueueEventQueue;
+#else
+using NativeEventQueue = EpollEventQueue;
+#endif
+
+// What the server and client actually hold: the platform's native readiness
+// backend, or io_uring if that was asked for at startup (and is available).
+class EventQueue {
+
+    NativeEventQueue _native;
+#ifdef HAVE_IO_URING
+    std::unique_ptr<UringEventQueue> _uring;
+#endif
+
+public:
+
+    explicit EventQueue(bool use_io_uring = false) {
+#ifdef HAVE_IO_URING
+        if (use_io_uring) {
+            _uring.reset(new UringEventQueue);
+            if (!_uring->ok()) {
+                std::cout << "io_uring unavailable (errno " << errno << "), falling back to readiness based I/O" << std::endl;
+                _uring.reset();
+            }
+        }
+#else
+        if (use_io_uring) {
+            std::cout << "io_uring is linux only, falling back to readiness based I/O" << std::endl;
+        }
+#endif
+    }
+
+#ifdef HAVE_IO_URING
+    // non-null if we're running on io_uring
+    UringEventQueue* io_uring() {
+        return _uring.get();
+    }
+#define EVENT_QUEUE_DISPATCH(call) (_uring ? _uring->call : _native.call)
+#else
+#define EVENT_QUEUE_DISPATCH(call) (_native.call)
+#endif
+
+    void add_event(uintptr_t fd, int16_t filter) {
+        EVENT_QUEUE_DISPATCH(add_event(fd, filter));
+    }
+
+    void add_timer_event(uintptr_t fd, uint32_t period_in_ms) {
+        EVENT_QUEUE_DISPATCH(add_timer_event(fd, period_in_ms));
+    }
+
+    void delete_event(uintptr_t fd, int16_t filter) {
+        EVENT_QUEUE_DISPATCH(delete_event(fd, filter));
+    }
+
+    const std::vector<event_t>& get_events() {
+        return EVENT_QUEUE_DISPATCH(get_events());
+    }
+
+    void close() {
+#ifdef HAVE_IO_URING
+        if (_uring) _uring->close();
+#endif
+        _native.close();
+    }
+
+#undef EVENT_QUEUE_DISPATCH
+};
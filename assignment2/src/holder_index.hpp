@@ -0,0 +1,111 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Which clients have each of a shard's chunks, going by their HAVEs. Only
+// the last SLOTS clients to announce a chunk are kept, in a flat array with a
+// fixed number of slots per chunk: a miss is only ever sent to a couple of
+// them anyway, and clients that announced it recently are the likeliest to
+// still be around. Who gets asked rotates between them, so that the client a
+// chunk was first distributed to doesn't get every ask for it. How many
+// clients announced a chunk in total is counted as well (for rarest first on
+// the clients, see AVAIL).
+//
+// Like WaitTable, it only keeps the chunks with chunk_id % n_shards == shard.
+class HolderIndex {
+
+    enum : uint32_t { NONE = UINT32_MAX };
+
+public:
+
+    static const size_t SLOTS = 4;
+
+private:
+
+    std::vector<uint32_t> _holders;     // SLOTS per chunk
+    std::vector<uint8_t> _oldest;       // the slot the next holder replaces
+    std::vector<uint8_t> _turn;         // the slot to ask first next time
+    std::vector<uint32_t> _count;       // holders, including those not kept
+    uint32_t _n_shards = 1;
+    uint32_t _shard = 0;
+
+    size_t index(uint32_t chunk_id) {
+        size_t k = chunk_id/_n_shards;
+        if (k >= _oldest.size()) {
+            _holders.resize((k+1)*SLOTS, NONE);
+            _oldest.resize(k+1, 0);
+            _turn.resize(k+1, 0);
+            _count.resize(k+1, 0);
+        }
+        return k;
+    }
+
+public:
+
+    void reserve(uint32_t tot_chunks, uint32_t n_shards, uint32_t shard) {
+        _n_shards = n_shards > 0 ? n_shards : 1;
+        _shard = shard;
+        size_t n = (tot_chunks+_n_shards-1)/_n_shards;
+        _holders.assign(n*SLOTS, NONE);
+        _oldest.assign(n, 0);
+        _turn.assign(n, 0);
+        _count.assign(n, 0);
+    }
+
+    // false if client_id already announced chunk_id (as far as we remember)
+    bool add(uint32_t chunk_id, uint32_t client_id) {
+        size_t k = index(chunk_id);
+        uint32_t* h = &_holders[k*SLOTS];
+        for (size_t s=0; s<SLOTS; s++) {
+            if (h[s] == client_id) return false;
+        }
+        h[_oldest[k]] = client_id;
+        _oldest[k] = (_oldest[k]+1) % SLOTS;
+        _count[k]++;
+        return true;
+    }
+
+    uint32_t count(uint32_t chunk_id) {
+        return _count[index(chunk_id)];
+    }
+
+    // calls f(client_id) for up to n holders of chunk_id for which
+    // skip(client_id) is false; returns how many
+    template<typename S, typename F>
+    size_t pick_if(uint32_t chunk_id, size_t n, S skip, F f) {
+        size_t k = index(chunk_id);
+        const uint32_t* h = &_holders[k*SLOTS];
+        size_t picked = 0;
+        size_t first = _turn[k];
+        for (size_t i=0; i<SLOTS and picked<n; i++) {
+            uint32_t c = h[(first+i) % SLOTS];
+            if (c == NONE or skip(c)) continue;
+            f(c);
+            picked++;
+        }
+        _turn[k] = (first+1) % SLOTS;
+        return picked;
+    }
+
+    // the same, for any holders other than `except`
+    template<typename F>
+    size_t pick(uint32_t chunk_id, size_t n, uint32_t except, F f) {
+        return pick_if(chunk_id, n, [except](uint32_t c) { return c == except; }, f);
+    }
+
+    // Drops client_id everywhere, and calls f(chunk_id) for every chunk whose
+    // count went down. Walks every chunk, but clients only go away once. (A
+    // holder that fell out of its chunk's slots stays counted.)
+    template<typename F>
+    void forget(uint32_t client_id, F f) {
+        for (size_t i=0; i<_holders.size(); i++) {
+            if (_holders[i] != client_id) continue;
+            _holders[i] = NONE;
+            size_t k = i/SLOTS;
+            if (_count[k] > 0) _count[k]--;
+            f((uint32_t)(k*_n_shards + _shard));
+        }
+    }
+};
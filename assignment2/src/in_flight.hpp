@@ -0,0 +1,128 @@
+#pragma once
+
+#include <queue>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+// The chunks a shard asked its clients for on behalf of someone waiting for
+// them, each with a deadline. A chunk that isn't back by then most likely
+// won't come at all (the clients asked dropped the ask, or went away), and
+// expire() hands it back to be asked for again, from somebody else, rather
+// than leaving it to the waiting clients' own, much longer, timeouts. The
+// last few clients asked are remembered for that.
+//
+// Fetches sit in a flat array, like WaitTable's heads (a shard only keeps
+// every n_shards-th chunk), and their deadlines in a heap. Rather than
+// digging an entry out of the heap when its chunk comes back or is asked for
+// again, it's skipped once it comes up.
+class InFlightTable {
+
+    using clock = std::chrono::steady_clock;
+
+public:
+
+    // clients asked that are remembered per chunk
+    static const size_t TRIED = 4;
+
+private:
+
+    struct Fetch {
+        clock::time_point sent;         // last time it was asked for
+        clock::time_point deadline;
+        uint32_t attempts = 0;          // 0 if it isn't in flight
+        uint32_t n_tried = 0;
+        uint32_t tried[TRIED];
+    };
+
+    using Deadline = std::pair<clock::time_point,uint32_t>;
+
+    std::vector<Fetch> _fetches;
+    std::priority_queue<Deadline,std::vector<Deadline>,std::greater<Deadline>> _deadlines;
+    uint32_t _n_shards = 1;
+    size_t _size = 0;
+
+    Fetch& fetch(uint32_t chunk_id) {
+        size_t k = chunk_id/_n_shards;
+        if (k >= _fetches.size()) _fetches.resize(k+1);
+        return _fetches[k];
+    }
+
+public:
+
+    void reserve(uint32_t tot_chunks, uint32_t n_shards) {
+        _n_shards = n_shards > 0 ? n_shards : 1;
+        _fetches.assign((tot_chunks+_n_shards-1)/_n_shards, Fetch());
+        _deadlines = decltype(_deadlines)();
+        _size = 0;
+    }
+
+    // chunk_id is being asked for (again), and has until timeout to show up
+    void start(uint32_t chunk_id, clock::duration timeout) {
+        Fetch& f = fetch(chunk_id);
+        if (f.attempts == 0) {
+            f.n_tried = 0;
+            _size++;
+        }
+        f.attempts++;
+        f.sent = clock::now();
+        f.deadline = f.sent + timeout;
+        _deadlines.emplace(f.deadline, chunk_id);
+    }
+
+    // how many times chunk_id was asked for so far, 0 if it isn't in flight
+    uint32_t attempts(uint32_t chunk_id) {
+        return fetch(chunk_id).attempts;
+    }
+
+    // client_id was asked for chunk_id (ignored unless it's in flight)
+    void tried(uint32_t chunk_id, uint32_t client_id) {
+        Fetch& f = fetch(chunk_id);
+        if (f.attempts == 0) return;
+        f.tried[f.n_tried % TRIED] = client_id;
+        f.n_tried++;
+    }
+
+    bool was_tried(uint32_t chunk_id, uint32_t client_id) {
+        Fetch& f = fetch(chunk_id);
+        if (f.attempts == 0) return false;
+        for (uint32_t i=0; i<f.n_tried and i<TRIED; i++) {
+            if (f.tried[i] == client_id) return true;
+        }
+        return false;
+    }
+
+    // chunk_id came back, or nobody wants it anymore. Returns how long ago it
+    // was last asked for, zero if it wasn't in flight.
+    clock::duration finish(uint32_t chunk_id) {
+        Fetch& f = fetch(chunk_id);
+        if (f.attempts == 0) return clock::duration::zero();
+        f.attempts = 0;
+        _size--;
+        return clock::now() - f.sent;
+    }
+
+    // calls f(chunk_id) for every chunk in flight whose deadline passed by
+    // now; f has to either start() it again or finish() it
+    template<typename F>
+    void expire(clock::time_point now, F f) {
+        while (!_deadlines.empty() and _deadlines.top().first <= now) {
+            Deadline d = _deadlines.top();
+            _deadlines.pop();
+            Fetch& fe = fetch(d.second);
+            // came back, or was asked for again since
+            if (fe.attempts == 0 or fe.deadline != d.first) continue;
+            f(d.second);
+        }
+    }
+
+    bool empty() const {
+        return _size == 0;
+    }
+
+    size_t size() const {
+        return _size;
+    }
+};
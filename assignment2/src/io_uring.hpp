@@ -0,0 +1,182 @@
+#pragma once
+
+// Minimal io_uring wrapper on top of the raw syscalls, so we don't have to
+// depend on liburing. Only does what the event queue needs: grab SQEs, submit
+// them (optionally waiting for completions) and walk the CQ ring.
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+
+class IoUring {
+
+    int _fd = -1;
+
+    unsigned* _sq_head;
+    unsigned* _sq_tail;
+    unsigned* _sq_mask;
+    unsigned* _sq_array;
+    struct io_uring_sqe* _sqes;
+    unsigned _sq_local_tail = 0;    // SQEs handed out but not yet published
+    unsigned _sq_entries;
+
+    unsigned* _cq_head;
+    unsigned* _cq_tail;
+    unsigned* _cq_mask;
+    struct io_uring_cqe* _cqes;
+
+    void* _sq_ring = MAP_FAILED;
+    size_t _sq_ring_len = 0;
+    void* _cq_ring = MAP_FAILED;
+    size_t _cq_ring_len = 0;
+    size_t _sqes_len = 0;
+
+    static int sys_setup(unsigned entries, struct io_uring_params* p) {
+        return (int)syscall(__NR_io_uring_setup, entries, p);
+    }
+
+    static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+        return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+    }
+
+    static int sys_register(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+        return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+    }
+
+public:
+
+    // returns false if the kernel doesn't support (or doesn't allow) io_uring,
+    // the caller is expected to fall back to readiness based I/O.
+    bool init(unsigned entries) {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+
+        _fd = sys_setup(entries, &p);
+        if (_fd < 0) {
+            _fd = -1;
+            return false;
+        }
+
+        _sq_ring_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+        _cq_ring_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            if (_cq_ring_len > _sq_ring_len) _sq_ring_len = _cq_ring_len;
+            _cq_ring_len = _sq_ring_len;
+        }
+
+        _sq_ring = mmap(nullptr, _sq_ring_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                        _fd, IORING_OFF_SQ_RING);
+        if (_sq_ring == MAP_FAILED) {
+            close();
+            return false;
+        }
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            _cq_ring = _sq_ring;
+        }
+        else {
+            _cq_ring = mmap(nullptr, _cq_ring_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                            _fd, IORING_OFF_CQ_RING);
+            if (_cq_ring == MAP_FAILED) {
+                close();
+                return false;
+            }
+        }
+
+        _sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+        _sqes = (struct io_uring_sqe*)mmap(nullptr, _sqes_len, PROT_READ|PROT_WRITE,
+                                           MAP_SHARED|MAP_POPULATE, _fd, IORING_OFF_SQES);
+        if (_sqes == MAP_FAILED) {
+            _sqes_len = 0;
+            close();
+            return false;
+        }
+
+        char* sq = (char*)_sq_ring;
+        _sq_head = (unsigned*)(sq + p.sq_off.head);
+        _sq_tail = (unsigned*)(sq + p.sq_off.tail);
+        _sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+        _sq_array = (unsigned*)(sq + p.sq_off.array);
+        _sq_entries = p.sq_entries;
+        _sq_local_tail = *_sq_tail;
+
+        char* cq = (char*)_cq_ring;
+        _cq_head = (unsigned*)(cq + p.cq_off.head);
+        _cq_tail = (unsigned*)(cq + p.cq_off.tail);
+        _cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+        _cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+        return true;
+    }
+
+    // returns nullptr if the SQ ring is full; submit() and try again.
+    struct io_uring_sqe* get_sqe() {
+        unsigned head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+        if (_sq_local_tail - head >= _sq_entries) {
+            return nullptr;
+        }
+        unsigned idx = _sq_local_tail & *_sq_mask;
+        _sq_array[idx] = idx;
+        _sq_local_tail++;
+
+        struct io_uring_sqe* sqe = &_sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    unsigned pending() {
+        return _sq_local_tail - *_sq_tail;
+    }
+
+    // publishes all SQEs handed out so far and enters the kernel once, waiting
+    // for at least wait_nr completions.
+    int submit(unsigned wait_nr) {
+        unsigned to_submit = pending();
+        __atomic_store_n(_sq_tail, _sq_local_tail, __ATOMIC_RELEASE);
+
+        if (to_submit == 0 and wait_nr == 0) return 0;
+
+        int ret;
+        do {
+            ret = sys_enter(_fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+        } while (ret < 0 and errno == EINTR and wait_nr == 0);
+        return ret;
+    }
+
+    bool has_completions() {
+        return __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE) != *_cq_head;
+    }
+
+    // calls f(cqe) for every completion in the CQ ring, then hands the
+    // entries back to the kernel. Returns the number of completions seen.
+    template<typename F>
+    unsigned for_each_cqe(F f) {
+        unsigned head = *_cq_head;
+        unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+        unsigned n = 0;
+        for (; head != tail; head++, n++) {
+            f(_cqes[head & *_cq_mask]);
+        }
+        __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+        return n;
+    }
+
+    int register_buffers(const struct iovec* iovs, unsigned n) {
+        return sys_register(_fd, IORING_REGISTER_BUFFERS, iovs, n);
+    }
+
+    void close() {
+        if (_sqes_len) munmap(_sqes, _sqes_len);
+        if (_cq_ring != MAP_FAILED and _cq_ring != _sq_ring) munmap(_cq_ring, _cq_ring_len);
+        if (_sq_ring != MAP_FAILED) munmap(_sq_ring, _sq_ring_len);
+        _sqes_len = 0;
+        _sq_ring = _cq_ring = MAP_FAILED;
+        if (_fd != -1) ::close(_fd);
+        _fd = -1;
+    }
+};
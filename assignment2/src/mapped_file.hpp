@@ -0,0 +1,100 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstddef>
+#include <string>
+
+// A whole file mapped read only. Nothing is read when it's opened, pages come
+// in from the page cache as they're touched, so opening is just as fast for a
+// multi-GB file as for a small one, and the file never has a second copy on
+// the heap.
+class MappedFile {
+
+    const char* _data = nullptr;
+    size_t _size = 0;
+
+public:
+
+    MappedFile() {}
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    // false with errno set if the file can't be mapped (which includes an
+    // empty file: there's nothing to map)
+    bool open(const std::string& path) {
+        close();
+
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            int err = errno;
+            ::close(fd);
+            errno = err;
+            return false;
+        }
+        if (st.st_size == 0) {
+            ::close(fd);
+            errno = EINVAL;
+            return false;
+        }
+
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        int err = errno;
+        // the mapping keeps the file open
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            errno = err;
+            return false;
+        }
+
+        _data = (const char*)p;
+        _size = st.st_size;
+
+        // the file is only ever read front to back (see will_need), so the
+        // kernel can read ahead aggressively and drop pages behind us
+        madvise(p, _size, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    void close() {
+        if (_data != nullptr) munmap(const_cast<char*>(_data), _size);
+        _data = nullptr;
+        _size = 0;
+    }
+
+    bool is_open() const {
+        return _data != nullptr;
+    }
+
+    const char* data() const {
+        return _data;
+    }
+
+    size_t size() const {
+        return _size;
+    }
+
+    // starts reading [offset, offset+len) in the background, so that sending
+    // it doesn't stall on a page fault per page
+    void will_need(size_t offset, size_t len) const {
+        if (_data == nullptr or offset >= _size) return;
+        if (len > _size-offset) len = _size-offset;
+
+        // madvise wants a page aligned start
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t start = offset & ~(page-1);
+        madvise(const_cast<char*>(_data)+start, len+(offset-start), MADV_WILLNEED);
+    }
+};
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <iostream>
+#include <algorithm>
+#include <unordered_set>
+
+// Readahead for the server's chunk cache. Every client's requests are fed to
+// a PrefetchStream, which works out whether the client walks the file in
+// order, with a fixed stride or at random (see init_chunk_request_sequence on
+// the client), and for the first two names the chunks it will want next, so
+// they can be asked for before the client gets there.
+//
+// How far ahead it goes adapts to how it's doing: the depth doubles while
+// prefetched chunks get used but still arrive too late, halves when most of
+// them are never asked for, and never drops below what it takes to cover the
+// time an ask takes to come back (owner latency) at the client's request rate.
+
+enum class AccessPattern {
+    RANDOM,
+    SEQUENTIAL,
+    STRIDED
+};
+
+inline const char* access_pattern_name(AccessPattern p) {
+    switch (p) {
+        case AccessPattern::RANDOM:     return "random";
+        case AccessPattern::SEQUENTIAL: return "sequential";
+        case AccessPattern::STRIDED:    return "strided";
+    }
+    return "?";
+}
+
+struct PrefetchStats {
+    uint64_t issued = 0;    // chunks prefetched
+    uint64_t useful = 0;    // ... that the client asked for afterwards
+    uint64_t late = 0;      // ... of which not in the cache yet when it did
+    uint64_t wasted = 0;    // ... that it never asked for
+
+    void print(std::ostream& out, const std::string& label) const {
+        out << label << ": " << issued << " chunks prefetched, " << useful << " used ("
+            << (issued ? 100.0*useful/issued : 0.0) << "%, " << late << " late), "
+            << wasted << " wasted" << std::endl;
+    }
+};
+
+class PrefetchStream {
+
+    using clock = std::chrono::steady_clock;
+
+    // a pattern counts once the same stride was seen this many times in a row
+    static const uint32_t CONFIDENT = 2;
+    static const uint32_t MAX_CONFIDENCE = 8;
+
+    uint32_t _max_depth;
+    uint32_t _depth;
+
+    bool _seen = false;
+    uint32_t _last = 0;
+    int64_t _stride = 0;
+    uint32_t _confidence = 0;
+
+    // the next chunk to prefetch, so that nothing is asked for twice while
+    // the client stays on its pattern
+    int64_t _next = -1;
+
+    // prefetched chunks the client hasn't asked for yet
+    std::unordered_set<uint32_t> _pending;
+
+    // what happened since the depth was last adapted
+    clock::time_point _epoch_start = clock::now();
+    uint32_t _epoch_requests = 0;
+    uint32_t _epoch_issued = 0;
+    uint32_t _epoch_useful = 0;
+    uint32_t _epoch_late = 0;
+
+    // whether a comes after b going in the direction of the stride
+    bool ahead_of(int64_t a, int64_t b) const {
+        return _stride > 0 ? a > b : a < b;
+    }
+
+    void drop_pending(PrefetchStats& stats) {
+        stats.wasted += _pending.size();
+        _pending.clear();
+        _next = -1;
+    }
+
+    // latency_us: how long an ask takes to come back, 0 if not known yet
+    void adapt(uint32_t latency_us) {
+        double secs = std::chrono::duration<double>(clock::now()-_epoch_start).count();
+
+        if (_epoch_issued > 0) {
+            double accuracy = (double)_epoch_useful/_epoch_issued;
+            if (accuracy < 0.5) {
+                _depth = std::max<uint32_t>(_depth/2, 1);
+            }
+            else if (_epoch_late*4 > _epoch_useful) {
+                _depth = std::min(_depth*2, _max_depth);
+            }
+        }
+        // enough in flight to cover one round trip at the client's pace
+        if (latency_us > 0 and secs > 0) {
+            double rate = _epoch_requests/secs;
+            uint32_t cover = (uint32_t)(rate*latency_us/1e6) + 1;
+            _depth = std::min(std::max(_depth, cover), _max_depth);
+        }
+
+        _epoch_start = clock::now();
+        _epoch_requests = _epoch_issued = _epoch_useful = _epoch_late = 0;
+    }
+
+public:
+
+    static const uint32_t DEFAULT_MAX_DEPTH = 64;
+
+    explicit PrefetchStream(uint32_t max_depth = DEFAULT_MAX_DEPTH):
+        _max_depth{std::max<uint32_t>(max_depth, 1)},
+        _depth{std::min<uint32_t>(4, _max_depth)} {}
+
+    AccessPattern pattern() const {
+        if (_confidence < CONFIDENT) return AccessPattern::RANDOM;
+        return _stride == 1 ? AccessPattern::SEQUENTIAL : AccessPattern::STRIDED;
+    }
+
+    uint32_t depth() const {
+        return _depth;
+    }
+
+    // the client asked for chunk_id, and hit says whether it was in the cache
+    void observe(uint32_t chunk_id, bool hit, uint32_t latency_us, PrefetchStats& stats) {
+        if (_pending.erase(chunk_id) > 0) {
+            stats.useful++;
+            _epoch_useful++;
+            if (!hit) {
+                stats.late++;
+                _epoch_late++;
+            }
+        }
+
+        if (_seen) {
+            int64_t delta = (int64_t)chunk_id - _last;
+            if (delta == 0) return;
+            if (delta == _stride) {
+                if (_confidence < MAX_CONFIDENCE) _confidence++;
+            }
+            else {
+                // one odd request (a re-request, or skipping over the chunks
+                // it already has) only costs some confidence
+                _confidence = _confidence >= CONFIDENT ? _confidence-1 : 0;
+                if (_confidence == 0) {
+                    _stride = delta;
+                    drop_pending(stats);
+                }
+            }
+        }
+        _seen = true;
+        _last = chunk_id;
+
+        if (++_epoch_requests >= std::max<uint32_t>(_depth, 8)) adapt(latency_us);
+    }
+
+    // calls f(chunk_id) for every chunk to prefetch now: the ones up to depth
+    // strides past the last request that weren't prefetched already. f
+    // returns false if there was no need (the chunk is cached already).
+    template<typename F>
+    void plan(uint32_t tot_chunks, PrefetchStats& stats, F f) {
+        if (pattern() == AccessPattern::RANDOM) return;
+
+        // the client may have overtaken what was prefetched
+        int64_t next = _last + _stride;
+        if (_next >= 0 and ahead_of(_next, next)) next = _next;
+
+        int64_t end = _last + _stride*(int64_t)_depth;
+        for (; !ahead_of(next, end); next += _stride) {
+            if (next < 0 or next >= tot_chunks) break;
+            if (!f((uint32_t)next)) continue;
+            _pending.insert((uint32_t)next);
+            stats.issued++;
+            _epoch_issued++;
+        }
+        _next = next;
+
+        // the client went somewhere else without us noticing
+        if (_pending.size() > 2*_max_depth) drop_pending(stats);
+    }
+
+    // everything still pending when the client goes away was wasted
+    void close(PrefetchStats& stats) {
+        drop_pending(stats);
+    }
+};
@@ -1,19 +1,189 @@
 #pragma once
 
 #include <cinttypes>
+#include <cstddef>
+#include <cstring>
+#include <memory>
 
 const uint8_t REQ = 1;
 const uint8_t OPEN = 2;
 const uint8_t REG = 3;
+const uint8_t REQ_RANGE = 4;
+const uint8_t REQ_BITMAP = 5;
+// client -> server: I have these chunks now. Same layouts as REQ, REQ_RANGE
+// and REQ_BITMAP.
+const uint8_t HAVE = 6;
+const uint8_t HAVE_RANGE = 7;
+const uint8_t HAVE_BITMAP = 8;
 
+// client -> server: please send AVAIL. server -> client: how many clients
+// have each chunk, as far as the server knows, counting up to
+// MAX_AVAILABILITY (see encode_availability)
+const uint8_t AVAIL_REQ = 9;
+const uint8_t AVAIL = 10;
+const uint8_t MAX_AVAILABILITY = 15;
+
+// Only used with a server that tracks rather than relays (REG_P2P). client ->
+// server: peers can reach me on this UDP port (in chunk_id). server ->
+// client: you can get these chunks from these peers (see PeerList).
+const uint8_t PEER = 11;
+const uint8_t PEERS = 12;
+
+inline bool is_range_msg(uint8_t t) {
+    return t == REQ_RANGE or t == HAVE_RANGE;
+}
+
+inline bool is_bitmap_msg(uint8_t t) {
+    return t == REQ_BITMAP or t == HAVE_BITMAP;
+}
+
+// the chunk size is picked by the server when it loads the file and handed
+// to clients with REG. The biggest one still fits in a UDP datagram.
+const uint32_t DEFAULT_CHUNK_SIZE = 1024;
+const uint32_t MAX_CHUNK_SIZE = 63*1024;
+
+// A chunk on the wire: the header and then `size` bytes of data. data is as
+// big as a chunk can ever be, but chunks are only allocated with room for the
+// chunk size in use (see make_chunk), so never copy one by value or look past
+// data[size].
 struct FileChunk {
     uint32_t id;
     uint16_t size;
-    char data[1024];
+    char data[MAX_CHUNK_SIZE];
 };
 
+// what actually goes out for c
+inline size_t chunk_wire_size(const FileChunk& c) {
+    return offsetof(FileChunk, data) + c.size;
+}
+
+// room for a chunk with up to chunk_size bytes of data, rounded up so that
+// chunks can sit back to back
+inline size_t chunk_alloc_size(size_t chunk_size) {
+    return (offsetof(FileChunk, data) + chunk_size + 7) & ~(size_t)7;
+}
+
+// whether the len bytes received at c hold a whole chunk
+inline bool chunk_complete(const FileChunk& c, size_t len) {
+    return len >= offsetof(FileChunk, data) and c.size <= MAX_CHUNK_SIZE and len >= chunk_wire_size(c);
+}
+
+inline std::shared_ptr<FileChunk> make_chunk(size_t chunk_size) {
+    char* p = new char[chunk_alloc_size(chunk_size)];
+    return std::shared_ptr<FileChunk>((FileChunk*)p, [](FileChunk* c) { delete[] (char*)c; });
+}
+
+inline std::shared_ptr<FileChunk> copy_chunk(const FileChunk& c) {
+    std::shared_ptr<FileChunk> p = make_chunk(c.size);
+    memcpy(p.get(), &c, chunk_wire_size(c));
+    return p;
+}
+
+// just the part of a FileChunk in front of data, for chunks whose data lives
+// somewhere else (a mapped file)
+struct ChunkHeader {
+    uint32_t id;
+    uint16_t size;
+};
+static_assert(offsetof(ChunkHeader, size) == offsetof(FileChunk, size) and
+              sizeof(ChunkHeader) >= offsetof(FileChunk, data), "ChunkHeader has to match FileChunk");
+
 struct ControlMessage {
     uint8_t msgtype;
     uint32_t client_id;
     uint32_t chunk_id;
-};
\ No newline at end of file
+};
+
+// REG in both directions: the client asks with everything zero, and the
+// server answers with the client's id, the number of chunks (in chunk_id, like
+// before), the chunk size and REG_ flags
+const uint32_t REG_P2P = 1;     // get chunks from peers, the server only says who has them
+
+struct Registration {
+    uint8_t msgtype;
+    uint32_t client_id;
+    uint32_t chunk_id;
+    uint32_t chunk_size;
+    uint32_t flags;
+};
+
+// Requests for many chunks in one message. REQ_RANGE asks for the `count`
+// chunks starting at chunk_id. REQ_BITMAP asks for a sparse set starting at
+// chunk_id, as a run-length compressed bitmap: `count` bytes of varints that
+// alternately say how many chunks to skip and how many to take. HAVE_RANGE
+// and HAVE_BITMAP announce chunks the same way. AVAIL uses the same layout
+// for runs of chunks that are equally available.
+const size_t BULK_RUN_BYTES = 240;
+
+struct BulkRequest {
+    uint8_t msgtype;
+    uint32_t client_id;
+    uint32_t chunk_id;
+    uint32_t count;
+    uint8_t runs[BULK_RUN_BYTES];
+};
+
+// PEERS: chunk_id can be had from the peer listening on addr:port (both in
+// network byte order, straight out of a sockaddr_in)
+struct PeerEntry {
+    uint32_t chunk_id;
+    uint32_t addr;
+    uint16_t port;
+};
+
+const size_t MAX_PEER_ENTRIES = BULK_RUN_BYTES/sizeof(PeerEntry);
+
+struct PeerList {
+    uint8_t msgtype;
+    uint32_t client_id;
+    uint32_t count;
+    PeerEntry peers[MAX_PEER_ENTRIES];
+};
+
+// Peers send each other chunk requests (REQ, REQ_RANGE, REQ_BITMAP) and
+// chunks over one UDP socket, so every datagram between them starts with one
+// of these
+const uint8_t PEER_REQUEST = 1;
+const uint8_t PEER_CHUNK = 2;
+
+// Anything that travels over the control layer. Only size() bytes of it go
+// out on the wire.
+union ControlPacket {
+    ControlMessage msg;
+    Registration reg;
+    BulkRequest bulk;
+    PeerList peers;
+
+    ControlPacket() {}
+    ControlPacket(const ControlMessage& m): msg(m) {}
+    ControlPacket(const Registration& r): reg(r) {}
+    ControlPacket(const BulkRequest& b): bulk(b) {}
+    ControlPacket(const PeerList& l): peers(l) {}
+
+    uint8_t type() const {
+        return msg.msgtype;
+    }
+
+    size_t size() const {
+        if (is_range_msg(msg.msgtype)) return offsetof(BulkRequest, runs);
+        if (is_bitmap_msg(msg.msgtype) or msg.msgtype == AVAIL) return offsetof(BulkRequest, runs) + bulk.count;
+        if (msg.msgtype == REG) return sizeof(Registration);
+        if (msg.msgtype == PEERS) return offsetof(PeerList, peers) + peers.count*sizeof(PeerEntry);
+        return sizeof(ControlMessage);
+    }
+
+    // false if the len bytes at p aren't a whole packet
+    static bool parse(const void* p, size_t len, ControlPacket& out) {
+        if (len < sizeof(ControlMessage) or len > sizeof(ControlPacket)) return false;
+        memcpy(&out, p, len);
+        bool runs = is_bitmap_msg(out.type()) or out.type() == AVAIL;
+        bool bulk = is_range_msg(out.type()) or runs;
+        if (bulk and len < offsetof(BulkRequest, runs)) return false;
+        if (out.type() == REG and len < sizeof(Registration)) return false;
+        if (runs and out.bulk.count > BULK_RUN_BYTES) return false;
+        if (out.type() == PEERS and (len < offsetof(PeerList, peers) or out.peers.count > MAX_PEER_ENTRIES)) {
+            return false;
+        }
+        return len == out.size();
+    }
+};
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <algorithm>
+#include <iostream>
+
+// Counts how often a reactor wakes up and how much of that was for nothing.
+// An event is idle if it's a write readiness event for a socket that has
+// nothing queued; a wakeup is spurious if every event in it was idle. With
+// write interest armed only while there's output, the spurious count should
+// stay near zero and CPU use should drop to ~0 once transfers are done.
+class ReactorStats {
+
+    using clock = std::chrono::steady_clock;
+
+    uint64_t _wakeups = 0;
+    uint64_t _events = 0;
+    uint64_t _idle_events = 0;
+    uint64_t _spurious_wakeups = 0;
+
+    size_t _wakeup_events = 0;
+    size_t _wakeup_idle_events = 0;
+
+    clock::time_point _start;
+    clock::time_point _woke_at;
+    clock::duration _blocked{0};
+    clock::duration _spurious_time{0};
+
+    double _cpu_at_start = 0;
+
+    // CPU time of the calling thread where we can get it (linux), else of
+    // the whole process
+    static double cpu_seconds() {
+        struct rusage ru;
+#ifdef RUSAGE_THREAD
+        getrusage(RUSAGE_THREAD, &ru);
+#else
+        getrusage(RUSAGE_SELF, &ru);
+#endif
+        return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+               (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec)/1e6;
+    }
+
+public:
+
+    // call from the reactor thread when its loop starts
+    void start() {
+        _start = clock::now();
+        _cpu_at_start = cpu_seconds();
+    }
+
+    void begin_wait() {
+        _woke_at = clock::now();
+    }
+
+    // call right after get_events() returns
+    void woke_up(size_t n_events) {
+        auto now = clock::now();
+        _blocked += now-_woke_at;
+        _woke_at = now;
+
+        _wakeups++;
+        _events += n_events;
+        _wakeup_events = n_events;
+        _wakeup_idle_events = 0;
+    }
+
+    void idle_event() {
+        _idle_events++;
+        _wakeup_idle_events++;
+    }
+
+    // call once everything from this wakeup has been dispatched
+    void dispatched() {
+        if (_wakeup_events > 0 and _wakeup_idle_events == _wakeup_events) {
+            _spurious_wakeups++;
+            _spurious_time += clock::now()-_woke_at;
+        }
+    }
+
+    uint64_t wakeups() {
+        return _wakeups;
+    }
+
+    uint64_t spurious_wakeups() {
+        return _spurious_wakeups;
+    }
+
+    void print(std::ostream& out, const std::string& label) {
+        double wall = std::chrono::duration<double>(clock::now()-_start).count();
+        double cpu = cpu_seconds()-_cpu_at_start;
+        double blocked = std::chrono::duration<double>(_blocked).count();
+        double spurious = std::chrono::duration<double>(_spurious_time).count();
+
+        out << label << ": " << _wakeups << " wakeups, " << _events << " events ("
+            << _idle_events << " idle), " << _spurious_wakeups << " spurious wakeups ("
+            << (_wakeups ? 100.0*_spurious_wakeups/_wakeups : 0.0) << "%)" << std::endl;
+        out << label << ": " << cpu << " s CPU over " << wall << " s wall ("
+            << (wall > 0 ? 100.0*cpu/wall : 0.0) << "% busy), " << blocked << " s blocked in get_events, "
+            << spurious << " s on spurious wakeups" << std::endl;
+    }
+};
+
+// How long things sat in a queue before they went out, in power of two
+// buckets of microseconds, which is plenty for percentiles.
+class DelayHistogram {
+
+    static const size_t BUCKETS = 40;
+
+    // _buckets[k] = how many waited less than 2^k us (and at least 2^(k-1))
+    uint64_t _buckets[BUCKETS] = {0};
+    uint64_t _count = 0;
+    uint64_t _sum_us = 0;
+    uint64_t _max_us = 0;
+
+public:
+
+    void add(std::chrono::steady_clock::duration d) {
+        int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        if (us < 0) us = 0;
+        size_t k = 0;
+        while (k+1 < BUCKETS and ((uint64_t)1 << k) <= (uint64_t)us) k++;
+        _buckets[k]++;
+        _count++;
+        _sum_us += us;
+        if ((uint64_t)us > _max_us) _max_us = us;
+    }
+
+    void merge(const DelayHistogram& h) {
+        for (size_t k=0; k<BUCKETS; k++) _buckets[k] += h._buckets[k];
+        _count += h._count;
+        _sum_us += h._sum_us;
+        if (h._max_us > _max_us) _max_us = h._max_us;
+    }
+
+    uint64_t count() const {
+        return _count;
+    }
+
+    // an upper bound on the p'th percentile (0 < p <= 1), in us
+    uint64_t percentile_us(double p) const {
+        uint64_t seen = 0;
+        for (size_t k=0; k<BUCKETS; k++) {
+            seen += _buckets[k];
+            if (seen >= p*_count) return std::min<uint64_t>((uint64_t)1 << k, _max_us);
+        }
+        return _max_us;
+    }
+
+    void print(std::ostream& out, const std::string& label) const {
+        if (_count == 0) return;
+        out << label << ": " << _count << " sent, queued for " << _sum_us/_count << " us on average, p50 <= "
+            << percentile_us(0.5) << " us, p99 <= " << percentile_us(0.99) << " us, max " << _max_us << " us"
+            << std::endl;
+    }
+};
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+// How many chunk requests a client keeps outstanding, sized the way TCP
+// sizes its congestion window: twice as many every round to begin with
+// (slow start), then one more per round (additive increase), and half as
+// many (multiplicative decrease) when requests time out or a round brings
+// back mostly chunks we already had, which is what asking for too much at
+// once looks like from here (asks dropped by a full server or client, and
+// the re-requests racing the originals).
+//
+// A round is a window's worth of requests settling one way or another. The
+// window is halved at most once per round: whatever was in flight when
+// things went wrong tends to time out together, and that's one loss.
+class RequestWindow {
+
+public:
+
+    static const size_t DEFAULT_INITIAL = 100;
+    static const size_t DEFAULT_MIN = 4;
+    static const size_t DEFAULT_MAX = 4096;
+
+    // a round with more than 1/DUPLICATE_SHARE duplicates counts as a loss
+    static const uint64_t DUPLICATE_SHARE = 4;
+
+    // what happened since the last take_sample()
+    struct Sample {
+        uint64_t delivered = 0;
+        uint64_t timed_out = 0;
+        uint64_t duplicates = 0;
+    };
+
+private:
+
+    double _window;
+    double _threshold;      // slow start below this
+    size_t _min;
+    size_t _max;
+
+    uint64_t _round_settled = 0;
+    uint64_t _round_duplicates = 0;
+
+    // settled since the window was last halved, and how many have to before
+    // it can be again
+    uint64_t _since_decrease = 0;
+    uint64_t _decrease_after = 0;
+
+    uint64_t _decreases = 0;
+    size_t _high_water;
+
+    Sample _sample;
+
+    void decrease() {
+        if (_since_decrease < _decrease_after) return;
+        _window = std::max(_window/2, (double)_min);
+        _threshold = _window;
+        _since_decrease = 0;
+        _decrease_after = size();
+        _round_settled = 0;
+        _round_duplicates = 0;
+        _decreases++;
+    }
+
+    void settled(uint64_t n) {
+        _since_decrease += n;
+        _round_settled += n;
+        if (_round_settled < size()) return;
+
+        bool duplicate_heavy = _round_duplicates*DUPLICATE_SHARE > _round_settled;
+        _round_settled = 0;
+        _round_duplicates = 0;
+        if (duplicate_heavy) decrease();
+    }
+
+public:
+
+    explicit RequestWindow(size_t initial = DEFAULT_INITIAL, size_t min = DEFAULT_MIN,
+                           size_t max = DEFAULT_MAX):
+        _window(initial), _threshold(max), _min(min), _max(max), _high_water(initial) {}
+
+    // keeps the window within [min, max]; a max below min wins, so a small
+    // max is a fixed window rather than being raised to min
+    void set_limits(size_t min, size_t max) {
+        _max = std::max<size_t>(max, 1);
+        _min = std::min(std::max<size_t>(min, 1), _max);
+        _threshold = std::min(_threshold, (double)_max);
+        _window = std::min(std::max(_window, (double)_min), (double)_max);
+    }
+
+    size_t size() const {
+        return (size_t)_window;
+    }
+
+    bool slow_start() const {
+        return _window < _threshold;
+    }
+
+    // a chunk we were waiting for came in
+    void delivered() {
+        _sample.delivered++;
+        _window += slow_start() ? 1 : 1/_window;
+        _window = std::min(_window, (double)_max);
+        _high_water = std::max(_high_water, size());
+        settled(1);
+    }
+
+    // a chunk we already had came in
+    void duplicate() {
+        _sample.duplicates++;
+        _round_duplicates++;
+        settled(1);
+    }
+
+    // n requests were given up on, to be asked for again
+    void timed_out(uint64_t n) {
+        if (n == 0) return;
+        _sample.timed_out += n;
+        settled(n);
+        decrease();
+    }
+
+    Sample take_sample() {
+        Sample s = _sample;
+        _sample = Sample();
+        return s;
+    }
+
+    uint64_t decreases() const {
+        return _decreases;
+    }
+
+    size_t high_water() const {
+        return _high_water;
+    }
+};
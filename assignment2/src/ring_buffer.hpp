@@ -0,0 +1,235 @@
+#pragma once
+
+#include <new>
+#include <atomic>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <type_traits>
+
+// Bounded ring buffers for handing things from one thread to another
+// without a lock: SpscRing for one producer and one consumer, MpscRing for
+// any number of producers and one consumer. Capacities are rounded up to a
+// power of two.
+//
+// The slots are allocated cache line aligned, and what the producers write
+// (the tail) and what the consumer writes (the head) are kept CACHE_LINE
+// bytes apart, so the two sides don't keep taking the same line away from
+// each other. (alignas would say that more directly, but these live inside
+// objects that are new'ed, which doesn't honour it before C++17.)
+
+namespace ring_detail {
+
+enum : size_t { CACHE_LINE = 64 };
+
+inline size_t round_up_pow2(size_t n) {
+    size_t c = 2;
+    while (c < n) c <<= 1;
+    return c;
+}
+
+inline void* alloc_lines(size_t bytes) {
+    void* p = nullptr;
+    if (posix_memalign(&p, CACHE_LINE, bytes > 0 ? bytes : CACHE_LINE) != 0) throw std::bad_alloc();
+    return p;
+}
+
+}
+
+// One producer thread calls try_push, one consumer thread everything else.
+// The consumer can look past the front (operator[]), e.g. to batch up what
+// it takes off. The ring never grows: try_push fails while it's full.
+template<typename T>
+class SpscRing {
+
+    using Slot = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+
+    Slot* _slots;
+    size_t _mask;
+
+    char _pad0[ring_detail::CACHE_LINE];
+
+    // producer's side; _head_seen is the last head it read
+    std::atomic<size_t> _tail{0};
+    size_t _head_seen = 0;
+
+    char _pad1[ring_detail::CACHE_LINE];
+
+    // consumer's side
+    std::atomic<size_t> _head{0};
+    size_t _tail_seen = 0;
+
+    char _pad2[ring_detail::CACHE_LINE];
+
+    T* slot(size_t i) const {
+        return reinterpret_cast<T*>(&_slots[i & _mask]);
+    }
+
+public:
+
+    explicit SpscRing(size_t capacity = 16) {
+        size_t n = ring_detail::round_up_pow2(capacity);
+        _slots = (Slot*)ring_detail::alloc_lines(n*sizeof(Slot));
+        _mask = n-1;
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    ~SpscRing() {
+        pop_front(size());
+        free(_slots);
+    }
+
+    size_t capacity() const {
+        return _mask+1;
+    }
+
+    // producer
+    bool try_push(T v) {
+        size_t t = _tail.load(std::memory_order_relaxed);
+        if (t - _head_seen > _mask) {
+            _head_seen = _head.load(std::memory_order_acquire);
+            if (t - _head_seen > _mask) return false;
+        }
+        new (slot(t)) T(std::move(v));
+        _tail.store(t+1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer (size() is exact there; anywhere else it's a snapshot)
+    size_t size() {
+        size_t h = _head.load(std::memory_order_relaxed);
+        _tail_seen = _tail.load(std::memory_order_acquire);
+        return _tail_seen - h;
+    }
+
+    bool empty() {
+        size_t h = _head.load(std::memory_order_relaxed);
+        if (_tail_seen != h) return false;
+        return size() == 0;
+    }
+
+    // the i'th from the front, i < size()
+    T& operator[](size_t i) {
+        return *slot(_head.load(std::memory_order_relaxed) + i);
+    }
+
+    T& front() {
+        return (*this)[0];
+    }
+
+    // drops the n at the front, n <= size()
+    void pop_front(size_t n = 1) {
+        size_t h = _head.load(std::memory_order_relaxed);
+        for (size_t i=0; i<n; i++) {
+            slot(h+i)->~T();
+        }
+        _head.store(h+n, std::memory_order_release);
+    }
+
+    bool try_pop(T& out) {
+        if (empty()) return false;
+        out = std::move(front());
+        pop_front();
+        return true;
+    }
+};
+
+// Any number of producer threads call try_push, one consumer thread
+// try_pop. Every slot has a sequence number that says whose turn it is
+// (Vyukov's bounded queue): producers claim a slot by moving the tail on,
+// fill it in and then hand it to the consumer by bumping its sequence, so a
+// producer that's slow to fill its slot holds up everything after it, but
+// nobody ever waits on a lock.
+template<typename T>
+class MpscRing {
+
+    struct Slot {
+        std::atomic<size_t> seq;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type value;
+
+        T* get() {
+            return reinterpret_cast<T*>(&value);
+        }
+    };
+
+    Slot* _slots;
+    size_t _mask;
+
+    char _pad0[ring_detail::CACHE_LINE];
+
+    std::atomic<size_t> _tail{0};
+
+    char _pad1[ring_detail::CACHE_LINE];
+
+    size_t _head = 0;
+
+    char _pad2[ring_detail::CACHE_LINE];
+
+public:
+
+    explicit MpscRing(size_t capacity = 1024) {
+        size_t n = ring_detail::round_up_pow2(capacity);
+        _slots = (Slot*)ring_detail::alloc_lines(n*sizeof(Slot));
+        for (size_t i=0; i<n; i++) {
+            new (&_slots[i].seq) std::atomic<size_t>(i);
+        }
+        _mask = n-1;
+    }
+
+    MpscRing(const MpscRing&) = delete;
+    MpscRing& operator=(const MpscRing&) = delete;
+
+    ~MpscRing() {
+        for (; _slots[_head & _mask].seq.load(std::memory_order_relaxed) == _head+1; _head++) {
+            _slots[_head & _mask].get()->~T();
+        }
+        free(_slots);
+    }
+
+    size_t capacity() const {
+        return _mask+1;
+    }
+
+    // any thread; v is left alone if the ring is full
+    bool try_push(T&& v) {
+        size_t t = _tail.load(std::memory_order_relaxed);
+        Slot* s;
+        for (;;) {
+            s = &_slots[t & _mask];
+            size_t seq = s->seq.load(std::memory_order_acquire);
+            intptr_t d = (intptr_t)seq - (intptr_t)t;
+            if (d == 0) {
+                if (_tail.compare_exchange_weak(t, t+1, std::memory_order_relaxed)) break;
+            }
+            else if (d < 0) {
+                return false;   // the consumer hasn't got to this one yet
+            }
+            else {
+                t = _tail.load(std::memory_order_relaxed);
+            }
+        }
+        new (s->get()) T(std::move(v));
+        s->seq.store(t+1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer. False if there's nothing, or the next one isn't filled in yet.
+    bool try_pop(T& out) {
+        Slot& s = _slots[_head & _mask];
+        if (s.seq.load(std::memory_order_acquire) != _head+1) return false;
+        out = std::move(*s.get());
+        s.get()->~T();
+        s.seq.store(_head + _mask + 1, std::memory_order_release);
+        _head++;
+        return true;
+    }
+
+    // consumer. True if no slot was claimed past what was popped, filled in
+    // or not.
+    bool empty() const {
+        return _tail.load(std::memory_order_acquire) == _head;
+    }
+};
@@ -1,4 +1,4 @@
-#include "server.hpp"
+#include "sharded_server.hpp"
 #include <csignal>
 #include <iostream>
 #include <string>
@@ -14,10 +14,25 @@ void terminate(int signal) {
 // args:
 // 1. Server port
 // 2. Min no. clients
-// 3. LRU cache size (in kB)
+// 3. LRU cache size (in kB of chunk data)
+// 4. -u: use the io_uring engine instead of epoll/kqueue (linux only)
+// 5. -b: max datagrams per sendmmsg
+// 6. -t: number of reactor threads (shards)
+// 7. -s: chunk size in bytes (sent to the clients when they register)
+// 8. -m: mmap the file and send chunks straight from the mapping instead of
+//        reading it all into memory first
+// 9. -e: cache eviction policy (lru, clock, arc, s3fifo or tinylfu)
+// 10. -d: max number of chunks to prefetch ahead of a client that requests
+//         them in order (0 turns prefetching off)
+// 11. -P: P2P mode, clients get chunks from each other and the server only
+//         tells them who has which (it still hands out the file at first)
+// 12. -q: how much may wait to go out to one client (in kB) before the server
+//         holds off queueing more for it (0 for no limit)
+// 13. -T: which layer carries control messages: tcp (chunks go over UDP) or
+//         udp (chunks go over TCP, the default). The clients have to match.
 
 void print_usage() {
-    std::cout << "usage: server_(tcp|udp) [-n num_clients] [-c cache_size] [-p port] file_to_share" << std::endl;
+    std::cout << "usage: server [-T tcp|udp] [-n num_clients] [-c cache_size] [-p port] [-u] [-b udp_batch_size] [-t threads] [-s chunk_size] [-m] [-e lru|clock|arc|s3fifo|tinylfu] [-d prefetch_depth] [-P] [-q max_queued_kb] file_to_share" << std::endl;
 }
 
 int main(int argc, char** argv) {
@@ -29,14 +44,46 @@ int main(int argc, char** argv) {
     int n_clients = 5;
     int cache_size = 100;
     int port = 15000;
+    bool use_io_uring = false;
+    int udp_batch_size = 32;
+    int n_threads = 1;
+    int chunk_size = DEFAULT_CHUNK_SIZE;
+    bool use_mmap = false;
+    CachePolicy cache_policy = CachePolicy::LRU;
+    int prefetch_depth = PrefetchStream::DEFAULT_MAX_DEPTH;
+    bool p2p = false;
+    int max_queued_kb = ServerShared::DEFAULT_MAX_PENDING/1024;
+    Transport transport = Transport::UDP_CONTROL;
 
     char opt;
-    while ((opt = getopt(argc, argv, "n:p:c:")) != -1) {
-        std::cout << "Got opt " << opt << " with arg " << std::string(optarg) << std::endl;
+    while ((opt = getopt(argc, argv, "n:p:c:ub:t:s:me:d:Pq:T:")) != -1) {
+        std::cout << "Got opt " << opt << (optarg ? " with arg " + std::string(optarg) : "") << std::endl;
         switch (opt) {
             case 'n': n_clients = std::stoi(std::string(optarg)); break;
             case 'p': port = std::stoi(std::string(optarg)); break;
             case 'c': cache_size = std::stoi(std::string(optarg)); break;
+            case 'u': use_io_uring = true; break;
+            case 'b': udp_batch_size = std::stoi(std::string(optarg)); break;
+            case 't': n_threads = std::stoi(std::string(optarg)); break;
+            case 's': chunk_size = std::stoi(std::string(optarg)); break;
+            case 'm': use_mmap = true; break;
+            case 'd': prefetch_depth = std::stoi(std::string(optarg)); break;
+            case 'P': p2p = true; break;
+            case 'q': max_queued_kb = std::stoi(std::string(optarg)); break;
+            case 'T':
+                if (!parse_transport(std::string(optarg), transport)) {
+                    std::cout << "server: unknown transport " << optarg << std::endl;
+                    print_usage();
+                    return 0;
+                }
+                break;
+            case 'e':
+                if (!parse_cache_policy(std::string(optarg), cache_policy)) {
+                    std::cout << "server: unknown cache policy " << optarg << std::endl;
+                    print_usage();
+                    return 0;
+                }
+                break;
             default:
                 print_usage();
                 return 0;
@@ -49,9 +96,17 @@ int main(int argc, char** argv) {
         return 0;
     }
 
-    Server srv(port, n_clients, cache_size);
-    srv.load_file(std::string(argv[argc-1]));
-    srv.run(running);
+    with_transport(transport, [&](auto tp) {
+        std::cout << "Using " << tp.description() << std::endl;
+        ShardedServer<decltype(tp)> srv(port, n_clients, (size_t)cache_size*1024, n_threads, use_io_uring);
+        srv.set_udp_batch_size(udp_batch_size);
+        srv.set_cache_policy(cache_policy);
+        srv.set_prefetch_depth(prefetch_depth < 0 ? 0 : prefetch_depth);
+        srv.set_p2p(p2p);
+        srv.set_max_pending(max_queued_kb < 0 ? 0 : (size_t)max_queued_kb*1024);
+        srv.load_file(std::string(argv[argc-1]), chunk_size, use_mmap);
+        srv.run(running);
+    });
 
     return 0;
 }
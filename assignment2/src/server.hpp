@@ -10,63 +10,368 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <list>
+#include <deque>
+#include <queue>
 #include <fcntl.h>
+#include <unistd.h>
 #include <fstream>
 #include <functional>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <mutex>
 
 #include "event_queue.hpp"
 #include "client_connection.hpp"
 #include "protocol.hpp"
-#include "lru_cache.hpp"
+#include "concurrent_chunk_cache.hpp"
+#include "udp_batch.hpp"
+#include "reactor_stats.hpp"
+#include "egress_scheduler.hpp"
+#include "shard_mailbox.hpp"
+#include "chunk_requests.hpp"
+#include "mapped_file.hpp"
+#include "prefetch.hpp"
+#include "wait_table.hpp"
+#include "holder_index.hpp"
+#include "in_flight.hpp"
+#include "transport.hpp"
+
+// What all the shards of a server share. It's either fixed before the shards
+// start (shards, tot_chunks, chunk_size, the file, distribution, p2p), atomic,
+// or behind registry_lock, which is only taken when a client connects,
+// disconnects or re-registers, and in P2P mode to look up peers.
+struct ServerShared {
+
+    // every shard's mailbox, which is all the shards need of each other
+    std::vector<ShardMailbox*> shards;
+
+    // P2P mode: clients get chunks from each other, the server only tells
+    // them who has what (PEERS). Only the initial distribution, and chunks
+    // no other client has, go through the server.
+    bool p2p = false;
+
+    uint32_t tot_chunks = 0;
+    uint32_t chunk_size = DEFAULT_CHUNK_SIZE;
+
+    // every chunk the server holds on to, read from the file or come back
+    // from a client, lives in here (declared first: it has to outlast them)
+    std::unique_ptr<ChunkPool> chunk_pool;
+
+    // The file itself: either the file is mapped and chunks are sent
+    // straight out of the mapping, in which case only their headers are
+    // kept, or every chunk was read into memory (chunks), and each one is let
+    // go of as soon as it's queued for the client it's distributed to (see
+    // take_file_chunk). After that the server only has what's in its cache,
+    // and goes back to the file (file_fd, or the mapping) for chunks that no
+    // client turns out to have (see load_chunk).
+    std::vector<ChunkHandle> chunks;
+    int file_fd = -1;
+    MappedFile mapped;
+    std::vector<ChunkHeader> mapped_headers;
+
+    // distribution[i] = the range of chunks client i gets when it connects.
+    // Only the first min_clients clients get any.
+    struct Share {
+        uint32_t first;
+        uint32_t count;
+    };
+    std::vector<Share> distribution;
+
+    // availability[id] = how many clients have chunk id (see AVAIL), up to
+    // MAX_AVAILABILITY. Written only by the chunk's owner, read by any shard.
+    std::unique_ptr<std::atomic<uint8_t>[]> availability;
+
+    // chunks that came back from clients, up to a budget of chunk bytes.
+    // Any shard looks requests up in it; chunks are only inserted by their
+    // owner, which also keeps the waiting lists.
+    std::unique_ptr<ConcurrentChunkCache<uint32_t,ChunkHandle>> chunk_cache;
+
+    // readahead (see prefetch.hpp) goes at most prefetch_depth chunks ahead
+    // of a client, 0 turns it off. ask_latency_us is how long it takes for a
+    // chunk to come back after asking the clients for it, a moving average
+    // over all the owners (readahead and the in-flight deadlines go by it).
+    uint32_t prefetch_depth = PrefetchStream::DEFAULT_MAX_DEPTH;
+    std::atomic<uint32_t> ask_latency_us{0};
+
+    std::atomic<uint32_t> next_client_id{0};
+    std::atomic<uint32_t> chunks_distributed{0};
+    std::atomic<bool> distributed_all_chunks{false};
 
-using namespace std::placeholders;
+    // we look this up if our registration packet drops.
+    // yes, this is overengineered af.
+    std::mutex registry_lock;
+    std::unordered_map<uint64_t,uint32_t> client_id_contingency_lookup;
+    std::unordered_map<uint32_t,uint64_t> client_id_contingency_reverse_lookup;
+
+    // where every client's peers can reach it (PEER), in P2P mode
+    std::unordered_map<uint32_t,struct sockaddr_in> peer_addrs;
+
+    // bytes queued for clients by every shard, added up as they shut down
+    std::atomic<uint64_t> egress_bytes{0};
+
+    // A connection with max_pending bytes waiting to go out (0 for no limit)
+    // is congested (see ClientConnection::congested): its owner stops
+    // queueing chunks for it, and no shard asks it for chunks or prefetches
+    // for it while the flag is set. Only the first CONGESTION_SLOTS client
+    // ids have one, the rest are never considered congested.
+    static const size_t DEFAULT_MAX_PENDING = 4*1024*1024;
+    static const uint32_t CONGESTION_SLOTS = 1 << 16;
+    size_t max_pending = DEFAULT_MAX_PENDING;
+    std::unique_ptr<std::atomic<bool>[]> congestion{new std::atomic<bool>[CONGESTION_SLOTS]()};
+
+    bool congested(uint32_t client_id) const {
+        return client_id < CONGESTION_SLOTS and congestion[client_id].load(std::memory_order_relaxed);
+    }
+
+    void set_congested(uint32_t client_id, bool on) {
+        if (client_id < CONGESTION_SLOTS) congestion[client_id].store(on, std::memory_order_relaxed);
+    }
+
+    Registration registration(uint32_t client_id) const {
+        return Registration{ REG, client_id, tot_chunks, chunk_size, p2p ? REG_P2P : 0 };
+    }
+
+    ~ServerShared() {
+        if (file_fd != -1) close(file_fd);
+    }
 
+    // a new copy of chunk id, read from the file; nullptr if it can't be
+    ChunkHandle load_chunk(uint32_t id) {
+        ChunkHandle c = chunk_pool->acquire();
+        size_t offset = (size_t)id*chunk_size;
+        c->id = id;
+        if (mapped.is_open()) {
+            c->size = mapped_headers[id].size;
+            memcpy(c->data, mapped.data() + offset, c->size);
+            return c;
+        }
+        ssize_t n = pread(file_fd, c->data, chunk_size, offset);
+        if (n < 0) return nullptr;
+        c->size = n;
+        return c;
+    }
+
+    // chunk id of the file, for the one client it's distributed to
+    ChunkRef take_file_chunk(uint32_t id) {
+        if (mapped.is_open()) return ChunkRef(mapped_headers[id], mapped.data() + (size_t)id*chunk_size);
+        return ChunkRef(std::move(chunks[id]));
+    }
+};
+
+// One reactor of the server. Every shard has its own event queue and its own
+// TCP/UDP sockets, all bound to the same port with SO_REUSEPORT, and runs on
+// its own thread (see ShardedServer). A shard owns the clients with
+// client_id % n_shards == shard and the cache and waiting lists for chunks
+// with chunk_id % n_shards == shard; everything else is posted to the owner.
+// Transport says which layer carries control and which carries chunks (see
+// transport.hpp).
+template<typename Transport>
 class Server {
 
-    std::unordered_map<uint32_t,std::unique_ptr<ClientConnection>> _clients;
-    std::unordered_map<uintptr_t,uint32_t> _tcp_map;
+    using Connection = ClientConnection<Transport>;
 
-    // we look this up if our registration packet drops.
-    // yes, this is overengineered af.
-    std::unordered_map<uint64_t,uint32_t> _client_id_contingency_lookup;
-    std::unordered_map<uint32_t,uint64_t> _client_id_contingency_reverse_lookup;
+    ServerShared& _shared;
+    uint32_t _shard;
+
+    std::unordered_map<uint32_t,std::unique_ptr<Connection>> _clients;
+    std::unordered_map<uintptr_t,uint32_t> _tcp_map;
 
     uintptr_t _tcp_ss;
     uintptr_t _udp_ss;
 
-    uint32_t _min_clients;
-    uint32_t _next_client_id = 0;
+    ShardMailbox _mailbox;
+    std::vector<ShardMessage> _mail;
 
-    LRUCache<uint32_t,std::shared_ptr<FileChunk>> _chunk_cache;
+    // chunks we had to ask our clients for because nobody had them, and how
+    // many of those asks went to every client rather than to ones that said
+    // they have the chunk
+    uint64_t _chunks_asked = 0;
+    uint64_t _chunks_asked_everyone = 0;
     EventQueue _evt_queue;
 
-    uint32_t _tot_chunks;
-    uint32_t _clients_distributed_to = 0;
-    bool _distributed_all_chunks = false;
-    bool _requests_open = false;
+    // outgoing UDP datagrams from all the connections, sent with one sendmmsg,
+    // and incoming ones, drained with one recvmmsg
+    static const size_t DEFAULT_UDP_BATCH_SIZE = 32;
+    UdpBatch _udp_batch{DEFAULT_UDP_BATCH_SIZE};
+    UdpRecvBatch _udp_recv_batch{DEFAULT_UDP_BATCH_SIZE, udp_slot_size(DEFAULT_CHUNK_SIZE)};
+
+    // write interest is only registered while there's something to write,
+    // otherwise the (almost always writable) sockets keep the loop spinning.
+    // _udp_backlog holds the clients with UDP output queued, and decides who
+    // gets how much of every batch.
+    DrrScheduler _udp_backlog{ChunkRef::HEADER + DEFAULT_CHUNK_SIZE};
+    bool _udp_write_armed = false;
+
+    // datagrams of each client's in the batch being put together
+    std::unordered_map<uint32_t,size_t> _udp_gathered;
+
+    // frames per syscall on the TCP streams, and bytes queued for clients,
+    // collected from connections as they go away
+    std::vector<uint64_t> _tcp_send_histogram;
+    std::vector<uint64_t> _tcp_recv_histogram;
+    uint64_t _egress_bytes = 0;
+
+    // how long control messages and chunks waited in the connections' queues,
+    // likewise collected as they go away
+    DelayHistogram _control_delay;
+    DelayHistogram _chunk_delay;
+
+    // backpressure: the rest of every congested client's initial share, and
+    // the chunks it asked for while congested, which go out (or are asked
+    // for again, if they were evicted meanwhile) once it drained. Plus the
+    // highest queue depth any of our clients got to, how often one was
+    // congested, how many asks there was no room for, and how often the UDP
+    // socket had no room.
+    std::unordered_map<uint32_t,uint32_t> _distribution_next;
+    std::unordered_map<uint32_t,std::deque<uint32_t>> _deferred;
+    uint64_t _chunks_deferred = 0;
+    size_t _high_water_bytes = 0;
+    size_t _high_water_msgs = 0;
+    uint64_t _times_congested = 0;
+    uint64_t _control_dropped = 0;
+    uint64_t _udp_send_full = 0;
+
+    // clients whose connection got congested or drained while we were
+    // dispatching, see handle_congestion_changes
+    std::vector<uint32_t> _congestion_changes;
+    std::vector<uint32_t> _congestion_handling;
+
+    ReactorStats _stats;
 
-    std::unordered_map<uint32_t,std::unordered_set<uint32_t>> _chunk_requests;
-    std::unordered_map<uint32_t,std::unordered_set<uint32_t>> _client_requests;
+    bool _requests_open = false;
 
-    // initial file chunk list
-    std::queue<std::shared_ptr<FileChunk>> _chunks_to_distribute;
+    // waiting lists, who has them, and the ones we asked clients for, for
+    // the chunks this shard owns
+    WaitTable _waiters;
+    HolderIndex _holders;
+    InFlightTable _in_flight;
+
+    // A fetch for a waiting client gets ASK_TIMEOUT_FACTOR times the usual
+    // ask latency (or DEFAULT_ASK_TIMEOUT_MS before there is one) to come
+    // back, and twice that every time it has to be asked for again, within
+    // [MIN_ASK_TIMEOUT_MS, MAX_ASK_TIMEOUT_MS]. The deadlines are checked
+    // every REDISPATCH_TICK_MS, but only while something is in flight.
+    static const uint32_t ASK_TIMEOUT_FACTOR = 4;
+    static const int DEFAULT_ASK_TIMEOUT_MS = 200;
+    static const int MIN_ASK_TIMEOUT_MS = 20;
+    static const int MAX_ASK_TIMEOUT_MS = 2000;
+    static const int REDISPATCH_TICK_MS = 10;
+    uint64_t _chunks_redispatched = 0;
+
+    // A chunk nobody said they have gets asked for NO_HOLDER_ATTEMPTS times
+    // (in case the HAVE is still on its way), one that somebody has up to
+    // MAX_ASK_ATTEMPTS times; then we stop asking and read it from the file
+    // ourselves. Nobody has it when it got lost on its way to the client it
+    // was distributed to.
+    static const uint32_t NO_HOLDER_ATTEMPTS = 2;
+    static const uint32_t MAX_ASK_ATTEMPTS = 6;
+    uint64_t _chunks_from_file = 0;
+
+    // the redispatch timer's ident, which comes back in the same events as
+    // the sockets: fds are ints, so none is ever above INT_MAX, and the epoll
+    // backend only keeps the low 32 bits of an ident
+    enum : uintptr_t { TIMER_IDENT = UINT32_MAX };
+    bool _timer_armed = false;
+
+    // asks made on nobody's behalf in particular
+    enum : uint32_t { NO_CLIENT = UINT32_MAX };
+
+    // scratch space for splitting up bulk requests and for the packets that
+    // ask our clients for chunks
+    std::vector<std::vector<uint32_t>> _requests_by_shard;
+    std::vector<ControlPacket> _ask_packets;
+    std::unordered_map<uint32_t,std::vector<uint32_t>> _asks_by_holder;
+    std::vector<uint32_t> _asks_for_everyone;
+    std::vector<uint8_t> _availability;
+    std::vector<ControlPacket> _avail_packets;
+
+    // scratch space for referring clients to peers (P2P mode)
+    std::vector<uint32_t> _one_request;
+    std::vector<std::pair<uint32_t,uint32_t>> _picked;
+    std::vector<PeerEntry> _referrals;
+    std::vector<uint32_t> _unreferred;
+    std::vector<ControlPacket> _peer_packets;
+
+    // how many of the clients that have a chunk get asked for it
+    static const size_t ASK_FANOUT = 2;
+
+    // readahead for the clients whose requests come in here, and when we
+    // asked for the chunks we own that are being prefetched
+    std::unordered_map<uint32_t,PrefetchStream> _streams;
+    std::unordered_map<uint32_t,std::chrono::steady_clock::time_point> _prefetching;
+    std::vector<std::vector<uint32_t>> _prefetch_by_shard;
+    PrefetchStats _prefetch_stats;
+    uint64_t _chunks_prefetched = 0;
+
+    // a prefetch that hasn't come back by then probably went nowhere (nobody
+    // had the chunk yet), so it may be asked for again. (An enum, since
+    // milliseconds() takes it by reference, which would need an out of line
+    // definition.)
+    enum : int { PREFETCH_RETRY_MS = 500 };
+    static const size_t MAX_PREFETCHING = 4096;
+
+    // chunks queued to our clients as part of the initial distribution
     std::unordered_set<uint32_t> _chunks_being_distributed;
-    std::unordered_set<uint32_t> _chunks_distributed;
+
+#ifdef HAVE_IO_URING
+    // receive slots for the io_uring engine, _io_recv_stride bytes each.
+    // Registered with the ring once, so receives land here without the
+    // kernel pinning pages every time.
+    static const size_t IO_RECV_SLOTS = 64;
+    std::vector<uint64_t> _io_recv_slots;
+    size_t _io_recv_stride = 0;
+
+    FileChunk& io_recv_slot(size_t slot) {
+        return *(FileChunk*)((char*)_io_recv_slots.data() + slot*_io_recv_stride);
+    }
+
+    // slots the ring had no room for, queued again after the next get_events
+    std::vector<size_t> _io_recv_unqueued;
+    std::vector<size_t> _io_recv_requeueing;
+
+    void queue_recv(size_t slot) {
+        if (!_evt_queue.io_uring()->queue_recv_fixed(_udp_ss, &io_recv_slot(slot), _io_recv_stride, slot)) {
+            _io_recv_unqueued.push_back(slot);
+        }
+    }
+
+    void requeue_recvs() {
+        _io_recv_requeueing.swap(_io_recv_unqueued);
+        for (auto slot : _io_recv_requeueing) {
+            queue_recv(slot);
+        }
+        _io_recv_requeueing.clear();
+    }
+#endif
 
 
 public:
 
-    Server(uint16_t port, uint32_t min_clients, size_t chunk_cache_size):
-        _min_clients{min_clients},
-        _chunk_cache{chunk_cache_size} {
+    Server(uint16_t port, ServerShared& shared, uint32_t shard, bool use_io_uring = false):
+        _shared(shared),
+        _shard{shard},
+        _evt_queue{use_io_uring} {
 
         _tcp_ss = create_server_socket(port, SOCK_STREAM);
         _udp_ss = create_server_socket(port, SOCK_DGRAM);
 
         _evt_queue.add_event(_tcp_ss, EVFILT_READ);
         _evt_queue.add_event(_udp_ss, EVFILT_READ);
-        _evt_queue.add_event(_udp_ss, EVFILT_WRITE);
+        _evt_queue.add_event(_mailbox.fd(), EVFILT_READ);
+
+#ifdef HAVE_IO_URING
+        if (_evt_queue.io_uring() != nullptr) {
+            std::cout << "Using io_uring" << std::endl;
+        }
+#endif
+    }
 
+    // what a datagram coming in on UDP can be at most: a chunk, or a control
+    // message. One byte more for control messages, so that a longer one is
+    // still seen as junk rather than cut short to something that parses.
+    static size_t udp_slot_size(size_t chunk_size) {
+        return Transport::CONTROL_OVER_TCP ? chunk_alloc_size(chunk_size) : sizeof(ControlPacket)+1;
     }
 
     uintptr_t create_server_socket(uint16_t port, int type) {
@@ -92,6 +397,14 @@ public:
         // (but also makes TCP less reliable)
         const int reuse = 1;
         setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        // every shard binds its own sockets to the same port, and the kernel
+        // spreads incoming connections and datagrams across them
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+
+        if (type == SOCK_DGRAM) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &UDP_SOCKET_BUFFER, sizeof(UDP_SOCKET_BUFFER));
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &UDP_SOCKET_BUFFER, sizeof(UDP_SOCKET_BUFFER));
+        }
 
         // set socket to be non-blocking
         int err = bind(fd, res->ai_addr, res->ai_addrlen);
@@ -104,36 +417,50 @@ public:
         return fd;
     }
 
-    void load_file(std::string filepath) {
-        // the server will equally distribute the 1kb chunks among min_clients 
-        // (The first n clients who join the server). once min_clients connect 
-        // to the server, the server will delete the file and all transactions
-        // taking place after that will be PSP
+    void set_udp_batch_size(size_t n) {
+        _udp_batch.resize(n);
+        _udp_recv_batch.resize(n);
+    }
 
-        std::ifstream infile(filepath);
+    void post(ShardMessage m) {
+        _mailbox.post(std::move(m));
+    }
 
-        uint32_t id_ctr = 0;
+    void wake() {
+        _mailbox.wake();
+    }
 
-        while (!infile.eof()) {
-            std::shared_ptr<FileChunk> fptr(new FileChunk);
-            fptr->id = id_ctr;
-            infile.read(fptr->data, 1024);
-            fptr->size = infile.gcount();
-            _chunk_requests.emplace(id_ctr, std::unordered_set<uint32_t>());
-            id_ctr++;
+    ShardMailbox& mailbox() {
+        return _mailbox;
+    }
 
-            _chunks_to_distribute.push(fptr);
-            // std::cout << "Read chunk of " << fptr->size << " bytes from file" << std::endl;
+    uint32_t owner_of_client(uint32_t client_id) {
+        return client_id % _shared.shards.size();
+    }
+
+    uint32_t owner_of_chunk(uint32_t chunk_id) {
+        return chunk_id % _shared.shards.size();
+    }
+
+    // runs m right away if it's for us, otherwise hands it to its owner
+    void send_to_shard(uint32_t shard, ShardMessage m) {
+        if (shard == _shard) {
+            handle_mail(m);
+        }
+        else {
+            _shared.shards[shard]->post(std::move(m));
         }
-        
-        _tot_chunks = _chunks_to_distribute.size();
+    }
 
-        std::cout << "Loaded " << _tot_chunks << " from file " << filepath << std::endl;
+    void send_to_all_shards(const ShardMessage& m) {
+        for (uint32_t k=0; k<_shared.shards.size(); k++) {
+            send_to_shard(k, m);
+        }
     }
 
     void open_requests() {
         for (auto& p : _clients) {
-            p.second->send_control_msg({OPEN,0,0});
+            p.second->send_control_msg(ControlMessage{OPEN,0,0});
         }
         _requests_open = true;
         std::cout << "Informed all clients that chunks were distributed" << std::endl;
@@ -141,20 +468,20 @@ public:
 
     void sent_chunk(uint32_t client_id, uint32_t chunk_id) {
 
-        if (!_distributed_all_chunks) {
-            if (_chunks_being_distributed.find(chunk_id) != _chunks_being_distributed.end()) {
-                _chunks_being_distributed.erase(chunk_id);
-                _chunks_distributed.insert(chunk_id);
-                if (_chunks_distributed.size() == _tot_chunks) {
-                    _distributed_all_chunks = true;
+        // (waiting lists are cleared by the chunk owner as soon as the chunk
+        // is handed out, see serve_waiters)
+        if (!_shared.distributed_all_chunks) {
+            if (_chunks_being_distributed.erase(chunk_id) > 0) {
+                if (++_shared.chunks_distributed == _shared.tot_chunks) {
+                    _shared.distributed_all_chunks = true;
                     std::cout << "Distributed all chunks" << std::endl;
+                    // the other shards check this at the end of a wakeup
+                    for (auto s : _shared.shards) {
+                        if (s != &_mailbox) s->wake();
+                    }
                 }
             }
         }
-        else {
-            _chunk_requests[chunk_id].erase(client_id);
-            _client_requests[client_id].erase(chunk_id);
-        }
     }
 
     void deregister_from_queue(uint32_t tcp_fd_handle) {
@@ -163,130 +490,773 @@ public:
     }
 
     void register_to_queue(uint32_t tcp_fd_handle) {
+        // EVFILT_WRITE gets added by output_queued once there's something to send
         _evt_queue.add_event(tcp_fd_handle, EVFILT_READ);
-        _evt_queue.add_event(tcp_fd_handle, EVFILT_WRITE);
+    }
+
+    // handled once we're done dispatching, see handle_congestion_changes
+    void congestion_noted(uint32_t client_id) {
+        _congestion_changes.push_back(client_id);
+    }
+
+    void output_queued(Connection& conn) {
+        if (!conn.tcp_write_armed() and conn.wants_write_TCP()) {
+            _evt_queue.add_event(conn.get_tcp_fd(), EVFILT_WRITE);
+            conn.set_tcp_write_armed(true);
+        }
+        if (conn.wants_write_UDP()) {
+            _udp_backlog.add(conn.get_client_id(), conn.UDP_is_control());
+            if (!_udp_write_armed) {
+                _evt_queue.add_event(_udp_ss, EVFILT_WRITE);
+                _udp_write_armed = true;
+            }
+        }
+    }
+
+    void can_write_TCP(Connection& conn) {
+        conn.can_write_TCP();
+        if (!conn.wants_write_TCP()) {
+            _evt_queue.delete_event(conn.get_tcp_fd(), EVFILT_WRITE);
+            conn.set_tcp_write_armed(false);
+        }
     }
 
     void client_disconnected(uint32_t client_id) {
         // disconnect client_id from everything
         std::cout << "Disconnecting client with id " << client_id << std::endl;
-        for (auto chunk_id : _client_requests[client_id]) {
-            _chunk_requests[chunk_id].erase(client_id);
-        }
 
-        _client_id_contingency_lookup.erase(_client_id_contingency_reverse_lookup[client_id]);
-        _client_id_contingency_reverse_lookup.erase(client_id);
-        _client_requests.erase(client_id);
+        ShardMessage m;
+        m.type = ShardMessage::FORGET;
+        m.client_id = client_id;
+        send_to_all_shards(m);
+
+        {
+            std::lock_guard<std::mutex> guard(_shared.registry_lock);
+            _shared.client_id_contingency_lookup.erase(_shared.client_id_contingency_reverse_lookup[client_id]);
+            _shared.client_id_contingency_reverse_lookup.erase(client_id);
+            _shared.peer_addrs.erase(client_id);
+        }
+        _udp_backlog.remove(client_id);
+        _distribution_next.erase(client_id);
+        _deferred.erase(client_id);
+        _shared.set_congested(client_id, false);
+        _egress_bytes += _clients[client_id]->bytes_queued();
+        print_delays(*_clients[client_id]);
+        merge_histogram(_tcp_send_histogram, _clients[client_id]->tcp_writer().histogram());
+        merge_histogram(_tcp_recv_histogram, _clients[client_id]->tcp_reader().histogram());
         deregister_from_queue(_clients[client_id]->get_tcp_fd());
         _tcp_map.erase(_clients[client_id]->get_tcp_fd());
         _clients.erase(client_id);
     }
 
-    void received_chunk(std::shared_ptr<FileChunk> chunk) {
+    void forget_client(uint32_t client_id) {
+        auto s = _streams.find(client_id);
+        if (s != _streams.end()) {
+            s->second.close(_prefetch_stats);
+            _streams.erase(s);
+        }
 
-        // serve the people who needed the chunk first
-        for (auto c : _chunk_requests[chunk->id]) {
-            _clients[c]->send_chunk(chunk);
+        _waiters.forget(client_id);
+        _holders.forget(client_id, [this](uint32_t chunk_id) {
+            publish_count(chunk_id);
+        });
+    }
+
+    void received_chunk(const FileChunk& c) {
+
+        if (c.id >= _shared.tot_chunks or c.size > _shared.chunk_size) return;
+
+        if (owner_of_chunk(c.id) == _shard) {
+            // store the chunk in the LRU cache (if it doesn't already exist). The
+            // receive buffer gets reused, so this is the only place we copy it.
+            chunk_arrived(c.id);
+            ChunkHandle cached = _shared.chunk_cache->peek(c.id);
+            if (cached != nullptr) {
+                serve_waiters(cached);
+            }
+            else {
+                ChunkHandle chunk = _shared.chunk_pool->copy(c);
+                _shared.chunk_cache->insert(c.id, chunk, chunk->size);
+                serve_waiters(chunk);
+            }
+        }
+        else {
+            ShardMessage m;
+            m.type = ShardMessage::CHUNK;
+            m.chunk = _shared.chunk_pool->copy(c);
+            _shared.shards[owner_of_chunk(c.id)]->post(std::move(m));
         }
+    }
 
-        // then store the chunk in the LRU cache (if it doesn't already exist)
-        if (_chunk_cache.access(chunk->id) == nullptr) {
-            _chunk_cache.insert(chunk->id, chunk);
+    // a chunk we own came in through another shard
+    void cache_chunk(ChunkHandle c) {
+        chunk_arrived(c->id);
+        ChunkHandle cached = _shared.chunk_cache->peek(c->id);
+        if (cached != nullptr) {
+            serve_waiters(cached);
+            return;
         }
+        _shared.chunk_cache->insert(c->id, c, c->size);
+        serve_waiters(c);
+    }
+
+    // serve the people who needed it
+    void serve_waiters(const ChunkHandle& chunk) {
+        _waiters.drain(chunk->id, [this,&chunk](uint32_t client_id) {
+            deliver_chunk(client_id, chunk);
+        });
     }
 
-    void received_control_msg(ControlMessage m, struct sockaddr_in sender) {
-        if (m.msgtype == REQ) {
-            received_chunk_request(m.client_id, m.chunk_id);
+    void deliver_chunk(uint32_t client_id, const ChunkHandle& chunk) {
+        if (owner_of_client(client_id) == _shard) {
+            auto it = _clients.find(client_id);
+            if (it == _clients.end()) return;
+            if (it->second->congested()) {
+                _deferred[client_id].push_back(chunk->id);
+                _chunks_deferred++;
+            }
+            else {
+                it->second->send_chunk(chunk);
+            }
+        }
+        else {
+            ShardMessage m;
+            m.type = ShardMessage::DELIVER;
+            m.client_id = client_id;
+            m.chunk = chunk;
+            _shared.shards[owner_of_client(client_id)]->post(std::move(m));
         }
-        else if (m.msgtype == OPEN) {
-            if (_distributed_all_chunks) {
-                _clients[m.client_id]->send_control_msg({OPEN,0,0});
+    }
+
+    void received_control_msg(const ControlPacket& p, struct sockaddr_in sender) {
+        ControlMessage m = p.msg;
+        if (m.msgtype == REQ_RANGE or m.msgtype == REQ_BITMAP) {
+            received_bulk_request(p);
+        }
+        else if (m.msgtype == HAVE or m.msgtype == HAVE_RANGE or m.msgtype == HAVE_BITMAP) {
+            received_haves(p);
+        }
+        else if (m.msgtype == REQ) {
+            if (m.chunk_id >= _shared.tot_chunks) return;
+            if (_shared.p2p) {
+                // only the owner knows who has it
+                ShardMessage r;
+                r.type = ShardMessage::REQUEST;
+                r.client_id = m.client_id;
+                r.chunk_id = m.chunk_id;
+                send_to_shard(owner_of_chunk(m.chunk_id), r);
+                return;
             }
+            // hits are served right here, only misses go to the chunk's owner
+            ChunkHandle chunk = _shared.chunk_cache->access(m.chunk_id);
+            observe_request(m.client_id, m.chunk_id, chunk != nullptr);
+            if (chunk != nullptr) {
+                deliver_chunk(m.client_id, chunk);
+            }
+            else {
+                ShardMessage r;
+                r.type = ShardMessage::REQUEST;
+                r.client_id = m.client_id;
+                r.chunk_id = m.chunk_id;
+                send_to_shard(owner_of_chunk(m.chunk_id), r);
+            }
+            prefetch_ahead(m.client_id);
+        }
+        else if (m.msgtype == PEER) {
+            received_peer_addr(m.client_id, m.chunk_id, sender);
+        }
+        else if (m.msgtype == OPEN or m.msgtype == AVAIL_REQ) {
+            ShardMessage r;
+            r.type = ShardMessage::CONTROL;
+            r.msg = m;
+            send_to_shard(owner_of_client(m.client_id), r);
         }
         else if (m.msgtype == REG) {
-            if (_client_id_contingency_lookup.find(ipv4_to_int64(sender)) != 
-                    _client_id_contingency_lookup.end()) {
-                int cid = _client_id_contingency_lookup[ipv4_to_int64(sender)];
-                std::cout << "Client with id " << cid << " requested registration data again" << std::endl;
-                auto& client = _clients[cid];
-                if (client != nullptr) {
-                    client->send_control_msg({REG,client->get_client_id(),_tot_chunks});
-                }
-                else {
-                    std::cout << "FATAL: internal conflict on client id = " << cid << std::endl;
+            bool found = false;
+            {
+                std::lock_guard<std::mutex> guard(_shared.registry_lock);
+                auto it = _shared.client_id_contingency_lookup.find(ipv4_to_int64(sender));
+                if (it != _shared.client_id_contingency_lookup.end()) {
+                    m.client_id = it->second;
+                    found = true;
                 }
             }
+            if (found) {
+                std::cout << "Client with id " << m.client_id << " requested registration data again" << std::endl;
+                ShardMessage r;
+                r.type = ShardMessage::CONTROL;
+                r.msg = m;
+                send_to_shard(owner_of_client(m.client_id), r);
+            }
             else {
                 std::cout << "Received unsolicited register message" << std::endl;
             }
         }
     }
 
+    // Cache hits in a bulk request are served right away, the misses are split
+    // up by chunk owner, so that every shard gets at most one message for it
+    // rather than one per chunk. In P2P mode everything goes to the owners,
+    // who refer the client to peers.
+    void received_bulk_request(const ControlPacket& p) {
+        _requests_by_shard.resize(_shared.shards.size());
+        for (auto& ids : _requests_by_shard) ids.clear();
+
+        uint32_t client_id = p.msg.client_id;
+        for_each_requested_chunk(p, _shared.tot_chunks, [this,client_id](uint32_t chunk_id) {
+            if (_shared.p2p) {
+                _requests_by_shard[owner_of_chunk(chunk_id)].push_back(chunk_id);
+                return;
+            }
+            ChunkHandle chunk = _shared.chunk_cache->access(chunk_id);
+            observe_request(client_id, chunk_id, chunk != nullptr);
+            if (chunk != nullptr) deliver_chunk(client_id, chunk);
+            else _requests_by_shard[owner_of_chunk(chunk_id)].push_back(chunk_id);
+        });
+
+        for (uint32_t k=0; k<_requests_by_shard.size(); k++) {
+            if (_requests_by_shard[k].empty()) continue;
+            if (k == _shard) {
+                received_chunk_requests(p.msg.client_id, _requests_by_shard[k]);
+            }
+            else {
+                ShardMessage r;
+                r.type = ShardMessage::REQUESTS;
+                r.client_id = p.msg.client_id;
+                r.chunk_ids = std::move(_requests_by_shard[k]);
+                _shared.shards[k]->post(std::move(r));
+            }
+        }
+        if (!_shared.p2p) prefetch_ahead(client_id);
+    }
+
+    // client_id's peers can reach it on port (UDP), at the address its
+    // messages come from
+    void received_peer_addr(uint32_t client_id, uint32_t port, struct sockaddr_in sender) {
+        if (!_shared.p2p or port == 0 or port > UINT16_MAX) return;
+        sender.sin_port = htons((uint16_t)port);
+
+        std::lock_guard<std::mutex> guard(_shared.registry_lock);
+        // (it may have disconnected since)
+        if (_shared.client_id_contingency_reverse_lookup.count(client_id) == 0) return;
+        _shared.peer_addrs[client_id] = sender;
+    }
+
+    // the chunk owners keep track of who has what
+    void received_haves(const ControlPacket& p) {
+        _requests_by_shard.resize(_shared.shards.size());
+        for (auto& ids : _requests_by_shard) ids.clear();
+
+        for_each_requested_chunk(p, _shared.tot_chunks, [this](uint32_t chunk_id) {
+            _requests_by_shard[owner_of_chunk(chunk_id)].push_back(chunk_id);
+        });
+
+        for (uint32_t k=0; k<_requests_by_shard.size(); k++) {
+            if (_requests_by_shard[k].empty()) continue;
+            ShardMessage m;
+            m.type = ShardMessage::HAVES;
+            m.client_id = p.msg.client_id;
+            m.chunk_ids = std::move(_requests_by_shard[k]);
+            send_to_shard(k, std::move(m));
+        }
+    }
+
+    // Someone may already be waiting for one of them: the ask for it went
+    // out before client_id said it has it (or got it), so client_id gets
+    // asked right away.
+    void add_holder(uint32_t client_id, const std::vector<uint32_t>& chunk_ids) {
+        for (auto chunk_id : chunk_ids) {
+            if (!_holders.add(chunk_id, client_id)) continue;
+            publish_count(chunk_id);
+            if (!_waiters.empty(chunk_id)) _asks_by_holder[client_id].push_back(chunk_id);
+        }
+        send_asks(client_id);
+    }
+
+    void publish_count(uint32_t chunk_id) {
+        uint32_t n = std::min<uint32_t>(_holders.count(chunk_id), MAX_AVAILABILITY);
+        _shared.availability[chunk_id].store(n, std::memory_order_relaxed);
+    }
+
+    // everything we know about who has what, for a client going rarest first
+    void send_availability(Connection& conn) {
+        _availability.resize(_shared.tot_chunks);
+        for (uint32_t id=0; id<_shared.tot_chunks; id++) {
+            _availability[id] = _shared.availability[id].load(std::memory_order_relaxed);
+        }
+        _avail_packets.clear();
+        encode_availability(conn.get_client_id(), _availability, [this](const ControlPacket& p) {
+            _avail_packets.push_back(p);
+        });
+        for (const auto& p : _avail_packets) {
+            conn.send_control_msg(p);
+        }
+    }
+
+    void observe_request(uint32_t client_id, uint32_t chunk_id, bool hit) {
+        if (_shared.prefetch_depth == 0) return;
+        auto it = _streams.find(client_id);
+        if (it == _streams.end()) {
+            it = _streams.emplace(client_id, PrefetchStream(_shared.prefetch_depth)).first;
+        }
+        it->second.observe(chunk_id, hit, _shared.ask_latency_us.load(std::memory_order_relaxed),
+                           _prefetch_stats);
+    }
+
+    // if client_id's requests follow a pattern, have the owners of the chunks
+    // it wants next fetch them into the cache
+    void prefetch_ahead(uint32_t client_id) {
+        // no point fetching more for a client that can't take what it has
+        if (_shared.congested(client_id)) return;
+        auto it = _streams.find(client_id);
+        if (it == _streams.end()) return;
+
+        _prefetch_by_shard.resize(_shared.shards.size());
+        for (auto& ids : _prefetch_by_shard) ids.clear();
+
+        it->second.plan(_shared.tot_chunks, _prefetch_stats, [this](uint32_t chunk_id) {
+            if (_shared.chunk_cache->peek(chunk_id) != nullptr) return false;
+            _prefetch_by_shard[owner_of_chunk(chunk_id)].push_back(chunk_id);
+            return true;
+        });
+
+        for (uint32_t k=0; k<_prefetch_by_shard.size(); k++) {
+            if (_prefetch_by_shard[k].empty()) continue;
+            ShardMessage m;
+            m.type = ShardMessage::PREFETCH;
+            m.client_id = client_id;
+            m.chunk_ids = std::move(_prefetch_by_shard[k]);
+            send_to_shard(k, std::move(m));
+        }
+    }
+
+    // chunk_ids (which we own) will likely be wanted soon: ask the clients for
+    // the ones that aren't cached or on their way already
+    void prefetch_chunks(uint32_t client_id, const std::vector<uint32_t>& chunk_ids) {
+        auto now = std::chrono::steady_clock::now();
+
+        if (_prefetching.size() > MAX_PREFETCHING) {
+            for (auto it = _prefetching.begin(); it != _prefetching.end(); ) {
+                if (now-it->second >= std::chrono::milliseconds(PREFETCH_RETRY_MS)) it = _prefetching.erase(it);
+                else ++it;
+            }
+        }
+
+        for (auto chunk_id : chunk_ids) {
+            if (_shared.chunk_cache->peek(chunk_id) != nullptr) continue;
+            if (!_waiters.empty(chunk_id)) continue;
+            auto p = _prefetching.find(chunk_id);
+            if (p != _prefetching.end() and now-p->second < std::chrono::milliseconds(PREFETCH_RETRY_MS)) continue;
+
+            _prefetching[chunk_id] = now;
+            queue_ask(client_id, chunk_id, false);
+            _chunks_prefetched++;
+        }
+        send_asks(client_id);
+    }
+
+    // a chunk we own came back; if we asked for it (for a waiting client, or
+    // to prefetch it), that's a sample of how long asking for one takes
+    void chunk_arrived(uint32_t chunk_id) {
+        auto took = _in_flight.finish(chunk_id);
+        auto it = _prefetching.find(chunk_id);
+        if (it != _prefetching.end()) {
+            if (took == took.zero()) took = std::chrono::steady_clock::now()-it->second;
+            _prefetching.erase(it);
+        }
+        if (took == took.zero()) return;
+
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(took).count();
+        uint32_t avg = _shared.ask_latency_us.load(std::memory_order_relaxed);
+        _shared.ask_latency_us.store(avg == 0 ? us : (7*avg+us)/8, std::memory_order_relaxed);
+    }
+
+    // how long the attempt'th ask for a chunk gets to come back
+    std::chrono::milliseconds ask_timeout(uint32_t attempt) {
+        uint32_t us = _shared.ask_latency_us.load(std::memory_order_relaxed);
+        int64_t ms = us > 0 ? (int64_t)us*ASK_TIMEOUT_FACTOR/1000 : DEFAULT_ASK_TIMEOUT_MS;
+        for (uint32_t i=1; i<attempt and ms<MAX_ASK_TIMEOUT_MS; i++) ms *= 2;
+        return std::chrono::milliseconds(std::min<int64_t>(std::max<int64_t>(ms, MIN_ASK_TIMEOUT_MS),
+                                                           MAX_ASK_TIMEOUT_MS));
+    }
+
+    // asks for chunk_id (which we own) on behalf of the clients waiting for
+    // it, and has it asked for again if it isn't back in time
+    void start_fetch(uint32_t client_id, uint32_t chunk_id, bool everyone) {
+        _in_flight.start(chunk_id, ask_timeout(_in_flight.attempts(chunk_id)+1));
+        queue_ask(client_id, chunk_id, everyone);
+        if (!_timer_armed) {
+            _evt_queue.add_timer_event(TIMER_IDENT, REDISPATCH_TICK_MS);
+            _timer_armed = true;
+        }
+    }
+
+    // Fetches that ran out of time go to holders that weren't asked yet, or
+    // to everyone once there are none left, until they were asked for often
+    // enough (see MAX_ASK_ATTEMPTS). Chunks nobody waits for anymore (they
+    // all went away) are let go.
+    void redispatch_expired() {
+        _in_flight.expire(std::chrono::steady_clock::now(), [this](uint32_t chunk_id) {
+            if (_waiters.empty(chunk_id)) {
+                _in_flight.finish(chunk_id);
+                return;
+            }
+            uint32_t attempts = _in_flight.attempts(chunk_id);
+            if (attempts >= MAX_ASK_ATTEMPTS or (attempts >= NO_HOLDER_ATTEMPTS and _holders.count(chunk_id) == 0)) {
+                fetch_from_file(chunk_id);
+                return;
+            }
+            start_fetch(NO_CLIENT, chunk_id, false);
+            _chunks_redispatched++;
+        });
+        send_asks(NO_CLIENT);
+
+        if (_in_flight.empty() and _timer_armed) {
+            _evt_queue.delete_event(TIMER_IDENT, EVFILT_TIMER);
+            _timer_armed = false;
+        }
+    }
+
+    // chunk_id (which we own) didn't come back however often we asked: it
+    // goes to whoever waits for it from the file, and into the cache like
+    // any chunk that did come back. (Not as a sample of the ask latency,
+    // though, so the fetch is finished first.)
+    void fetch_from_file(uint32_t chunk_id) {
+        _in_flight.finish(chunk_id);
+        _prefetching.erase(chunk_id);
+        ChunkHandle c = _shared.load_chunk(chunk_id);
+        if (c == nullptr) {
+            std::cerr << "Could not read chunk " << chunk_id << " from the file (errno " << errno << ")" << std::endl;
+            return;
+        }
+        _chunks_from_file++;
+        cache_chunk(std::move(c));
+    }
+
+    // control messages that have to be answered by the client's owner
+    void control_for_client(ControlMessage m) {
+        auto it = _clients.find(m.client_id);
+        if (m.msgtype == OPEN) {
+            if (_shared.distributed_all_chunks and it != _clients.end()) {
+                it->second->send_control_msg(ControlMessage{OPEN,0,0});
+            }
+        }
+        else if (m.msgtype == AVAIL_REQ) {
+            if (_shared.distributed_all_chunks and it != _clients.end()) {
+                send_availability(*it->second);
+            }
+        }
+        else if (m.msgtype == REG) {
+            if (it != _clients.end()) {
+                it->second->send_control_msg(_shared.registration(m.client_id));
+            }
+            else {
+                std::cout << "FATAL: internal conflict on client id = " << m.client_id << std::endl;
+            }
+        }
+    }
+
     /*
     
     To reduce chunk request times, we need to do 2 things:
-    1. Reduce network load: request a chunk from the authoritative chunk owner only
-    2. Increase cache locality: for every client request not in cache, request the 
-       next k chunks as well
+    1. Reduce network load: ask only clients that said they have a chunk
+       (see queue_ask)
+    2. Increase cache locality: fetch the chunks a client will ask for next
+       before it does (see prefetch_ahead)
     */
 
     void received_chunk_request(uint32_t client_id, uint32_t chunk_id) {
+        if (_shared.p2p) {
+            _one_request.assign(1, chunk_id);
+            received_chunk_requests(client_id, _one_request);
+            return;
+        }
         // sdfsstd::cout << "Received request for chunk " << chunk_id << std::endl;
-        // check if chunk is in LRU cache first
-        std::shared_ptr<FileChunk> chunk = _chunk_cache.access(chunk_id);
+        // the shard that got the request already looked in the cache (and
+        // counted the miss), but the chunk may have come in since
+        ChunkHandle chunk = _shared.chunk_cache->peek(chunk_id);
         if (chunk != nullptr) {
             // std::cout << "Chunk exists in cache, sending" << std::endl;
-            _clients[client_id]->send_chunk(chunk);
+            deliver_chunk(client_id, chunk);
         }
-        else if (!_chunk_requests[chunk_id].empty()) {
+        else if (!_waiters.empty(chunk_id) and _waiters.add(chunk_id, client_id)) {
             // std::cout << "Chunk request is in the air" << std::endl;
             // chunk request in the air, will alert when it comes back
-            _chunk_requests[chunk_id].insert(client_id);
         }
         else {
-            for (int i=0; i<10; i++) {
-		int nc = _clients.size()/(1<<i);
-                if (chunk_id+i < _tot_chunks) {
-                    // std::cout << "Requesting chunk " << chunk_id+i << " From client " << _authoritative_chunk_owners[chunk_id+i] << std::endl;
-                    // The farther the chunk, the fewer the requests for it...
-		    // have a geometric progression down for the number of 
-		    // clients we request. The first one goes out to all the 
-		    // clients, the next one to half, and so on
-		    int c = 0;
-		    for (const auto& p : _clients) {
-			if (c >= nc) break;
-                    	p.second->send_control_msg({REQ,client_id,chunk_id});
-			c++;
-		    }
+            // This also happens when a client asks again for a chunk it's
+            // already waiting on: then the last ask went nowhere (with big
+            // chunks, the owner's copy can still be on its way to it when the
+            // ask arrives, or the client we asked is gone), so everyone gets
+            // asked this time.
+            bool again = !_waiters.empty(chunk_id);
+            start_fetch(client_id, chunk_id, again);
+            send_asks(client_id);
+            _chunks_asked++;
+
+            _waiters.add(chunk_id, client_id);
+        }
+    }
+
+    // the bulk version of received_chunk_request: hits and chunks already in
+    // the air are handled one by one, but all the misses go out together
+    void received_chunk_requests(uint32_t client_id, const std::vector<uint32_t>& chunk_ids) {
+        const std::vector<uint32_t>* relay = &chunk_ids;
+        if (_shared.p2p) {
+            refer_to_peers(client_id, chunk_ids);
+            relay = &_unreferred;
+        }
+        for (auto chunk_id : *relay) {
+            ChunkHandle chunk = _shared.chunk_cache->peek(chunk_id);
+            if (chunk != nullptr) {
+                deliver_chunk(client_id, chunk);
+            }
+            else if (!_waiters.empty(chunk_id) and _waiters.add(chunk_id, client_id)) {
+                // in the air
+            }
+            else {
+                // (or asked for again, see received_chunk_request)
+                start_fetch(client_id, chunk_id, !_waiters.empty(chunk_id));
+                _chunks_asked++;
+                _waiters.add(chunk_id, client_id);
+            }
+        }
+        send_asks(client_id);
+    }
+
+    // P2P: tell client_id which peers to get chunk_ids (which we own) from,
+    // one each; the next request for a chunk goes to the next one that has
+    // it. What no other client is known to have ends up in _unreferred, to
+    // be fetched by us like without P2P.
+    void refer_to_peers(uint32_t client_id, const std::vector<uint32_t>& chunk_ids) {
+        _picked.clear();
+        _unreferred.clear();
+        for (auto chunk_id : chunk_ids) {
+            size_t n = _holders.pick(chunk_id, 1, client_id, [this,chunk_id](uint32_t holder) {
+                _picked.emplace_back(chunk_id, holder);
+            });
+            if (n == 0) _unreferred.push_back(chunk_id);
+        }
+        if (_picked.empty()) return;
+
+        _referrals.clear();
+        {
+            std::lock_guard<std::mutex> guard(_shared.registry_lock);
+            for (const auto& p : _picked) {
+                auto it = _shared.peer_addrs.find(p.second);
+                if (it == _shared.peer_addrs.end()) {
+                    _unreferred.push_back(p.first);
+                    continue;
                 }
+                _referrals.push_back(PeerEntry{ p.first, it->second.sin_addr.s_addr, it->second.sin_port });
+            }
+        }
+        if (_referrals.empty()) return;
+
+        ShardMessage m;
+        m.type = ShardMessage::REFER;
+        m.client_id = client_id;
+        m.peers = _referrals;
+        send_to_shard(owner_of_client(client_id), std::move(m));
+    }
+
+    void refer_client(uint32_t client_id, const std::vector<PeerEntry>& peers) {
+        auto it = _clients.find(client_id);
+        if (it == _clients.end()) return;
+
+        _peer_packets.clear();
+        encode_peer_list(client_id, peers, [this](const ControlPacket& p) {
+            _peer_packets.push_back(p);
+        });
+        for (const auto& pkt : _peer_packets) {
+            it->second->offer_control_msg(pkt);
+        }
+    }
+
+    // Queues an ask for chunk_id (which we own) on behalf of client_id: to up
+    // to ASK_FANOUT of the clients that said they have it, or to all of them
+    // if nobody did or `everyone` is set. send_asks sends what's queued.
+    // Holders that were already asked for it, for a fetch that's in flight,
+    // are skipped, and so are congested ones (their answer would queue up
+    // behind everything they're already sending).
+    void queue_ask(uint32_t client_id, uint32_t chunk_id, bool everyone) {
+        if (!everyone) {
+            auto skip = [this,client_id,chunk_id](uint32_t holder) {
+                return holder == client_id or _in_flight.was_tried(chunk_id, holder) or _shared.congested(holder);
+            };
+            size_t n = _holders.pick_if(chunk_id, ASK_FANOUT, skip, [this,chunk_id](uint32_t holder) {
+                _asks_by_holder[holder].push_back(chunk_id);
+                _in_flight.tried(chunk_id, holder);
+            });
+            if (n > 0) return;
+        }
+        _asks_for_everyone.push_back(chunk_id);
+        _chunks_asked_everyone++;
+    }
+
+    void send_asks(uint32_t client_id) {
+        for (auto& a : _asks_by_holder) {
+            if (a.second.empty()) continue;
+            ShardMessage m;
+            m.type = ShardMessage::ASK_HOLDER;
+            m.client_id = a.first;
+            m.chunk_ids = a.second;
+            a.second.clear();
+            send_to_shard(owner_of_client(a.first), std::move(m));
+        }
+        if (!_asks_for_everyone.empty()) {
+            ShardMessage m;
+            m.type = ShardMessage::ASKS;
+            m.client_id = client_id;
+            m.chunk_ids = _asks_for_everyone;
+            _asks_for_everyone.clear();
+            send_to_all_shards(m);
+        }
+    }
+
+    // the packets asking for chunk_ids, as few as they pack into
+    void encode_asks(uint32_t client_id, std::vector<uint32_t>& chunk_ids) {
+        // (prefetches for a client going backwards come in descending)
+        std::sort(chunk_ids.begin(), chunk_ids.end());
+        chunk_ids.erase(std::unique(chunk_ids.begin(), chunk_ids.end()), chunk_ids.end());
+        _ask_packets.clear();
+        encode_chunk_requests(client_id, chunk_ids, [this](const ControlPacket& p) {
+            _ask_packets.push_back(p);
+        });
+    }
+
+    // every client we own gets asked for all of chunk_ids, except the
+    // congested ones, unless that's all of them
+    void ask_clients(uint32_t client_id, std::vector<uint32_t>& chunk_ids) {
+        if (_clients.empty()) return;
+
+        encode_asks(client_id, chunk_ids);
+        bool anyone = false;
+        for (const auto& p : _clients) {
+            anyone |= !p.second->congested();
+        }
+        for (const auto& p : _clients) {
+            if (anyone and p.second->congested()) continue;
+            for (const auto& pkt : _ask_packets) {
+                p.second->offer_control_msg(pkt);
+            }
+        }
+    }
+
+    // holder (one of ours) said it has chunk_ids
+    void ask_holder(uint32_t holder, std::vector<uint32_t>& chunk_ids) {
+        auto it = _clients.find(holder);
+        if (it == _clients.end()) return;
+
+        encode_asks(holder, chunk_ids);
+        for (const auto& pkt : _ask_packets) {
+            it->second->offer_control_msg(pkt);
+        }
+    }
+
+    void handle_mail(ShardMessage& m) {
+        switch (m.type) {
+            case ShardMessage::ADOPT:   adopt_client(m.fd, m.addr, m.client_id); break;
+            case ShardMessage::REQUEST: received_chunk_request(m.client_id, m.chunk_id); break;
+            case ShardMessage::REQUESTS:received_chunk_requests(m.client_id, m.chunk_ids); break;
+            case ShardMessage::ASKS:    ask_clients(m.client_id, m.chunk_ids); break;
+            case ShardMessage::ASK_HOLDER: ask_holder(m.client_id, m.chunk_ids); break;
+            case ShardMessage::HAVES:   add_holder(m.client_id, m.chunk_ids); break;
+            case ShardMessage::PREFETCH:prefetch_chunks(m.client_id, m.chunk_ids); break;
+            case ShardMessage::CHUNK:   cache_chunk(m.chunk); break;
+            case ShardMessage::DELIVER: deliver_chunk(m.client_id, m.chunk); break;
+            case ShardMessage::FORGET:  forget_client(m.client_id); break;
+            case ShardMessage::REFER:   refer_client(m.client_id, m.peers); break;
+            case ShardMessage::CONTROL: control_for_client(m.msg); break;
+            case ShardMessage::WAKE:    break;
+        }
+    }
+
+    void received_mail() {
+        _mailbox.drain(_mail);
+        for (auto& m : _mail) {
+            handle_mail(m);
+        }
+        _mail.clear();
+    }
+
+    // Connections only note that they got congested or drained, this is
+    // where it's dealt with: once the events are dispatched, so that what
+    // draining queues doesn't land in the middle of something going through
+    // _clients. Draining one can congest it again, or others, hence the loop.
+    void handle_congestion_changes() {
+        while (!_congestion_changes.empty()) {
+            _congestion_handling.swap(_congestion_changes);
+            for (auto client_id : _congestion_handling) {
+                auto it = _clients.find(client_id);
+                if (it == _clients.end() or !it->second->take_congestion_change()) continue;
+                congestion_changed(*it->second);
             }
+            _congestion_handling.clear();
+        }
+    }
 
-            _chunk_requests[chunk_id].insert(client_id);
-            _client_requests[client_id].insert(chunk_id);
+    void congestion_changed(Connection& conn) {
+        uint32_t client_id = conn.get_client_id();
+        _shared.set_congested(client_id, conn.congested());
+        if (conn.congested()) return;
+
+        // drained: pick up where we left off
+        continue_distribution(conn);
+
+        auto d = _deferred.find(client_id);
+        if (d == _deferred.end()) return;
+        std::deque<uint32_t>& ids = d->second;
+        while (!ids.empty() and !conn.congested()) {
+            uint32_t chunk_id = ids.front();
+            ids.pop_front();
+            ChunkHandle chunk = _shared.chunk_cache->peek(chunk_id);
+            if (chunk != nullptr) {
+                conn.send_chunk(chunk);
+                continue;
+            }
+            // evicted since, as good as a new request
+            ShardMessage r;
+            r.type = ShardMessage::REQUEST;
+            r.client_id = client_id;
+            r.chunk_id = chunk_id;
+            send_to_shard(owner_of_chunk(chunk_id), r);
         }
+        // (the entry may be gone by now: a request we posted to ourselves
+        // can find the connection congested again and defer once more)
+        d = _deferred.find(client_id);
+        if (d != _deferred.end() and d->second.empty()) _deferred.erase(d);
     }
 
-    void bind_callbacks_to_client(std::unique_ptr<ClientConnection>& conn) {
-        conn->on_recv_chunk(std::bind(&Server::received_chunk,this,_1));
-        conn->on_recv_control_msg(std::bind(&Server::received_control_msg,this,_1,_2));
-        conn->on_send_chunk(std::bind(&Server::sent_chunk,this,_1,_2));
-        conn->on_disconnect(std::bind(&Server::client_disconnected,this,_1));
+    void distribute_chunks_to_client(Connection& conn) {
+        uint32_t client_id = conn.get_client_id();
+        if (client_id >= _shared.distribution.size()) return;
+
+        // with a mapped file, have the kernel read the whole share in while
+        // the first chunks go out
+        const ServerShared::Share& share = _shared.distribution[client_id];
+        if (_shared.mapped.is_open()) {
+            _shared.mapped.will_need((size_t)share.first*_shared.chunk_size, (size_t)share.count*_shared.chunk_size);
+        }
+
+        _distribution_next[client_id] = share.first;
+        continue_distribution(conn);
     }
 
-    void distribute_chunks_to_client(std::unique_ptr<ClientConnection>& conn) {
-        int ctr = 0;
-        int n = _min_clients-_clients_distributed_to;
-        int m = _chunks_to_distribute.size();
-        int chunk_lim = m/n + (m%n>0?1:0); // number of chunks distributed can 
-                                           // vary by atmost one among clients
-        while (!_chunks_to_distribute.empty() and ctr < chunk_lim) {
-            conn->send_chunk(_chunks_to_distribute.front());
-            _chunks_being_distributed.insert(_chunks_to_distribute.front()->id);
-            _chunks_to_distribute.pop();
-            ctr++;
+    // queues the rest of the client's share, up to where the connection
+    // gets congested
+    void continue_distribution(Connection& conn) {
+        uint32_t client_id = conn.get_client_id();
+        auto it = _distribution_next.find(client_id);
+        if (it == _distribution_next.end()) return;
+
+        const ServerShared::Share& share = _shared.distribution[client_id];
+        uint32_t& id = it->second;
+        while (id < share.first+share.count and !conn.congested()) {
+            _chunks_being_distributed.insert(id);
+            conn.send_chunk(_shared.take_file_chunk(id++));
         }
-        _clients_distributed_to++;
+        if (id == share.first+share.count) _distribution_next.erase(it);
     }
 
     static uint64_t ipv4_to_int64(struct sockaddr_in s) {
@@ -299,81 +1269,286 @@ public:
 
         struct sockaddr_in addr;
         socklen_t addr_size = sizeof(addr);
-        uintptr_t new_fd = accept(_tcp_ss, (struct sockaddr*)&addr, &addr_size);
+        int new_fd = accept(_tcp_ss, (struct sockaddr*)&addr, &addr_size);
+        if (new_fd == -1) {
+            if (errno != EAGAIN and errno != EWOULDBLOCK) {
+                std::cerr << "Could not accept connection (errno " << errno << ")" << std::endl;
+            }
+            return;
+        }
+
+        uint32_t client_id = _shared.next_client_id++;
+        {
+            // the reverse lookup helps delete from the lookup in O(1) when a client 
+            // disconnects, otherwise the lookup table would not stop growing.
+            std::lock_guard<std::mutex> guard(_shared.registry_lock);
+            uint64_t intaddr = ipv4_to_int64(addr);
+            _shared.client_id_contingency_lookup[intaddr] = client_id;
+            _shared.client_id_contingency_reverse_lookup[client_id] = intaddr;
+        }
 
-        uint64_t intaddr = ipv4_to_int64(addr);
-        _client_id_contingency_lookup[intaddr] = _next_client_id;
-        // the reverse lookup helps delete from the lookup in O(1) when a client 
-        // disconnects, otherwise the lookup table would not stop growing.
-        _client_id_contingency_reverse_lookup[_next_client_id] = intaddr;
+        // the kernel picks which shard accepts, the client id picks which
+        // shard keeps it
+        ShardMessage m;
+        m.type = ShardMessage::ADOPT;
+        m.fd = new_fd;
+        m.addr = addr;
+        m.client_id = client_id;
+        send_to_shard(owner_of_client(client_id), m);
+    }
+
+    void adopt_client(int fd, struct sockaddr_in addr, uint32_t client_id) {
 
-        // for now, let fd and client id be the same
-        _tcp_map[new_fd] = _next_client_id;
-        std::unique_ptr<ClientConnection> conn(new ClientConnection(_next_client_id++, new_fd, _udp_ss, addr));
+        _tcp_map[fd] = client_id;
+        std::unique_ptr<Connection> conn(new Connection(client_id, fd, _udp_ss, addr, *this));
 
         register_to_queue(conn->get_tcp_fd());
-        _client_requests.emplace(conn->get_client_id(), std::unordered_set<uint32_t>());
-        bind_callbacks_to_client(conn);
+#ifdef HAVE_IO_URING
+        conn->use_io_uring(_evt_queue.io_uring());
+#endif
+        conn->set_max_pending(_shared.max_pending);
+        conn->set_chunk_size(_shared.chunk_size);
 
         std::cout << "Sending registration data to client" << std::endl;
-        conn->send_control_msg({ REG, conn->get_client_id(), _tot_chunks });
+        conn->send_control_msg(_shared.registration(conn->get_client_id()));
 
-        if (_distributed_all_chunks) {
+        if (_shared.distributed_all_chunks) {
             std::cout << "All chunks distributed already, letting client know" << std::endl;
-            conn->send_control_msg({ OPEN, 0, 0 });
+            conn->send_control_msg(ControlMessage{ OPEN, 0, 0 });
         }
         else {
-            distribute_chunks_to_client(conn);
+            distribute_chunks_to_client(*conn);
         }
 
         _clients.emplace(conn->get_client_id(), std::move(conn));
     }
 
-    // impl specific
+    void print_delays(Connection& conn) {
+        std::string label = "Client " + std::to_string(conn.get_client_id());
+        conn.control_delay().print(std::cout, label + " control");
+        conn.chunk_delay().print(std::cout, label + " chunks");
+        std::cout << label << " queue high water: " << conn.high_water_bytes() << " bytes, "
+                  << conn.high_water_msgs() << " messages and chunks; congested "
+                  << conn.times_congested() << " times; " << conn.control_dropped()
+                  << " asks dropped" << std::endl;
+        _control_delay.merge(conn.control_delay());
+        _chunk_delay.merge(conn.chunk_delay());
+        _high_water_bytes = std::max(_high_water_bytes, conn.high_water_bytes());
+        _high_water_msgs = std::max(_high_water_msgs, conn.high_water_msgs());
+        _times_congested += conn.times_congested();
+        _control_dropped += conn.control_dropped();
+    }
+
+    void flush_UDP() {
+#ifdef HAVE_IO_URING
+        if (_evt_queue.io_uring() != nullptr) {
+            // same rounds as below, only each datagram is handed to the ring
+            // as it's picked, until the ring is out of room (so the order
+            // they go out in is still fair, control first)
+            bool ring_full = false;
+            _udp_backlog.set_quantum(ChunkRef::HEADER + _shared.chunk_size);
+            _udp_backlog.pick(
+                [&ring_full]() { return ring_full; },
+                [this](uint32_t id) { return _clients[id]->UDP_size(0); },
+                [this, &ring_full](uint32_t id) {
+                    // not sent, so it gets its credit back for the next go
+                    size_t bytes = _clients[id]->UDP_size(0);
+                    if (!_clients[id]->submit_UDP()) {
+                        ring_full = true;
+                        _udp_backlog.refund(id, bytes);
+                    }
+                });
+        }
+        else
+#endif
+        {
+            // the scheduler goes round the connections, giving each about a
+            // chunk's worth of the batch per turn (control first), so that one
+            // client with a deep queue can't crowd out the others
+            _udp_backlog.set_quantum(ChunkRef::HEADER + _shared.chunk_size);
+            _udp_batch.clear();
+            _udp_gathered.clear();
+            _udp_backlog.pick(
+                [this]() { return _udp_batch.full(); },
+                [this](uint32_t id) { return _clients[id]->UDP_size(_udp_gathered[id]); },
+                [this](uint32_t id) { _clients[id]->gather_UDP(_udp_batch, _udp_gathered[id]++); });
+
+            int n = _udp_batch.flush(_udp_ss);
+            if (n == -1) {
+                // no room in the socket buffer: it all goes again once there is
+                if (errno == EAGAIN or errno == EWOULDBLOCK or errno == ENOBUFS) _udp_send_full++;
+                else std::cerr << "Error while writing to UDP socket (errno " << errno << ")" << std::endl;
+                n = 0;
+            }
+
+            // every connection's datagrams went in front-to-back, so whatever
+            // was sent is a prefix of its queue
+            for (int i=0; i<n; i++) {
+                uint32_t id = _udp_batch.tag(i);
+                _clients[id]->sent_UDP(1);
+                _udp_gathered[id]--;
+            }
+
+            // what didn't make it goes out with the next batch, with the
+            // credit it was picked with
+            for (auto& g : _udp_gathered) {
+                if (g.second == 0) continue;
+                Connection& conn = *_clients[g.first];
+                _udp_backlog.add(g.first, conn.UDP_is_control());
+                for (size_t i=0; i<g.second; i++) _udp_backlog.refund(g.first, conn.UDP_size(i));
+            }
+        }
+
+        if (_udp_backlog.empty()) {
+            _evt_queue.delete_event(_udp_ss, EVFILT_WRITE);
+            _udp_write_armed = false;
+        }
+    }
+
+    // transport specific, see server_tcp.cpp and server_udp.cpp
     void can_read_UDP();
 
+#ifdef HAVE_IO_URING
+    void setup_io_uring();
+
+    void io_completed(const IoCompletion& c);
+#endif
+
     void run(volatile bool& running) {
 
-        listen(_tcp_ss, 10);
+        // a backlog of 10 made a thousand clients connecting at once spend
+        // most of their time in SYN retransmits
+        listen(_tcp_ss, SOMAXCONN);
 
-        while (running) {
-            std::vector<event_t> evts = _evt_queue.get_events();
+        // the file is loaded and the shards are all there by now
+        _waiters.reserve(_shared.tot_chunks, _shared.shards.size(), _shared.distribution.size());
+        _holders.reserve(_shared.tot_chunks, _shared.shards.size(), _shard);
+        _in_flight.reserve(_shared.tot_chunks, _shared.shards.size());
 
-            if (_distributed_all_chunks and !_requests_open) {
-                open_requests();
-            }
+        // and so is the chunk size, which is all a chunk coming in can be
+        _udp_recv_batch.set_slot_size(udp_slot_size(_shared.chunk_size));
+#ifdef HAVE_IO_URING
+        if (_evt_queue.io_uring() != nullptr) {
+            setup_io_uring();
+        }
+#endif
+
+        _stats.start();
+
+        while (running) {
+            _stats.begin_wait();
+            const std::vector<event_t>& evts = _evt_queue.get_events();
+            _stats.woke_up(evts.size());
 
             for (const auto& e : evts) {
                 if (e.ident == _tcp_ss) {
                     std::cout << "Registering new client" << std::endl;
                     accept_new_client();
                 }
+                else if (e.ident == _mailbox.fd()) {
+                    received_mail();
+                }
+                else if (e.ident == TIMER_IDENT and e.filter == EVFILT_TIMER) {
+                    redispatch_expired();
+                }
                 else if (e.ident == _udp_ss) {
                     if (e.filter == EVFILT_READ) can_read_UDP();
                     else if (e.filter == EVFILT_WRITE) {
-                        for (auto& p : _clients) {
-                            p.second->can_write_UDP();
-                        }
+                        if (_udp_backlog.empty()) _stats.idle_event();
+                        flush_UDP();
                     }
                 }
                 else if (_tcp_map.find(e.ident) != _tcp_map.end()) {
-                    if (e.filter == EVFILT_READ) _clients[_tcp_map[e.ident]]->can_read_TCP();
-                    else if (e.filter == EVFILT_WRITE) _clients[_tcp_map[e.ident]]->can_write_TCP();
+                    auto& conn = _clients[_tcp_map[e.ident]];
+                    if (e.filter == EVFILT_READ) conn->can_read_TCP();
+                    else if (e.filter == EVFILT_WRITE) {
+                        if (!conn->wants_write_TCP()) _stats.idle_event();
+                        can_write_TCP(*conn);
+                    }
+                }
+            }
+
+            // checked after dispatching, since the last distributed chunk
+            // going out doesn't leave anything behind to wake us up again
+            if (_shared.distributed_all_chunks and !_requests_open) {
+                open_requests();
+            }
+
+#ifdef HAVE_IO_URING
+            if (_evt_queue.io_uring() != nullptr) {
+                for (const auto& c : _evt_queue.io_uring()->completions()) {
+                    io_completed(c);
                 }
+                requeue_recvs();
             }
+#endif
+            handle_congestion_changes();
+            _stats.dispatched();
+        }
+
+        // a signal only interrupts one of the shards, pass it on
+        for (auto s : _shared.shards) {
+            if (s != &_mailbox) s->wake();
         }
 
         shutdown_server();
     }
 
     void shutdown_server() {
+        // close_client ends up erasing from _clients, so don't iterate it directly
+        std::vector<uint32_t> client_ids;
         for (const auto& p : _clients) {
-            p.second->close_client();
+            client_ids.push_back(p.first);
+        }
+        for (auto id : client_ids) {
+            _clients[id]->close_client();
+        }
+
+        // connections handed to us that we never got around to adopting
+        _mailbox.drain(_mail);
+        for (auto& m : _mail) {
+            if (m.type == ShardMessage::ADOPT) close(m.fd);
         }
+        _mail.clear();
 
         close(_tcp_ss);
         close(_udp_ss);
 
+        std::string label = "Shard " + std::to_string(_shard);
+        _udp_batch.print_histogram(std::cout, label + " UDP send");
+        _udp_recv_batch.print_histogram(std::cout, label + " UDP receive");
+        print_batch_histogram(std::cout, label + " TCP send", "sendmsg", _tcp_send_histogram, "frames");
+        print_batch_histogram(std::cout, label + " TCP receive", "recv", _tcp_recv_histogram, "frames");
+        _stats.print(std::cout, label + " reactor");
+        std::cout << label << " asked clients for " << _chunks_asked << " chunks, and "
+                  << _chunks_prefetched << " more ahead of time; " << _chunks_asked_everyone
+                  << " of those asks went to every client, " << _chunks_redispatched
+                  << " were asked for again after timing out, and " << _chunks_from_file
+                  << " read from the file again since nobody had them" << std::endl;
+        for (auto& s : _streams) {
+            s.second.close(_prefetch_stats);
+        }
+        _prefetch_stats.print(std::cout, label + " readahead");
+        std::cout << label << " queued " << _egress_bytes << " bytes for its clients" << std::endl;
+        _control_delay.print(std::cout, label + " control");
+        _chunk_delay.print(std::cout, label + " chunks");
+        std::cout << label << " queue high water: " << _high_water_bytes << " bytes, " << _high_water_msgs
+                  << " messages and chunks; clients were congested " << _times_congested << " times, "
+                  << _chunks_deferred << " chunks waited for them to drain, " << _control_dropped
+                  << " asks were dropped for lack of room, and the UDP socket was full "
+                  << _udp_send_full << " times" << std::endl;
+        _shared.egress_bytes += _egress_bytes;
+
         _evt_queue.close();
     }
 };
+
+template<> void Server<TcpControl>::can_read_UDP();
+template<> void Server<UdpControl>::can_read_UDP();
+
+#ifdef HAVE_IO_URING
+template<> void Server<TcpControl>::setup_io_uring();
+template<> void Server<TcpControl>::io_completed(const IoCompletion& c);
+template<> void Server<UdpControl>::setup_io_uring();
+template<> void Server<UdpControl>::io_completed(const IoCompletion& c);
+#endif
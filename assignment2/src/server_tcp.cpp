@@ -3,17 +3,76 @@
 
 #include "server.hpp"
 
-void Server::can_read_UDP() {
-    std::shared_ptr<FileChunk> c(new FileChunk);
-    int nb = recvfrom(_udp_ss, c.get(), sizeof(FileChunk), 0, nullptr, 0);
+template<>
+void Server<TcpControl>::can_read_UDP() {
+    int n = _udp_recv_batch.receive(_udp_ss);
 
-    if (nb == -1) {
-        std::cerr << "Error while reading from UDP socket (errno " << errno << ")" << std::endl;
+    if (n == -1) {
+        if (errno != EAGAIN and errno != EWOULDBLOCK) {
+            std::cerr << "Error while reading from UDP socket (errno " << errno << ")" << std::endl;
+        }
+        return;
     }
-    else {
-        // handle the event where we don't read a complete filechunk in...
-        // actually, such an event won't come up due to the low-water level
-        // we've set.
+
+    for (int i=0; i<n; i++) {
+        // every datagram is exactly one chunk; anything shorter is junk
+        const FileChunk& c = *(FileChunk*)_udp_recv_batch.slot(i);
+        if (!chunk_complete(c, _udp_recv_batch.length(i))) continue;
         received_chunk(c);
     }
-}
\ No newline at end of file
+}
+#ifdef HAVE_IO_URING
+
+template<>
+void Server<TcpControl>::setup_io_uring() {
+    UringEventQueue* uring = _evt_queue.io_uring();
+
+    // chunks coming back from the owners are received straight into the
+    // registered slots, so the UDP socket doesn't need a readiness poll
+    _io_recv_stride = chunk_alloc_size(_shared.chunk_size);
+    _io_recv_slots.resize(IO_RECV_SLOTS*_io_recv_stride/sizeof(uint64_t));
+    if (!uring->register_buffer(_io_recv_slots.data(), IO_RECV_SLOTS*_io_recv_stride)) {
+        std::cerr << "Could not register receive buffers with io_uring (errno " << errno << ")" << std::endl;
+        _io_recv_slots.clear();
+        return;
+    }
+
+    _evt_queue.delete_event(_udp_ss, EVFILT_READ);
+    for (size_t i=0; i<IO_RECV_SLOTS; i++) {
+        queue_recv(i);
+    }
+}
+
+template<>
+void Server<TcpControl>::io_completed(const IoCompletion& c) {
+    if (c.is_send) {
+        uint32_t client_id = c.token >> 32;
+        uint32_t chunk_id = (uint32_t)c.token;
+        auto it = _clients.find(client_id);
+        if (it == _clients.end()) return; // disconnected while the send was in flight
+
+        if (c.res < 0) {
+            // no room in the socket buffer is counted like it is for
+            // sendmmsg; either way it goes back in the queue, same as when
+            // sendto fails
+            if (c.res == -EAGAIN or c.res == -EWOULDBLOCK or c.res == -ENOBUFS) _udp_send_full++;
+            else std::cerr << "Error while writing to UDP socket " << it->second->get_addr_str() << " (errno " << -c.res << ")" << std::endl;
+            it->second->send_chunk(c.chunk);
+        }
+        else {
+            sent_chunk(client_id, chunk_id);
+        }
+        return;
+    }
+
+    FileChunk& slot = io_recv_slot(c.token);
+    if (c.res < 0) {
+        std::cerr << "Error while reading from UDP socket (errno " << -c.res << ")" << std::endl;
+    }
+    else if (chunk_complete(slot, c.res)) {
+        received_chunk(slot);
+    }
+    queue_recv(c.token);
+}
+
+#endif
@@ -3,16 +3,37 @@
 
 #include "server.hpp"
 
-void Server::can_read_UDP() {
-    ControlMessage req_data;
-    struct sockaddr_in sender;
-    socklen_t len = sizeof(sender);
-    int nb = recvfrom(_udp_ss, &req_data, sizeof(req_data), 0, (struct sockaddr*)&sender, &len);
+template<>
+void Server<UdpControl>::can_read_UDP() {
+    int n = _udp_recv_batch.receive(_udp_ss);
 
-    if (nb == -1) {
-        std::cerr << "Error while reading from UDP socket (errno " << errno << ")" << std::endl;
+    if (n == -1) {
+        if (errno != EAGAIN and errno != EWOULDBLOCK) {
+            std::cerr << "Error while reading from UDP socket (errno " << errno << ")" << std::endl;
+        }
+        return;
     }
-    else {
-        received_control_msg(req_data, sender);
+
+    for (int i=0; i<n; i++) {
+        ControlPacket m;
+        if (!ControlPacket::parse(_udp_recv_batch.slot(i), _udp_recv_batch.length(i), m)) continue;
+        received_control_msg(m, _udp_recv_batch.sender(i));
     }
-}
\ No newline at end of file
+}
+#ifdef HAVE_IO_URING
+
+// control messages on UDP are tiny and need the sender's address, so they
+// stay on the readiness path. Outgoing ones go through the ring (see
+// ClientConnection::submit_UDP), and are fire-and-forget like with sendto.
+template<>
+void Server<UdpControl>::setup_io_uring() {}
+
+template<>
+void Server<UdpControl>::io_completed(const IoCompletion& c) {
+    if (c.is_send and c.res < 0) {
+        if (c.res == -EAGAIN or c.res == -EWOULDBLOCK or c.res == -ENOBUFS) _udp_send_full++;
+        else std::cerr << "Error while writing to UDP socket (err " << -c.res << ")" << std::endl;
+    }
+}
+
+#endif
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "protocol.hpp"
+#include "chunk_pool.hpp"
+#include "ring_buffer.hpp"
+
+// Work one server shard hands to another. Clients belong to the shard
+// client_id % n_shards, chunks (cache + waiting lists) to chunk_id % n_shards,
+// and anything that lands on the wrong shard gets posted to the right one.
+struct ShardMessage {
+
+    enum Type : uint8_t {
+        ADOPT,      // accepted a connection for a client you own: fd, addr, client_id
+        REQUEST,    // client_id wants chunk_id, which you own
+        REQUESTS,   // client_id wants all of chunk_ids, which you own
+        ASKS,       // ask all your clients for chunk_ids on behalf of client_id
+        ASK_HOLDER, // ask your client client_id for chunk_ids, it said it has them
+        HAVES,      // client_id has chunk_ids, which you own
+        PREFETCH,   // client_id will likely want chunk_ids, which you own, soon
+        CHUNK,      // a chunk you own came in
+        DELIVER,    // send chunk to client_id
+        FORGET,     // client_id is gone, drop it from your waiting lists
+        REFER,      // tell client_id where to get chunks from (peers)
+        CONTROL,    // control message for msg.client_id
+        WAKE        // nothing, just re-check the loop condition
+    };
+
+    Type type;
+    uint32_t client_id = 0;
+    uint32_t chunk_id = 0;
+    std::vector<uint32_t> chunk_ids;
+    std::vector<PeerEntry> peers;
+    int fd = -1;
+    struct sockaddr_in addr{};
+    ControlMessage msg{};
+    ChunkHandle chunk;
+};
+
+// Multi-producer inbox for one shard. Posts go into a lock-free ring (see
+// ring_buffer.hpp); only when that's full do they go to an overflow list
+// behind a lock instead, and keep going there until the owner took it, so
+// that everyone's messages still come out in the order they were posted.
+// The owner watches fd() in its event queue; a byte is written to the pipe
+// only when the inbox goes from empty to non-empty, so a burst of posts
+// costs one wakeup.
+class ShardMailbox {
+
+    enum : size_t { RING_SLOTS = 1024 };
+
+    MpscRing<ShardMessage> _ring{RING_SLOTS};
+    std::atomic<bool> _signalled{false};
+    int _pipe[2];
+
+    std::mutex _lock;
+    std::vector<ShardMessage> _overflow;
+    std::atomic<bool> _overflowed{false};
+
+public:
+
+    ShardMailbox() {
+        if (pipe(_pipe) == -1) {
+            _pipe[0] = _pipe[1] = -1;
+            return;
+        }
+        fcntl(_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(_pipe[1], F_SETFL, O_NONBLOCK);
+    }
+
+    ~ShardMailbox() {
+        close(_pipe[0]);
+        close(_pipe[1]);
+    }
+
+    uintptr_t fd() {
+        return _pipe[0];
+    }
+
+    void post(ShardMessage m) {
+        if (_overflowed.load(std::memory_order_acquire) or !_ring.try_push(std::move(m))) {
+            std::lock_guard<std::mutex> guard(_lock);
+            _overflow.push_back(std::move(m));
+            _overflowed.store(true, std::memory_order_release);
+        }
+        if (!_signalled.exchange(true, std::memory_order_acq_rel)) {
+            char b = 0;
+            ssize_t nb = write(_pipe[1], &b, 1);
+            (void)nb; // a full pipe is already readable, which is all we need
+        }
+    }
+
+    void wake() {
+        ShardMessage m;
+        m.type = ShardMessage::WAKE;
+        post(std::move(m));
+    }
+
+    // moves everything posted so far into out. The pipe is emptied and the
+    // flag cleared first, so a post that races with this either makes it
+    // into out or leaves a byte behind for the next wakeup. The overflow is
+    // only taken once the ring is empty: a slot some producer claimed but
+    // hasn't filled in yet (it's about to, and wakes us up again) may hold
+    // a message that was posted before what's in there.
+    void drain(std::vector<ShardMessage>& out) {
+        out.clear();
+        char buf[64];
+        while (read(_pipe[0], buf, sizeof(buf)) > 0);
+        _signalled.exchange(false, std::memory_order_acq_rel);
+
+        ShardMessage m;
+        while (_ring.try_pop(m)) {
+            out.push_back(std::move(m));
+        }
+
+        if (_overflowed.load(std::memory_order_acquire) and _ring.empty()) {
+            std::lock_guard<std::mutex> guard(_lock);
+            for (auto& o : _overflow) {
+                out.push_back(std::move(o));
+            }
+            _overflow.clear();
+            _overflowed.store(false, std::memory_order_release);
+        }
+    }
+};
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <thread>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cerrno>
+
+#include "server.hpp"
+
+// N server shards, each running its own reactor on its own thread. Shard 0
+// runs on the thread that calls run().
+template<typename Transport>
+class ShardedServer {
+
+    ServerShared _shared;
+    std::vector<std::unique_ptr<Server<Transport>>> _shards;
+
+    uint32_t _min_clients;
+
+public:
+
+    // all shards share one cache of chunk_cache_bytes of chunk data, which
+    // is split into as many locks as there are shards
+    ShardedServer(uint16_t port, uint32_t min_clients, size_t chunk_cache_bytes, uint32_t n_shards,
+                  bool use_io_uring = false):
+        _min_clients{min_clients} {
+
+        if (n_shards == 0) n_shards = 1;
+        _shared.chunk_cache.reset(new ConcurrentChunkCache<uint32_t,ChunkHandle>(
+            CachePolicy::LRU, chunk_cache_bytes, chunk_cache_bytes/DEFAULT_CHUNK_SIZE, n_shards));
+
+        for (uint32_t k=0; k<n_shards; k++) {
+            _shards.emplace_back(new Server<Transport>(port, _shared, k, use_io_uring));
+            _shared.shards.push_back(&_shards.back()->mailbox());
+        }
+    }
+
+    void set_udp_batch_size(size_t n) {
+        for (auto& s : _shards) {
+            s->set_udp_batch_size(n);
+        }
+    }
+
+    // how many chunks ahead of a client the server may fetch, 0 for none
+    void set_prefetch_depth(uint32_t n) {
+        _shared.prefetch_depth = n;
+    }
+
+    // P2P mode: have clients fetch chunks from each other rather than
+    // through the server (see ServerShared::p2p)
+    void set_p2p(bool on) {
+        _shared.p2p = on;
+    }
+
+    // how many bytes may wait to go out to a client before the server stops
+    // queueing more for it, 0 for no limit (see ServerShared::max_pending)
+    void set_max_pending(size_t bytes) {
+        _shared.max_pending = bytes;
+    }
+
+    // bytes queued for clients over the whole run, once run() returned
+    uint64_t egress_bytes() {
+        return _shared.egress_bytes;
+    }
+
+    // call before load_file, which sizes the cache for the chunk size
+    void set_cache_policy(CachePolicy p) {
+        auto& cache = _shared.chunk_cache;
+        cache.reset(new ConcurrentChunkCache<uint32_t,ChunkHandle>(
+            p, cache->max_bytes(), cache->max_entries(), cache->n_shards()));
+    }
+
+    // With use_mmap the file is mapped rather than read: nothing is loaded up
+    // front and chunks go out straight from the page cache, so startup
+    // doesn't depend on the file size. Falls back to reading the file if it
+    // can't be mapped.
+
+    void load_file(std::string filepath, uint32_t chunk_size = DEFAULT_CHUNK_SIZE, bool use_mmap = false) {
+        // the server will equally distribute the chunks among min_clients
+        // (The first n clients who join the server). Every chunk is let go of
+        // once it's queued for its client, and all transactions taking place
+        // after that will be PSP, with the server keeping only what's in its
+        // cache (and reading what got lost on the way from the file again)
+
+        // every client learns the chunk size when it registers
+        if (chunk_size == 0 or chunk_size > MAX_CHUNK_SIZE) {
+            std::cout << "Chunk size has to be between 1 and " << MAX_CHUNK_SIZE << " bytes, using "
+                      << DEFAULT_CHUNK_SIZE << std::endl;
+            chunk_size = DEFAULT_CHUNK_SIZE;
+        }
+        _shared.chunk_size = chunk_size;
+        _shared.chunk_pool.reset(new ChunkPool(chunk_size));
+        // the cache has a fixed number of entries, enough for its budget in
+        // chunks of this size
+        _shared.chunk_cache->reserve(_shared.chunk_cache->max_bytes()/chunk_size);
+
+        // readahead for every client has to fit in half the cache, or
+        // prefetched chunks push each other out before they're asked for
+        uint32_t fits = _shared.chunk_cache->max_entries()/(2*std::max<uint32_t>(_min_clients, 1));
+        if (_shared.prefetch_depth > fits) {
+            std::cout << "Cache only has room to prefetch " << fits << " chunks ahead of each client" << std::endl;
+            _shared.prefetch_depth = fits;
+        }
+
+        if (use_mmap and !_shared.mapped.open(filepath)) {
+            std::cerr << "Could not map " << filepath << " (errno " << errno << "), reading it instead" << std::endl;
+        }
+
+        if (_shared.mapped.is_open()) {
+            size_t size = _shared.mapped.size();
+            _shared.tot_chunks = (size+chunk_size-1)/chunk_size;
+            _shared.mapped_headers.resize(_shared.tot_chunks);
+            for (uint32_t id=0; id<_shared.tot_chunks; id++) {
+                size_t offset = (size_t)id*chunk_size;
+                _shared.mapped_headers[id] = ChunkHeader{ id, (uint16_t)std::min<size_t>(chunk_size, size-offset) };
+            }
+        }
+        else {
+            _shared.file_fd = open(filepath.c_str(), O_RDONLY);
+            if (_shared.file_fd == -1) {
+                std::cerr << "Could not open " << filepath << " (errno " << errno << ")" << std::endl;
+            }
+            std::ifstream infile(filepath);
+            uint32_t id_ctr = 0;
+
+            while (!infile.eof()) {
+                ChunkHandle fptr = _shared.chunk_pool->acquire();
+                fptr->id = id_ctr;
+                infile.read(fptr->data, chunk_size);
+                fptr->size = infile.gcount();
+                // a file that ends on a chunk boundary only hits eof on the
+                // read after the last chunk
+                if (fptr->size == 0 and id_ctr > 0) break;
+                id_ctr++;
+
+                _shared.chunks.push_back(fptr);
+                // std::cout << "Read chunk of " << fptr->size << " bytes from file" << std::endl;
+            }
+            _shared.tot_chunks = _shared.chunks.size();
+        }
+
+        _shared.availability.reset(new std::atomic<uint8_t>[_shared.tot_chunks]);
+        for (uint32_t id=0; id<_shared.tot_chunks; id++) {
+            _shared.availability[id].store(0, std::memory_order_relaxed);
+        }
+
+        // client i gets the next m/n chunks (rounded up), so the number of
+        // chunks distributed can vary by atmost one among clients
+        _shared.distribution.assign(_min_clients, {});
+        uint32_t next = 0;
+        for (uint32_t i=0; i<_min_clients; i++) {
+            uint32_t n = _min_clients-i;
+            uint32_t m = _shared.tot_chunks-next;
+            uint32_t chunk_lim = m/n + (m%n>0?1:0);
+            _shared.distribution[i] = { next, chunk_lim };
+            next += chunk_lim;
+        }
+
+        std::cout << (_shared.mapped.is_open() ? "Mapped " : "Loaded ") << _shared.tot_chunks << " chunks of "
+                  << chunk_size << " bytes from file " << filepath << std::endl;
+    }
+
+    // makes every shard re-check `running`, for when it's cleared from
+    // somewhere other than a signal handler
+    void wake() {
+        for (auto& s : _shards) {
+            s->wake();
+        }
+    }
+
+    void run(volatile bool& running) {
+        std::vector<std::thread> threads;
+        for (size_t k=1; k<_shards.size(); k++) {
+            threads.emplace_back(&Server<Transport>::run, _shards[k].get(), std::ref(running));
+        }
+
+        _shards[0]->run(running);
+
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        auto& cache = _shared.chunk_cache;
+        cache->stats().print(std::cout, std::string("Shared ") + cache->name() + " cache ("
+                             + std::to_string(cache->n_shards()) + " locks)");
+        std::cout << "Server queued " << _shared.egress_bytes << " bytes for clients"
+                  << (_shared.p2p ? " (P2P)" : "") << std::endl;
+        if (_shared.chunk_pool) _shared.chunk_pool->print(std::cout, "Chunk pool");
+    }
+};
@@ -0,0 +1,270 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#include "protocol.hpp"
+#include "chunk_pool.hpp"
+#include "udp_batch.hpp"
+
+// Framing for the TCP streams. Every message goes out as a 4 byte length (in
+// network order) followed by that many bytes of payload, so a reader never
+// has to assume that one recv returns exactly one message, and a writer can
+// put any number of messages into a single syscall.
+
+// A frame's payload is data, followed by rest if there is one, so a payload
+// doesn't have to be in one piece.
+struct Frame {
+    const void* data;
+    size_t len;
+    const void* rest = nullptr;
+    size_t rest_len = 0;
+};
+
+// a chunk on a stream only carries the part of data that's used
+inline Frame chunk_frame(const FileChunk& c) {
+    return { &c, chunk_wire_size(c) };
+}
+
+inline Frame chunk_frame(const ChunkRef& c) {
+    return { c.header, ChunkRef::HEADER, c.data, c.size };
+}
+
+// Room for one chunk with up to chunk_size bytes of data, to take a chunk
+// frame apart in. Sized for the chunk size in use rather than the biggest
+// one there is, which is what a FileChunk on the stack would be.
+class ChunkBuffer {
+
+    // uint64_t so that the chunk is aligned
+    std::vector<uint64_t> _buf;
+
+public:
+
+    explicit ChunkBuffer(size_t chunk_size) {
+        resize(chunk_size);
+    }
+
+    void resize(size_t chunk_size) {
+        std::vector<uint64_t>((chunk_alloc_size(chunk_size)+sizeof(uint64_t)-1)/sizeof(uint64_t)).swap(_buf);
+    }
+
+    FileChunk& get() {
+        return *(FileChunk*)_buf.data();
+    }
+
+    size_t room() const {
+        return _buf.size()*sizeof(uint64_t);
+    }
+};
+
+// the other way around, into buf; false if the payload can't be a chunk (of
+// the size buf is for)
+inline bool chunk_from_frame(const char* p, size_t len, ChunkBuffer& buf) {
+    if (len < offsetof(FileChunk, data) or len > buf.room()) return false;
+    memcpy(&buf.get(), p, len);
+    return chunk_complete(buf.get(), len);
+}
+
+inline bool control_from_frame(const char* p, size_t len, ControlPacket& m) {
+    return ControlPacket::parse(p, len, m);
+}
+
+// adds src into dst bucket by bucket, growing dst if needed
+inline void merge_histogram(std::vector<uint64_t>& dst, const std::vector<uint64_t>& src) {
+    if (dst.size() < src.size()) dst.resize(src.size(), 0);
+    for (size_t k=0; k<src.size(); k++) dst[k] += src[k];
+}
+
+// Per-connection receive buffer. fill() does one recv into whatever space is
+// left; for_each_frame() then hands out every complete frame and keeps the
+// trailing partial one for the next fill. The buffer starts out small and
+// grows if a frame (up to max_frame bytes) doesn't fit.
+class FrameReader {
+
+    std::vector<char> _buf;
+    size_t _start = 0;
+    size_t _end = 0;
+    size_t _max_frame;
+
+    // _histogram[k] = number of recv calls after which k frames were complete
+    // (the last bucket also counts anything bigger)
+    std::vector<uint64_t> _histogram;
+
+public:
+
+    static const size_t HEADER = sizeof(uint32_t);
+
+    explicit FrameReader(size_t capacity = 16*1024, size_t max_frame = sizeof(FileChunk),
+                         size_t histogram_size = 128):
+        _buf(capacity),
+        _max_frame{max_frame},
+        _histogram(histogram_size+1, 0) {}
+
+    // returns the number of bytes read, 0 if the peer has closed the stream,
+    // or -1 with errno set
+    ssize_t fill(int fd) {
+        // move the partial frame (if any) to the front to make room
+        if (_start > 0) {
+            memmove(_buf.data(), _buf.data()+_start, _end-_start);
+            _end -= _start;
+            _start = 0;
+        }
+
+        ssize_t nb = recv(fd, _buf.data()+_end, _buf.size()-_end, 0);
+        if (nb > 0) _end += nb;
+        return nb;
+    }
+
+    // calls f(payload, len) for every complete frame. Returns false if the
+    // stream is garbage (a frame bigger than max_frame), in which case the
+    // connection should be dropped.
+    template<typename F>
+    bool for_each_frame(F f) {
+        size_t n = 0;
+        bool ok = true;
+        while (_end-_start >= HEADER) {
+            uint32_t len;
+            memcpy(&len, _buf.data()+_start, HEADER);
+            len = ntohl(len);
+            if (len > _max_frame) {
+                ok = false;
+                break;
+            }
+            if (_end-_start < HEADER+len) {
+                if (HEADER+len > _buf.size()) _buf.resize(HEADER+len);
+                break;
+            }
+
+            f(_buf.data()+_start+HEADER, (size_t)len);
+            _start += HEADER+len;
+            n++;
+        }
+        if (_start == _end) _start = _end = 0;
+
+        if (n > 0) _histogram[std::min(n, _histogram.size()-1)]++;
+        return ok;
+    }
+
+    const std::vector<uint64_t>& histogram() {
+        return _histogram;
+    }
+
+    void print_histogram(std::ostream& out, const std::string& label) {
+        print_batch_histogram(out, label, "recv", _histogram, "frames");
+    }
+};
+
+// Per-connection write state. The caller keeps its own queue of messages;
+// write() frames as many of them as fit into one iovec array, sends them with
+// a single gathering sendmsg, and returns how many went out completely. If the
+// kernel only took part of a frame, the offset into it is remembered and the
+// next write() resumes from there, so the caller must leave the front of its
+// queue alone until it is reported as sent.
+class FrameWriter {
+
+    // up to three iovecs (header, payload, rest) per frame, and no more than
+    // IOV_MAX (1024 on linux and macOS) per sendmsg
+    static const size_t MAX_FRAMES = 512;
+    static const size_t MAX_IOVS = 1024;
+
+    std::vector<struct iovec> _iov;
+    std::vector<uint32_t> _headers;
+    std::vector<size_t> _lens;
+
+    // bytes of the front frame (header included) already written
+    size_t _offset = 0;
+
+    // _histogram[k] = number of sendmsg calls that completed k frames
+    std::vector<uint64_t> _histogram;
+
+public:
+
+    FrameWriter():
+        _iov(MAX_IOVS),
+        _headers(MAX_FRAMES),
+        _lens(MAX_FRAMES),
+        _histogram(MAX_FRAMES+1, 0) {}
+
+    // frame(i) returns the i'th queued message, for i < n_frames. Returns the
+    // number of frames that are now fully written, or -1 with errno set.
+    template<typename F>
+    ssize_t write(int fd, size_t n_frames, F frame) {
+        // (not std::min, which takes MAX_FRAMES by reference)
+        size_t max_n = n_frames < MAX_FRAMES ? n_frames : MAX_FRAMES;
+        if (max_n == 0) return 0;
+
+        size_t n = 0;
+        size_t n_iov = 0;
+        while (n < max_n and n_iov+3 <= MAX_IOVS) {
+            Frame f = frame(n);
+            _headers[n] = htonl((uint32_t)(f.len + f.rest_len));
+            _lens[n] = FrameReader::HEADER + f.len + f.rest_len;
+            _iov[n_iov].iov_base = &_headers[n];
+            _iov[n_iov++].iov_len = FrameReader::HEADER;
+            _iov[n_iov].iov_base = const_cast<void*>(f.data);
+            _iov[n_iov++].iov_len = f.len;
+            if (f.rest_len > 0) {
+                _iov[n_iov].iov_base = const_cast<void*>(f.rest);
+                _iov[n_iov++].iov_len = f.rest_len;
+            }
+            n++;
+        }
+
+        // skip whatever part of the front frame went out last time
+        size_t first = 0;
+        size_t skip = _offset;
+        while (skip > 0) {
+            if (skip >= _iov[first].iov_len) {
+                skip -= _iov[first].iov_len;
+                first++;
+            }
+            else {
+                _iov[first].iov_base = (char*)_iov[first].iov_base + skip;
+                _iov[first].iov_len -= skip;
+                skip = 0;
+            }
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &_iov[first];
+        msg.msg_iovlen = n_iov-first;
+
+        // sendmsg rather than writev only so that a peer that went away gives
+        // us EPIPE instead of SIGPIPE
+#ifdef MSG_NOSIGNAL
+        ssize_t nb = sendmsg(fd, &msg, MSG_NOSIGNAL);
+#else
+        ssize_t nb = sendmsg(fd, &msg, 0);
+#endif
+        if (nb == -1) return -1;
+
+        size_t written = _offset + nb;
+        size_t done = 0;
+        while (done < n and written >= _lens[done]) {
+            written -= _lens[done];
+            done++;
+        }
+        _offset = written;
+
+        _histogram[done]++;
+        return done;
+    }
+
+    const std::vector<uint64_t>& histogram() {
+        return _histogram;
+    }
+
+    void print_histogram(std::ostream& out, const std::string& label) {
+        print_batch_histogram(out, label, "sendmsg", _histogram, "frames");
+    }
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+
+// Which layer carries what: either control messages go over TCP and chunks
+// over UDP, or the other way round. Server, ClientConnection and Client are
+// templates on one of these two, so the choice is made once at startup (-T)
+// and everything that happens per message is resolved at compile time, with
+// no callbacks in between. What actually differs between the two is
+// specialized in the *_tcp.cpp and *_udp.cpp files (named after the layer
+// that carries control), and both are linked into every binary.
+
+struct TcpControl {
+    static const bool CONTROL_OVER_TCP = true;
+
+    static const char* name() {
+        return "tcp";
+    }
+
+    static const char* description() {
+        return "TCP control/UDP data";
+    }
+};
+
+struct UdpControl {
+    static const bool CONTROL_OVER_TCP = false;
+
+    static const char* name() {
+        return "udp";
+    }
+
+    static const char* description() {
+        return "UDP control/TCP data";
+    }
+};
+
+enum class Transport { TCP_CONTROL, UDP_CONTROL };
+
+inline bool parse_transport(const std::string& s, Transport& t) {
+    if (s == TcpControl::name()) t = Transport::TCP_CONTROL;
+    else if (s == UdpControl::name()) t = Transport::UDP_CONTROL;
+    else return false;
+    return true;
+}
+
+// calls f with the policy for t, e.g. with_transport(t, [](auto tp) {
+// Server<decltype(tp)> ... })
+template<typename F>
+auto with_transport(Transport t, F f) -> decltype(f(UdpControl())) {
+    if (t == Transport::TCP_CONTROL) return f(TcpControl());
+    return f(UdpControl());
+}
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <iostream>
+
+// Socket buffer size asked for on UDP sockets. With chunks of up to 63 kB the
+// ~200 kB default only holds a handful of datagrams, and everything after that
+// is dropped. The kernel caps this at net.core.rmem_max/wmem_max.
+const int UDP_SOCKET_BUFFER = 4*1024*1024;
+
+// histogram[k] = number of syscalls that moved k datagrams (or whatever unit is)
+inline void print_batch_histogram(std::ostream& out, const std::string& label, const char* syscall_name,
+                                  const std::vector<uint64_t>& histogram, const char* unit = "datagrams") {
+    uint64_t calls = 0, datagrams = 0;
+    for (size_t k=1; k<histogram.size(); k++) {
+        calls += histogram[k];
+        datagrams += k*histogram[k];
+    }
+    if (calls == 0) return;
+
+    out << label << ": " << datagrams << " " << unit << " in " << calls << " " << syscall_name
+        << " calls (avg " << (double)datagrams/calls << ", max " << histogram.size()-1 << ")" << std::endl;
+    out << label << " batch size histogram (size:count):";
+    for (size_t k=1; k<histogram.size(); k++) {
+        if (histogram[k] > 0) out << " " << k << ":" << histogram[k];
+    }
+    out << std::endl;
+}
+
+// Collects outgoing datagrams and sends them with a single sendmmsg. Each
+// datagram carries a tag (the server uses the client id) so that after a
+// partial send the caller can tell whose datagrams made it out.
+//
+// The buffers handed to add() are not copied, they have to stay valid until
+// flush() returns.
+class UdpBatch {
+
+    size_t _capacity;
+    size_t _n = 0;
+
+    std::vector<struct mmsghdr> _msgs;
+    std::vector<struct iovec> _iovs;  // two per datagram
+    std::vector<struct sockaddr_in> _addrs;
+    std::vector<uint32_t> _tags;
+
+    // _histogram[k] = number of flushes that sent k datagrams
+    std::vector<uint64_t> _histogram;
+
+public:
+
+    explicit UdpBatch(size_t capacity) {
+        resize(capacity);
+    }
+
+    void resize(size_t capacity) {
+        if (capacity == 0) capacity = 1;
+        _capacity = capacity;
+        _n = 0;
+        _msgs.resize(capacity);
+        _iovs.resize(2*capacity);
+        _addrs.resize(capacity);
+        _tags.resize(capacity);
+        _histogram.assign(capacity+1, 0);
+    }
+
+    size_t size() {
+        return _n;
+    }
+
+    size_t capacity() {
+        return _capacity;
+    }
+
+    bool full() {
+        return _n >= _capacity;
+    }
+
+    void clear() {
+        _n = 0;
+    }
+
+    // `to` may be null for connected sockets
+    void add(const void* buf, size_t len, const struct sockaddr_in* to, uint32_t tag) {
+        add(buf, len, nullptr, 0, to, tag);
+    }
+
+    // one datagram made of head followed by body, e.g. a chunk header and
+    // data that lives somewhere else
+    void add(const void* head, size_t head_len, const void* body, size_t body_len,
+             const struct sockaddr_in* to, uint32_t tag) {
+        struct mmsghdr& m = _msgs[_n];
+        memset(&m, 0, sizeof(m));
+        struct iovec* iov = &_iovs[2*_n];
+        iov[0].iov_base = const_cast<void*>(head);
+        iov[0].iov_len = head_len;
+        iov[1].iov_base = const_cast<void*>(body);
+        iov[1].iov_len = body_len;
+        m.msg_hdr.msg_iov = iov;
+        m.msg_hdr.msg_iovlen = body_len > 0 ? 2 : 1;
+        if (to != nullptr) {
+            _addrs[_n] = *to;
+            m.msg_hdr.msg_name = &_addrs[_n];
+            m.msg_hdr.msg_namelen = sizeof(_addrs[_n]);
+        }
+        _tags[_n] = tag;
+        _n++;
+    }
+
+    uint32_t tag(size_t i) {
+        return _tags[i];
+    }
+
+    // sends everything that was added; returns how many datagrams went out
+    // (always a prefix of the batch), or -1 with errno set if none did.
+    int flush(int fd) {
+        if (_n == 0) return 0;
+
+#ifdef __linux__
+        int sent = sendmmsg(fd, _msgs.data(), _n, 0);
+#else
+        // no sendmmsg on macOS, so at least keep the batching logic the same
+        int sent = 0;
+        while (sent < (int)_n and sendmsg(fd, &_msgs[sent].msg_hdr, 0) != -1) sent++;
+        if (sent == 0) sent = -1;
+#endif
+        if (sent > 0) _histogram[sent]++;
+        return sent;
+    }
+
+    const std::vector<uint64_t>& histogram() {
+        return _histogram;
+    }
+
+    void print_histogram(std::ostream& out, const std::string& label) {
+        print_batch_histogram(out, label, "sendmmsg", _histogram);
+    }
+};
+
+// The receive side: a preallocated ring of fixed size slots that a single
+// recvmmsg drains up to capacity() datagrams into. Slots (and sender
+// addresses) stay valid until the next receive().
+class UdpRecvBatch {
+
+    size_t _capacity;
+    size_t _slot_size;
+    size_t _n = 0;
+
+    // uint64_t so that slots are suitably aligned for the structs we read into
+    std::vector<uint64_t> _slots;
+    std::vector<struct mmsghdr> _msgs;
+    std::vector<struct iovec> _iovs;
+    std::vector<struct sockaddr_in> _addrs;
+
+    std::vector<uint64_t> _histogram;
+
+public:
+
+    UdpRecvBatch(size_t capacity, size_t slot_size):
+        _slot_size{(slot_size+sizeof(uint64_t)-1)/sizeof(uint64_t)*sizeof(uint64_t)} {
+        resize(capacity);
+    }
+
+    // Datagrams longer than slot_size are cut short. What was received is
+    // gone unless the size stays the same, which is then a no-op (and so is
+    // fine to call while going through the slots).
+    void set_slot_size(size_t slot_size) {
+        slot_size = (slot_size+sizeof(uint64_t)-1)/sizeof(uint64_t)*sizeof(uint64_t);
+        if (slot_size == _slot_size) return;
+        _slot_size = slot_size;
+        std::vector<uint64_t>().swap(_slots);
+        resize(_capacity);
+    }
+
+    void resize(size_t capacity) {
+        if (capacity == 0) capacity = 1;
+        _capacity = capacity;
+        _n = 0;
+        _slots.assign(capacity*_slot_size/sizeof(uint64_t), 0);
+        _msgs.resize(capacity);
+        _iovs.resize(capacity);
+        _addrs.resize(capacity);
+        _histogram.assign(capacity+1, 0);
+
+        for (size_t i=0; i<capacity; i++) {
+            _iovs[i].iov_base = slot(i);
+            _iovs[i].iov_len = _slot_size;
+        }
+    }
+
+    size_t capacity() {
+        return _capacity;
+    }
+
+    size_t size() {
+        return _n;
+    }
+
+    void* slot(size_t i) {
+        return (char*)_slots.data() + i*_slot_size;
+    }
+
+    // bytes actually received into slot i
+    size_t length(size_t i) {
+        return _msgs[i].msg_len;
+    }
+
+    const struct sockaddr_in& sender(size_t i) {
+        return _addrs[i];
+    }
+
+    // reads whatever is queued on fd, up to capacity() datagrams. Returns the
+    // number received, or -1 with errno set.
+    int receive(int fd) {
+        // the kernel overwrites msg_namelen (and we may have left garbage in
+        // msg_flags etc.), so the headers are reset every time
+        for (size_t i=0; i<_capacity; i++) {
+            struct mmsghdr& m = _msgs[i];
+            memset(&m, 0, sizeof(m));
+            m.msg_hdr.msg_iov = &_iovs[i];
+            m.msg_hdr.msg_iovlen = 1;
+            m.msg_hdr.msg_name = &_addrs[i];
+            m.msg_hdr.msg_namelen = sizeof(_addrs[i]);
+        }
+
+#ifdef __linux__
+        int n = recvmmsg(fd, _msgs.data(), _capacity, MSG_DONTWAIT, nullptr);
+#else
+        int n = 0;
+        ssize_t nb;
+        while (n < (int)_capacity and (nb = recvmsg(fd, &_msgs[n].msg_hdr, MSG_DONTWAIT)) != -1) {
+            _msgs[n++].msg_len = nb;
+        }
+        if (n == 0) n = -1;
+#endif
+        _n = n > 0 ? n : 0;
+        if (n > 0) _histogram[n]++;
+        return n;
+    }
+
+    void print_histogram(std::ostream& out, const std::string& label) {
+        print_batch_histogram(out, label, "recvmmsg", _histogram);
+    }
+};
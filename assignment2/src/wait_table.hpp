@@ -0,0 +1,139 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Which clients are waiting for which of a shard's chunks. Every (chunk,
+// client) pair is one node, linked into two lists at once: the chunk's
+// waiters and the client's chunks, so handing a chunk out and forgetting a
+// client both touch only the nodes involved. Nodes live in one vector and
+// are recycled through a free list, and the list heads are flat arrays
+// indexed by chunk and client id (chunk ids are dense, and so are client
+// ids, which are handed out from 0), so once warmed up nothing allocates.
+//
+// A shard owns the chunks with chunk_id % n_shards == shard, so it only
+// keeps heads for every n_shards-th chunk.
+class WaitTable {
+
+    // (an enum so that passing it by reference, to resize, needs no
+    // out of line definition)
+    enum : uint32_t { NONE = UINT32_MAX };
+
+    struct Node {
+        uint32_t chunk_id;
+        uint32_t client_id;
+        // siblings in the chunk's list and in the client's list
+        uint32_t prev_waiter, next_waiter;
+        uint32_t prev_chunk, next_chunk;
+    };
+
+    std::vector<Node> _nodes;
+    uint32_t _free = NONE;
+    size_t _size = 0;
+
+    std::vector<uint32_t> _chunk_head;
+    std::vector<uint32_t> _client_head;
+    uint32_t _n_shards = 1;
+
+    uint32_t& chunk_head(uint32_t chunk_id) {
+        size_t k = chunk_id/_n_shards;
+        if (k >= _chunk_head.size()) _chunk_head.resize(k+1, NONE);
+        return _chunk_head[k];
+    }
+
+    uint32_t& client_head(uint32_t client_id) {
+        if (client_id >= _client_head.size()) _client_head.resize(client_id+1, NONE);
+        return _client_head[client_id];
+    }
+
+    void unlink(uint32_t n) {
+        Node& node = _nodes[n];
+
+        if (node.prev_waiter != NONE) _nodes[node.prev_waiter].next_waiter = node.next_waiter;
+        else chunk_head(node.chunk_id) = node.next_waiter;
+        if (node.next_waiter != NONE) _nodes[node.next_waiter].prev_waiter = node.prev_waiter;
+
+        if (node.prev_chunk != NONE) _nodes[node.prev_chunk].next_chunk = node.next_chunk;
+        else client_head(node.client_id) = node.next_chunk;
+        if (node.next_chunk != NONE) _nodes[node.next_chunk].prev_chunk = node.prev_chunk;
+
+        node.next_waiter = _free;
+        _free = n;
+        _size--;
+    }
+
+public:
+
+    // room for chunk ids below tot_chunks and client ids below n_clients
+    // without growing; either may still show up later
+    void reserve(uint32_t tot_chunks, uint32_t n_shards, uint32_t n_clients) {
+        _n_shards = n_shards > 0 ? n_shards : 1;
+        _chunk_head.assign((tot_chunks+_n_shards-1)/_n_shards, NONE);
+        _client_head.assign(n_clients, NONE);
+        _nodes.clear();
+        _free = NONE;
+        _size = 0;
+    }
+
+    bool empty(uint32_t chunk_id) {
+        return chunk_head(chunk_id) == NONE;
+    }
+
+    // false if client_id was already waiting for chunk_id. A chunk rarely has
+    // more than a handful of waiters, so looking for it is a short walk.
+    bool add(uint32_t chunk_id, uint32_t client_id) {
+        uint32_t& head = chunk_head(chunk_id);
+        for (uint32_t n = head; n != NONE; n = _nodes[n].next_waiter) {
+            if (_nodes[n].client_id == client_id) return false;
+        }
+
+        uint32_t n;
+        if (_free != NONE) {
+            n = _free;
+            _free = _nodes[n].next_waiter;
+        }
+        else {
+            n = _nodes.size();
+            _nodes.emplace_back();
+        }
+        uint32_t& khead = client_head(client_id);
+        _nodes[n] = Node{ chunk_id, client_id, NONE, head, NONE, khead };
+        if (head != NONE) _nodes[head].prev_waiter = n;
+        if (khead != NONE) _nodes[khead].prev_chunk = n;
+        head = n;
+        khead = n;
+        _size++;
+        return true;
+    }
+
+    // calls f(client_id) for everyone waiting for chunk_id, which then has no
+    // waiters left
+    template<typename F>
+    void drain(uint32_t chunk_id, F f) {
+        uint32_t n = chunk_head(chunk_id);
+        while (n != NONE) {
+            uint32_t next = _nodes[n].next_waiter;
+            uint32_t client_id = _nodes[n].client_id;
+            unlink(n);
+            f(client_id);
+            n = next;
+        }
+    }
+
+    // client_id stops waiting for anything
+    void forget(uint32_t client_id) {
+        if (client_id >= _client_head.size()) return;
+        uint32_t n = _client_head[client_id];
+        while (n != NONE) {
+            uint32_t next = _nodes[n].next_chunk;
+            unlink(n);
+            n = next;
+        }
+    }
+
+    // (chunk, client) pairs waiting
+    size_t size() const {
+        return _size;
+    }
+};